@@ -0,0 +1,198 @@
+/*
+ * Microbenchmark of the TU and PBX APIs, with no network in the way.
+ *
+ * Each thread owns a number of pairs of TUs.  In each round, every thread
+ * registers its TUs, takes each pair through two complete calls (the first
+ * dialed with tu_dial(), the second with pbx_dial()), and unregisters them.
+ * The round is run in phases, one operation per phase (e.g. every A picks
+ * up, then every A dials its B), and the threads start and finish each
+ * phase together, so that each phase measures that operation running
+ * concurrently on every thread.  Only the phases are timed: creating TUs,
+ * reading back their notifications, and a first round run to warm up are
+ * not.
+ *
+ * Notifications go to /dev/null, or with "socketpair" to one end of a
+ * socket pair per thread, whose other end is drained between phases.
+ *
+ * The benchmark runs with 1, 2, ... up to the given number of threads, and
+ * reports, as JSON on standard output, the mean time per operation seen by
+ * each thread and the number of operations per second over all threads.
+ *
+ * Usage: api_bench [max threads] [rounds] [null|socketpair]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "lock.h"
+
+#define USAGE "usage: %s [max threads] [rounds] [null|socketpair]\n"
+
+/* Pairs of TUs per thread. */
+#define NPAIRS 512
+
+/* Socket buffer for notifications, enough for every phase of a round. */
+#define OUTBUF_SIZE (1 << 20)
+
+typedef enum {
+    OP_REGISTER, OP_PICKUP, OP_DIAL, OP_PBX_DIAL, OP_CHAT, OP_HANGUP, OP_UNREGISTER, NUM_OPS
+} OP;
+
+static char *op_names[] = {
+    "pbx_register", "tu_pickup", "tu_dial", "pbx_dial", "tu_chat", "tu_hangup", "pbx_unregister"
+};
+
+/* The phases of a round, in order. */
+typedef enum {
+    PH_REGISTER, PH_PICKUP_A, PH_DIAL, PH_ANSWER, PH_CHAT_A, PH_CHAT_B, PH_HANGUP_A, PH_HANGUP_B,
+    PH_PICKUP_A2, PH_PBX_DIAL, PH_ANSWER2, PH_HANGUP_A2, PH_HANGUP_B2, PH_UNREGISTER, NUM_PHASES
+} PHASE;
+
+static OP phase_ops[NUM_PHASES] = {
+    OP_REGISTER, OP_PICKUP, OP_DIAL, OP_PICKUP, OP_CHAT, OP_CHAT, OP_HANGUP, OP_HANGUP,
+    OP_PICKUP, OP_PBX_DIAL, OP_PICKUP, OP_HANGUP, OP_HANGUP, OP_UNREGISTER
+};
+
+static PBX *bench_pbx;
+static pthread_barrier_t barrier;
+static int nthreads, nrounds, use_socketpair, devnull;
+static double op_ns[NUM_OPS];           /* Wall-clock time in each operation */
+static unsigned long op_count[NUM_OPS];  /* Operations over all threads */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Read back whatever notifications are waiting on a socket.
+ */
+static void drain(int fd) {
+    char buf[65536];
+    while(recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+/*
+ * Carry out one phase on a thread's pairs.  Extension numbers are those of
+ * pbx_register(): A of pair i at base + 2i, and B at base + 2i + 1.
+ */
+static void run_phase(PHASE ph, TU **a, TU **b, int base) {
+    int i;
+    for(i=0; i<NPAIRS; i++){
+        switch(ph){
+            case PH_REGISTER:
+                pbx_register(bench_pbx, a[i], base + 2 * i);
+                pbx_register(bench_pbx, b[i], base + 2 * i + 1);
+                break;
+            case PH_PICKUP_A: case PH_PICKUP_A2: tu_pickup(a[i]); break;
+            case PH_DIAL: tu_dial(a[i], b[i]); break;
+            case PH_PBX_DIAL: pbx_dial(bench_pbx, a[i], base + 2 * i + 1); break;
+            case PH_ANSWER: case PH_ANSWER2: tu_pickup(b[i]); break;
+            case PH_CHAT_A: tu_chat(a[i], "hello"); break;
+            case PH_CHAT_B: tu_chat(b[i], "hello"); break;
+            case PH_HANGUP_A: case PH_HANGUP_A2: tu_hangup(a[i]); break;
+            case PH_HANGUP_B: case PH_HANGUP_B2: tu_hangup(b[i]); break;
+            case PH_UNREGISTER:
+                pbx_unregister(bench_pbx, a[i]);
+                pbx_unregister(bench_pbx, b[i]);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void *bench_thread(void *arg) {
+    long t = (long)arg;
+    TU *a[NPAIRS], *b[NPAIRS];
+    int sv[2] = { devnull, -1 }, bufsize = OUTBUF_SIZE;
+    int round, ph, i;
+    double t0 = 0;
+
+    if(use_socketpair){
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0){
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    }
+    // Round 0 warms up the allocators and the registry, and is not counted.
+    for(round=0; round<=nrounds; round++){
+        for(i=0; i<NPAIRS; i++){
+            a[i] = tu_init(sv[0]);
+            b[i] = tu_init(sv[0]);
+        }
+        for(ph=0; ph<NUM_PHASES; ph++){
+            pthread_barrier_wait(&barrier);
+            if(t == 0)
+                t0 = now_ns();
+            run_phase(ph, a, b, t * 2 * NPAIRS);
+            pthread_barrier_wait(&barrier);
+            if(t == 0 && round > 0){
+                op_ns[phase_ops[ph]] += now_ns() - t0;
+                op_count[phase_ops[ph]] += (ph == PH_REGISTER || ph == PH_UNREGISTER ? 2 : 1)
+                    * NPAIRS * nthreads;
+            }
+            if(use_socketpair)
+                drain(sv[1]);
+        }
+    }
+    if(use_socketpair){
+        close(sv[0]);
+        close(sv[1]);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int max = argc > 1 ? atoi(argv[1]) : 4;
+    pthread_t *tids;
+    int op, i, first = 1;
+
+    nrounds = argc > 2 ? atoi(argv[2]) : 50;
+    use_socketpair = argc > 3 && strcmp(argv[3], "socketpair") == 0;
+    if(max <= 0 || nrounds <= 0 || (argc > 3 && !use_socketpair && strcmp(argv[3], "null") != 0)
+       || (devnull = open("/dev/null", O_WRONLY)) < 0
+       || (tids = malloc(max * sizeof(pthread_t))) == NULL){
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    pbx_set_max_extensions(2 * NPAIRS * max);
+
+    printf("{\n  \"benchmark\": \"api_bench\",\n  \"lock\": \"%s\",\n  \"output\": \"%s\",\n"
+           "  \"pairs_per_thread\": %d,\n  \"rounds\": %d,\n  \"results\": [",
+           LOCK_NAME, use_socketpair ? "socketpair" : "null", NPAIRS, nrounds);
+    for(nthreads=1; nthreads<=max; nthreads++){
+        bench_pbx = pbx_init();
+        memset(op_ns, 0, sizeof(op_ns));
+        memset(op_count, 0, sizeof(op_count));
+        pthread_barrier_init(&barrier, NULL, nthreads);
+        for(i=0; i<nthreads; i++)
+            pthread_create(&tids[i], NULL, bench_thread, (void *)(long)i);
+        for(i=0; i<nthreads; i++)
+            pthread_join(tids[i], NULL);
+        pthread_barrier_destroy(&barrier);
+        pbx_shutdown(bench_pbx);
+
+        for(op=0; op<NUM_OPS; op++){
+            printf("%s\n    {\"threads\": %d, \"op\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.1f, "
+                   "\"ops_per_sec\": %.0f}", first ? "" : ",", nthreads, op_names[op], op_count[op],
+                   op_ns[op] * nthreads / op_count[op], op_count[op] / (op_ns[op] / 1e9));
+            first = 0;
+        }
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+    free(tids);
+    close(devnull);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/*
+ * Contention benchmark of the lock implementation (see lock.h).
+ *
+ * The Makefile builds this once for each implementation, as
+ * lock_bench_futex, lock_bench_pthread and lock_bench_sem, so that their
+ * results can be compared directly.  For each number of threads, three
+ * workloads are timed:
+ *
+ *   lock      Every thread increments a shared counter under a single lock.
+ *   dial      Every thread owns a registered TU, and repeatedly picks it up,
+ *             dials one of a few shared target extensions and hangs up.
+ *             Dialers collide on the targets' locks and on the calls they
+ *             set up.
+ *   register  Every thread registers and unregisters TUs of its own, which
+ *             serializes them on the PBX registry lock.
+ *
+ * TUs are given an invalid descriptor, so their output is discarded and
+ * only the cost of locking and of the transitions themselves is measured.
+ * The mean wall-clock time per operation is reported.
+ *
+ * Usage: lock_bench_<impl> [iterations] [max threads] [targets]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "lock.h"
+
+static int niters, ntargets;
+static PBX *bench_pbx;
+static LOCK counter_lock;
+static volatile unsigned long counter;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *lock_thread(void *arg) {
+    int i;
+    for(i=0; i<niters; i++){
+        lock_acquire(&counter_lock);
+        counter++;
+        lock_release(&counter_lock);
+    }
+    return NULL;
+}
+
+static void *dial_thread(void *arg) {
+    long t = (long)arg;
+    unsigned int seed = t + 1;
+    TU *tu = tu_init(-1);
+    int i;
+
+    tu_ref(tu, "bench");
+    pbx_register(bench_pbx, tu, ntargets + t);
+    for(i=0; i<niters; i++){
+        tu_pickup(tu);
+        pbx_dial(bench_pbx, tu, rand_r(&seed) % ntargets);
+        tu_hangup(tu);
+    }
+    pbx_unregister(bench_pbx, tu);
+    tu_unref(tu, "bench");
+    return NULL;
+}
+
+static void *register_thread(void *arg) {
+    long t = (long)arg;
+    TU *tu;
+    int i;
+
+    for(i=0; i<niters / 8; i++){
+        tu = tu_init(-1);
+        pbx_register(bench_pbx, tu, ntargets + t);
+        pbx_unregister(bench_pbx, tu);
+    }
+    return NULL;
+}
+
+/*
+ * Run a workload on a number of threads.
+ *
+ * @param ops  The number of operations performed by each thread.
+ * @return the mean time per operation, in nanoseconds.
+ */
+static double run(void *(*fn)(void *), int nthreads, long ops) {
+    pthread_t tids[nthreads];
+    double t0 = now_ns();
+    long i;
+    for(i=0; i<nthreads; i++)
+        pthread_create(&tids[i], NULL, fn, (void *)i);
+    for(i=0; i<nthreads; i++)
+        pthread_join(tids[i], NULL);
+    return (now_ns() - t0) / ((double)ops * nthreads);
+}
+
+int main(int argc, char *argv[]) {
+    int maxthreads, n, i;
+    TU **targets;
+
+    niters = argc > 1 ? atoi(argv[1]) : 100000;
+    maxthreads = argc > 2 ? atoi(argv[2]) : 16;
+    ntargets = argc > 3 ? atoi(argv[3]) : 4;
+    if(niters < 8 || maxthreads <= 0 || ntargets <= 0
+       || (targets = malloc(ntargets * sizeof(TU *))) == NULL){
+        fprintf(stderr, "usage: %s [iterations] [max threads] [targets]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    lock_init(&counter_lock, LOCK_CLASS_OTHER);
+    pbx_set_max_extensions(ntargets + maxthreads);
+    bench_pbx = pbx_init();
+    for(i=0; i<ntargets; i++){
+        targets[i] = tu_init(-1);
+        pbx_register(bench_pbx, targets[i], i);
+    }
+
+    printf("%s locks, %d iterations, %d dial targets\n", LOCK_NAME, niters, ntargets);
+    printf("%8s %14s %14s %14s\n", "threads", "lock ns/op", "dial ns/op", "register ns/op");
+    for(n=1; n<=maxthreads; n*=2){
+        printf("%8d", n);
+        printf(" %14.1f", run(lock_thread, n, niters));
+        printf(" %14.1f", run(dial_thread, n, niters * 3L));
+        printf(" %14.1f\n", run(register_thread, n, niters / 8 * 2L));
+    }
+
+    for(i=0; i<ntargets; i++)
+        pbx_unregister(bench_pbx, targets[i]);
+    pbx_shutdown(bench_pbx);
+    free(targets);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/*
+ * Microbenchmark of parsing client command lines.
+ *
+ * A fixed mix of lines (mostly dials and chats, as in a busy exchange, with
+ * some malformed ones) is parsed over and over by pbx_client_parse(), and
+ * by a copy of the strcmp/strncmp/strtol parser it replaced, which compares
+ * each line against tu_command_names[] in turn.  Only parsing is timed: no
+ * command is carried out.  The mean cost per line is reported.
+ *
+ * Usage: parse_bench [iterations]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pbx.h"
+#include "server_extra.h"
+
+static char *lines[] = {
+    "pickup",
+    "dial 17",
+    "chat hello there",
+    "chat how are you",
+    "dial 123456",
+    "hangup",
+    "chat",
+    "dial  42  ",
+    "pickup",
+    "chat the quick brown fox jumps over the lazy dog",
+    "hangup",
+    "dial x",
+    "chatter",
+    "",
+    "dial 5",
+    "hangup",
+};
+
+#define NLINES (sizeof(lines) / sizeof(lines[0]))
+
+/* Accumulates the results, so that the parsing is not optimized away. */
+static volatile unsigned long sink;
+
+/*
+ * The parser that pbx_client_dispatch() used to have.
+ */
+static TU_COMMAND old_parse(char *line, size_t len, char **msg, int *ext) {
+    char *endp;
+    size_t cmdlen;
+
+    if(strcmp(line, tu_command_names[TU_PICKUP_CMD]) == 0)
+        return TU_PICKUP_CMD;
+    else if(strcmp(line, tu_command_names[TU_HANGUP_CMD]) == 0)
+        return TU_HANGUP_CMD;
+    else if(strncmp(line, tu_command_names[TU_DIAL_CMD], (cmdlen = strlen(tu_command_names[TU_DIAL_CMD]))) == 0){
+        if(len > cmdlen+1 && line[cmdlen] == ' '){
+            *ext = (int)strtol(line+cmdlen+1, &endp, 10);
+            return TU_DIAL_CMD;
+        }
+    }
+    else if(strncmp(line, tu_command_names[TU_CHAT_CMD], (cmdlen = strlen(tu_command_names[TU_CHAT_CMD]))) == 0){
+        for(*msg=line+cmdlen; **msg==' '; (*msg)++)
+            ;
+        return TU_CHAT_CMD;
+    }
+    return TU_NO_CMD;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Parse every line a number of times.
+ *
+ * @return the mean time per line, in nanoseconds.
+ */
+static double run(TU_COMMAND (*parse)(char *, size_t, char **, int *), size_t *lens, int niters) {
+    double t0 = now_ns();
+    char *msg = NULL;
+    int i, l, ext = 0;
+
+    for(i=0; i<niters; i++){
+        for(l=0; l<NLINES; l++)
+            sink += parse(lines[l], lens[l], &msg, &ext) + ext + (msg != NULL);
+    }
+    return (now_ns() - t0) / ((double)niters * NLINES);
+}
+
+int main(int argc, char *argv[]) {
+    size_t lens[NLINES];
+    int niters, l;
+
+    niters = argc > 1 ? atoi(argv[1]) : 1000000;
+    if(niters <= 0){
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for(l=0; l<NLINES; l++)
+        lens[l] = strlen(lines[l]);
+
+    // Warm up, so that neither parser pays for faulting in the other's pages.
+    run(pbx_client_parse, lens, niters / 10 + 1);
+    run(old_parse, lens, niters / 10 + 1);
+
+    printf("%d iterations of %zu lines\n", niters, NLINES);
+    printf("%-16s %10s\n", "parser", "ns/line");
+    printf("%-16s %10.2f\n", "single pass", run(pbx_client_parse, lens, niters));
+    printf("%-16s %10.2f\n", "strcmp/strtol", run(old_parse, lens, niters));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,405 @@
+/*
+ * Discrete-event simulation of telephone traffic through the PBX, for
+ * capacity planning.
+ *
+ * The real TU and PBX modules are driven in process, with no sockets:
+ * every TU is created with tu_init_sink() and its notifications go to an
+ * in-memory sink, which keeps the state they announce.  Time is virtual:
+ * events are taken from a heap in time order and the clock jumps from one
+ * to the next, so hours of traffic take only as long as the API calls made.
+ *
+ * The PBX serves a group of circuits: one agent TU per circuit.  Calls
+ * arrive as a Poisson process; each is a new TU that registers, picks up
+ * and dials the agent that has been idle longest.  The agent answers after
+ * the answer delay, and the call is released (the caller hangs up, then the
+ * agent) after a holding time drawn from an exponential distribution, or
+ * fixed with -d const.  A circuit is busy from the dial until its release.
+ * A call that arrives when every circuit is busy dials a busy agent, gets
+ * a busy signal, and is lost, as in the Erlang B model.  The offered load
+ * is A = arrival rate * (answer delay + mean holding time), in Erlangs.
+ *
+ * After each API call, the states announced to the TUs concerned are
+ * checked against what the model expects, e.g. that a dial to an idle
+ * agent rings back and one to a busy agent does not; any difference is
+ * counted as an error, and makes the exit status nonzero.
+ *
+ * Reported are the blocking probability, against the Erlang B formula for
+ * A and the number of circuits; the carried load (mean calls in progress
+ * while calls are arriving), against A(1 - B); the peak number of calls in
+ * progress; and the CPU time per call offered, which includes the work of
+ * the sinks and the simulation itself.
+ *
+ * Usage: pbx_sim [-c <circuits>] [-e <offered Erlangs>] [-H <mean holding s>]
+ *                [-a <answer delay s>] [-d exp|const] [-n <calls>] [-s <seed>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "tu_fsm.h"
+
+#define USAGE "usage: %s [-c <circuits>] [-e <offered Erlangs>] [-H <mean holding s>]" \
+              " [-a <answer delay s>] [-d exp|const] [-n <calls>] [-s <seed>]\n"
+
+/* What a TU's sink has seen. */
+typedef struct sim_line {
+    TU_STATE state;             /* As last announced */
+    int bad;                    /* Set if a notification named no state */
+}SIM_LINE;
+
+/* An agent: the TU answering one circuit. */
+typedef struct sim_agent {
+    TU *tu;
+    int ext;
+    SIM_LINE line;
+}SIM_AGENT;
+
+/* A call, from its arrival until its release. */
+typedef struct sim_call {
+    TU *tu;                     /* The caller */
+    int ext;
+    SIM_LINE line;
+    SIM_AGENT *agent;
+    double hold;                /* Holding time, once answered */
+}SIM_CALL;
+
+typedef enum { EV_ARRIVAL, EV_ANSWER, EV_RELEASE } SIM_EVENT_TYPE;
+
+typedef struct sim_event {
+    double t;
+    SIM_EVENT_TYPE type;
+    SIM_CALL *call;
+}SIM_EVENT;
+
+static PBX *sim_pbx;
+static int ncircuits = 100;
+static double offered = 90, mean_hold = 180, answer_delay = 0;
+static int const_hold;
+
+static SIM_AGENT *agents;
+static SIM_AGENT **idle;        /* Idle agents, longest idle first, in a ring */
+static int idle_head, nidle;
+static SIM_CALL **free_calls;   /* Calls not in progress */
+static int nfree;
+
+static SIM_EVENT *heap;
+static int nevents;
+static double now;
+
+static uint64_t rng_state;
+static size_t state_name_len[TU_NUM_STATES];
+static unsigned long notifications, out_bytes, api_calls, errors;
+
+/*
+ * Uniform random number in (0, 1), from xorshift64*.
+ */
+static double sim_uniform(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545F4914F6CDD1DULL >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double sim_exponential(double mean) {
+    return -log(sim_uniform()) * mean;
+}
+
+/*
+ * Blocking probability of the Erlang B formula, by its recurrence.
+ *
+ * @param a  The offered load, in Erlangs.
+ * @param c  The number of circuits.
+ */
+static double erlang_b(double a, int c) {
+    double b = 1;
+    int k;
+    for(k=1; k<=c; k++)
+        b = a * b / (k + a * b);
+    return b;
+}
+
+/*
+ * Sink for the notifications of one TU: note the state each announces.
+ */
+static ssize_t sim_sink_write(void *arg, const char *buf, size_t len) {
+    SIM_LINE *line = arg;
+    const char *p = buf, *end = buf + len, *eol, *nl;
+    TU_STATE s;
+
+    out_bytes += len;
+    for(; p < end; p = nl + 1){
+        if((nl = memchr(p, '\n', end - p)) == NULL)
+            nl = end - 1;
+        eol = nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+        notifications++;
+        for(s=0; s<TU_NUM_STATES; s++){
+            if((size_t)(eol - p) >= state_name_len[s] && memcmp(p, tu_state_names[s], state_name_len[s]) == 0
+               && (p + state_name_len[s] == eol || p[state_name_len[s]] == ' '))
+                break;
+        }
+        if(s < TU_NUM_STATES)
+            line->state = s;
+        else if(eol - p < 4 || memcmp(p, "CHAT", 4) != 0)
+            line->bad = 1;
+    }
+    return len;
+}
+
+/*
+ * Count an error unless a TU's sink has been told it is in a given state.
+ */
+static void sim_expect(SIM_LINE *line, TU_STATE s) {
+    if(line->state != s || line->bad){
+        errors++;
+        line->bad = 0;
+    }
+}
+
+/*
+ * Count an API call, and an error if it failed.
+ */
+static void sim_api(int ret) {
+    api_calls++;
+    if(ret < 0)
+        errors++;
+}
+
+/*
+ * Binary heap of pending events, by time.
+ */
+static void sim_schedule(double t, SIM_EVENT_TYPE type, SIM_CALL *call) {
+    int i = nevents++, p;
+    while(i > 0 && heap[p = (i - 1) / 2].t > t){
+        heap[i] = heap[p];
+        i = p;
+    }
+    heap[i] = (SIM_EVENT){ t, type, call };
+}
+
+static SIM_EVENT sim_next(void) {
+    SIM_EVENT top = heap[0], last = heap[--nevents];
+    int i = 0, c;
+    while((c = 2 * i + 1) < nevents){
+        if(c + 1 < nevents && heap[c + 1].t < heap[c].t)
+            c++;
+        if(last.t <= heap[c].t)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void idle_push(SIM_AGENT *a) {
+    idle[(idle_head + nidle++) % ncircuits] = a;
+}
+
+static SIM_AGENT *idle_pop(void) {
+    SIM_AGENT *a = idle[idle_head];
+    idle_head = (idle_head + 1) % ncircuits;
+    nidle--;
+    return a;
+}
+
+static TU *sim_tu(SIM_LINE *line, int ext) {
+    TU_SINK sink = { sim_sink_write, line };
+    TU *tu;
+    line->state = TU_ERROR;
+    line->bad = 0;
+    if((tu = tu_init_sink(-1, &sink)) == NULL || pbx_register(sim_pbx, tu, ext) < 0){
+        fprintf(stderr, "Failed to register extension %d\n", ext);
+        exit(EXIT_FAILURE);
+    }
+    api_calls += 2;
+    sim_expect(line, TU_ON_HOOK);
+    return tu;
+}
+
+/*
+ * A call arrives: dial the longest-idle agent, or, if every circuit is
+ * busy, any agent, which should give a busy signal.
+ *
+ * @return 1 if the call was lost, otherwise 0.
+ */
+static int sim_arrival(SIM_CALL *call) {
+    SIM_AGENT *agent;
+
+    call->tu = sim_tu(&call->line, call->ext);
+    sim_api(tu_pickup(call->tu));
+    sim_expect(&call->line, TU_DIAL_TONE);
+    if(nidle > 0){
+        agent = idle_pop();
+        sim_api(pbx_dial(sim_pbx, call->tu, agent->ext));
+        sim_expect(&call->line, TU_RING_BACK);
+        sim_expect(&agent->line, TU_RINGING);
+        call->agent = agent;
+        call->hold = const_hold ? mean_hold : sim_exponential(mean_hold);
+        sim_schedule(now + answer_delay, EV_ANSWER, call);
+        return 0;
+    }
+    agent = &agents[(int)(sim_uniform() * ncircuits)];
+    sim_api(pbx_dial(sim_pbx, call->tu, agent->ext));
+    sim_expect(&call->line, TU_BUSY_SIGNAL);
+    sim_api(tu_hangup(call->tu));
+    sim_expect(&call->line, TU_ON_HOOK);
+    sim_api(pbx_unregister(sim_pbx, call->tu));
+    free_calls[nfree++] = call;
+    return 1;
+}
+
+static void sim_answer(SIM_CALL *call) {
+    sim_api(tu_pickup(call->agent->tu));
+    sim_expect(&call->agent->line, TU_CONNECTED);
+    sim_expect(&call->line, TU_CONNECTED);
+    sim_schedule(now + call->hold, EV_RELEASE, call);
+}
+
+static void sim_release(SIM_CALL *call) {
+    SIM_AGENT *agent = call->agent;
+
+    sim_api(tu_hangup(call->tu));
+    sim_expect(&call->line, TU_ON_HOOK);
+    sim_expect(&agent->line, TU_DIAL_TONE);
+    sim_api(tu_hangup(agent->tu));
+    sim_expect(&agent->line, TU_ON_HOOK);
+    sim_api(pbx_unregister(sim_pbx, call->tu));
+    idle_push(agent);
+    free_calls[nfree++] = call;
+}
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long ncalls = 1000000, arrived = 0, lost = 0;
+    int opt, i, busy = 0, peak = 0;
+    unsigned long seed = 1;
+    double rate, area = 0, last = 0, cpu, b;
+    SIM_CALL *calls;
+    SIM_EVENT ev;
+
+    while((opt = getopt(argc, argv, "c:e:H:a:d:n:s:")) != -1){
+        switch(opt){
+            case 'c': ncircuits = atoi(optarg); break;
+            case 'e': offered = atof(optarg); break;
+            case 'H': mean_hold = atof(optarg); break;
+            case 'a': answer_delay = atof(optarg); break;
+            case 'n': ncalls = atol(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'd':
+                if(strcmp(optarg, "const") == 0 || strcmp(optarg, "exp") == 0){
+                    const_hold = strcmp(optarg, "const") == 0;
+                    break;
+                }
+                // Fall through.
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(ncircuits <= 0 || offered <= 0 || mean_hold <= 0 || answer_delay < 0 || ncalls <= 0){
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    rate = offered / (answer_delay + mean_hold);
+    rng_state = seed ? seed : 1;
+    for(i=0; i<TU_NUM_STATES; i++)
+        state_name_len[i] = strlen(tu_state_names[i]);
+
+    // Agents take the first extensions, and calls those after; at most one
+    // call more than there are circuits is in progress at any time.
+    agents = calloc(ncircuits, sizeof(SIM_AGENT));
+    idle = calloc(ncircuits, sizeof(SIM_AGENT *));
+    calls = calloc(ncircuits + 1, sizeof(SIM_CALL));
+    free_calls = calloc(ncircuits + 1, sizeof(SIM_CALL *));
+    heap = calloc(ncircuits + 2, sizeof(SIM_EVENT));
+    if(agents == NULL || idle == NULL || calls == NULL || free_calls == NULL || heap == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if(2 * ncircuits + 1 > PBX_DEFAULT_MAX_EXTENSIONS)
+        pbx_set_max_extensions(2 * ncircuits + 1);
+    if((sim_pbx = pbx_init()) == NULL){
+        fprintf(stderr, "Failed to initialize the PBX\n");
+        return EXIT_FAILURE;
+    }
+    for(i=0; i<ncircuits; i++){
+        agents[i].ext = i;
+        agents[i].tu = sim_tu(&agents[i].line, i);
+        idle_push(&agents[i]);
+    }
+    for(i=0; i<=ncircuits; i++){
+        calls[i].ext = ncircuits + i;
+        free_calls[nfree++] = &calls[i];
+    }
+
+    cpu = cpu_seconds();
+    sim_schedule(sim_exponential(1 / rate), EV_ARRIVAL, NULL);
+    while(nevents > 0){
+        ev = sim_next();
+        // The carried load is measured only while calls are arriving.
+        if(arrived < ncalls){
+            area += busy * (ev.t - last);
+            last = ev.t;
+        }
+        now = ev.t;
+        switch(ev.type){
+            case EV_ARRIVAL:
+                arrived++;
+                if(sim_arrival(free_calls[--nfree]))
+                    lost++;
+                else if(++busy > peak)
+                    peak = busy;
+                if(arrived < ncalls)
+                    sim_schedule(now + sim_exponential(1 / rate), EV_ARRIVAL, NULL);
+                break;
+            case EV_ANSWER:
+                sim_answer(ev.call);
+                break;
+            case EV_RELEASE:
+                sim_release(ev.call);
+                busy--;
+                break;
+        }
+    }
+    for(i=0; i<ncircuits; i++)
+        sim_api(pbx_unregister(sim_pbx, agents[i].tu));
+    cpu = cpu_seconds() - cpu;
+    pbx_shutdown(sim_pbx);
+
+    b = erlang_b(offered, ncircuits);
+    printf("%d circuits, offered %.2f Erlangs (%.4f calls/s, holding %s %.1f s, answer %.1f s), seed %lu\n",
+           ncircuits, offered, rate, const_hold ? "const" : "exp", mean_hold, answer_delay, seed);
+    printf("%-22s %14ld\n", "calls offered", arrived);
+    printf("%-22s %14ld\n", "calls carried", arrived - lost);
+    printf("%-22s %14ld\n", "calls lost", lost);
+    printf("%-22s %14.6f\n", "blocking", (double)lost / arrived);
+    printf("%-22s %14.6f\n", "blocking (Erlang B)", b);
+    printf("%-22s %14.3f\n", "carried Erlangs", area / last);
+    printf("%-22s %14.3f\n", "carried (A(1-B))", offered * (1 - b));
+    printf("%-22s %14d\n", "peak calls", peak);
+    printf("%-22s %14.1f\n", "virtual hours", now / 3600);
+    printf("%-22s %14lu\n", "api calls", api_calls);
+    printf("%-22s %14lu\n", "notifications", notifications);
+    printf("%-22s %14lu\n", "notification bytes", out_bytes);
+    printf("%-22s %14.3f\n", "cpu s", cpu);
+    printf("%-22s %14.3f\n", "cpu us per call", cpu * 1e6 / arrived);
+    printf("%-22s %14.1f\n", "cpu ns per api call", cpu * 1e9 / api_calls);
+    printf("%-22s %14lu\n", "errors", errors);
+    free(agents);
+    free(idle);
+    free(calls);
+    free(free_calls);
+    free(heap);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,91 @@
+/*
+ * Benchmark of PBX registry operations as the registry grows.
+ *
+ * For each table size N, N TUs are registered, then random extensions are
+ * dialed from on-hook TUs (so that each dial is a lookup plus a state
+ * notification), then all TUs are unregistered.  The mean cost of each
+ * operation is reported.  All TUs write their notifications to /dev/null.
+ *
+ * Dials are spread over the given number of threads, each dialing from its
+ * own TU, and the dial cost is wall-clock time divided by total dials.
+ *
+ * Usage: registry_bench [max size] [dial threads]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pbx.h"
+#include "pbx_extra.h"
+
+#define NDIALS 200000
+
+static PBX *bench_pbx;
+static TU **tus;
+static int size, nthreads;
+
+static void *dial_thread(void *arg) {
+    long t = (long)arg;
+    unsigned int seed = t + 1;
+    int i;
+    for(i=0; i<NDIALS/nthreads; i++)
+        pbx_dial(bench_pbx, tus[t % size], rand_r(&seed) % size);
+    return NULL;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    int max = argc > 1 ? atoi(argv[1]) : 262144;
+    int devnull = open("/dev/null", O_WRONLY);
+    pthread_t *tids;
+    double t0, reg_ns, dial_ns, unreg_ns;
+    int n, i;
+
+    nthreads = argc > 2 ? atoi(argv[2]) : 1;
+    if(devnull < 0 || max <= 0 || nthreads <= 0 || (tus = malloc(max * sizeof(TU *))) == NULL
+       || (tids = malloc(nthreads * sizeof(pthread_t))) == NULL){
+        fprintf(stderr, "usage: %s [max size] [dial threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    pbx_set_max_extensions(max);
+    printf("%d dial threads\n", nthreads);
+
+    printf("%10s %14s %14s %14s\n", "size", "register ns", "dial ns", "unregister ns");
+    for(n=PBX_CHUNK_SIZE; n<=max; n*=4){
+        PBX *p = bench_pbx = pbx_init();
+        size = n;
+
+        t0 = now_ns();
+        for(i=0; i<n; i++){
+            tus[i] = tu_init(devnull);
+            pbx_register(p, tus[i], i);
+        }
+        reg_ns = (now_ns() - t0) / n;
+
+        t0 = now_ns();
+        for(i=0; i<nthreads; i++)
+            pthread_create(&tids[i], NULL, dial_thread, (void *)(long)i);
+        for(i=0; i<nthreads; i++)
+            pthread_join(tids[i], NULL);
+        dial_ns = (now_ns() - t0) / (NDIALS / nthreads * nthreads);
+
+        t0 = now_ns();
+        for(i=0; i<n; i++)
+            pbx_unregister(p, tus[i]);
+        unreg_ns = (now_ns() - t0) / n;
+
+        pbx_shutdown(p);
+        printf("%10d %14.1f %14.1f %14.1f\n", n, reg_ns, dial_ns, unreg_ns);
+    }
+    free(tus);
+    free(tids);
+    return EXIT_SUCCESS;
+}
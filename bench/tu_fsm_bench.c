@@ -0,0 +1,106 @@
+/*
+ * Microbenchmark of TU state transitions.
+ *
+ * Pairs of TUs are driven through complete calls: A picks up and dials B,
+ * B answers, each chats once, and both hang up.  A second mix issues only
+ * commands that leave the state unchanged (pickup and dial while connected).
+ * The mean cost per TU operation is reported.
+ *
+ * Each mix is run twice: once with notifications written to /dev/null, and
+ * once with TUs whose output has been discarded (they are given an invalid
+ * descriptor, so the first write fails and no more are attempted), which
+ * leaves only the cost of locking and of the transitions themselves.
+ *
+ * Usage: tu_fsm_bench [calls] [threads]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pbx.h"
+
+static int ncalls, nthreads, outfd;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *call_thread(void *arg) {
+    TU *a = tu_init(outfd), *b = tu_init(outfd);
+    int i;
+    tu_ref(a, "bench");
+    tu_ref(b, "bench");
+    for(i=0; i<ncalls; i++){
+        tu_pickup(a);
+        tu_dial(a, b);
+        tu_pickup(b);
+        tu_chat(a, "hello");
+        tu_chat(b, "hello");
+        tu_hangup(a);
+        tu_hangup(b);
+    }
+    tu_unref(a, "bench");
+    tu_unref(b, "bench");
+    return NULL;
+}
+
+static void *noop_thread(void *arg) {
+    TU *a = tu_init(outfd), *b = tu_init(outfd);
+    int i;
+    tu_ref(a, "bench");
+    tu_ref(b, "bench");
+    tu_pickup(a);
+    tu_dial(a, b);
+    tu_pickup(b);
+    for(i=0; i<ncalls; i++){
+        tu_pickup(a);
+        tu_dial(a, b);
+        tu_pickup(b);
+        tu_dial(b, a);
+        tu_pickup(a);
+        tu_pickup(b);
+        tu_dial(a, a);
+    }
+    tu_hangup(a);
+    tu_hangup(b);
+    tu_unref(a, "bench");
+    tu_unref(b, "bench");
+    return NULL;
+}
+
+static double run(void *(*fn)(void *)) {
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    double t0 = now_ns();
+    int i;
+    for(i=0; i<nthreads; i++)
+        pthread_create(&tids[i], NULL, fn, NULL);
+    for(i=0; i<nthreads; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return (now_ns() - t0) / ((double)ncalls * 7 * nthreads);
+}
+
+int main(int argc, char *argv[]) {
+    int devnull = open("/dev/null", O_WRONLY);
+
+    ncalls = argc > 1 ? atoi(argv[1]) : 200000;
+    nthreads = argc > 2 ? atoi(argv[2]) : 1;
+    if(devnull < 0 || ncalls <= 0 || nthreads <= 0){
+        fprintf(stderr, "usage: %s [calls] [threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("%d threads, %d iterations of 7 operations each\n", nthreads, ncalls);
+    printf("%-12s %14s %14s\n", "output", "call ns/op", "no-op ns/op");
+    outfd = devnull;
+    printf("%-12s %14.1f", "/dev/null", run(call_thread));
+    printf(" %14.1f\n", run(noop_thread));
+    outfd = -1;
+    printf("%-12s %14.1f", "discarded", run(call_thread));
+    printf(" %14.1f\n", run(noop_thread));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Capture of client traffic, for replay by pbx_replay.
+ *
+ * When enabled, the server appends a record to a binary log for every
+ * connection made and closed, every line received from a client, and
+ * every notification written to one.  Notifications are recorded as the
+ * TU's queue is taken for writing, after the TU's locks are released, so
+ * recording never holds up a TU.  Each record carries the time, from
+ * CLOCK_MONOTONIC in nanoseconds since the capture began, and the id of
+ * the connection, numbered from 1 in order of connection, so that a
+ * descriptor reused by a later client gets a new id.
+ *
+ * The log is a header followed by records, each a fixed-size header and
+ * then len bytes of text: the line or notification, without its EOL.  All
+ * fields are in host byte order.  Records are written in time order, under
+ * a single lock, into a buffer that is flushed when it fills and when the
+ * capture stops.
+ */
+#define CAPTURE_MAGIC 0x50425843        /* "PBXC" */
+#define CAPTURE_VERSION 1
+
+typedef enum {
+    CAPTURE_CONNECT = 1, CAPTURE_COMMAND, CAPTURE_NOTIFY, CAPTURE_DISCONNECT
+} CAPTURE_TYPE;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t start_ns;          /* CLOCK_REALTIME when the capture began */
+} CAPTURE_HEADER;
+
+typedef struct {
+    uint64_t ns;                /* Time since the capture began */
+    uint32_t conn;              /* Connection id */
+    uint16_t len;               /* Length of the text that follows */
+    uint8_t type;               /* CAPTURE_TYPE */
+    uint8_t reserved;
+} CAPTURE_RECORD;
+
+/* Texts longer than this are truncated. */
+#define CAPTURE_MAX_TEXT UINT16_MAX
+
+typedef struct capture CAPTURE;
+
+/* The capture, if one is being made. */
+extern CAPTURE *capture;
+
+int capture_init(char *path);
+void capture_stop(void);
+void capture_connect(int fd);
+void capture_disconnect(int fd);
+void capture_command(int fd, const char *line, size_t len);
+void capture_notify(int fd, const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef CMDSTAT_H
+#define CMDSTAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "server.h"
+#include "tu_fsm.h"
+#include "hist.h"
+
+/*
+ * Latency of client commands, measured by pbx_client_dispatch() from the
+ * time a line has been framed to the time its command returns, by which
+ * time its notifications have been written (or queued, for a client whose
+ * socket is full).  Latencies are in nanoseconds.
+ *
+ * Threads record into one of a fixed number of sets of histograms, one
+ * histogram per command, which are merged when the statistics are read.
+ */
+static inline uint64_t cmdstat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void cmdstat_record(TU_COMMAND cmd, uint64_t ns);
+void cmdstat_collect(TU_COMMAND cmd, HIST *h);
+int cmdstat_dump(FILE *out);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Readers bracket lock-free accesses to shared objects with epoch_enter()
+ * and epoch_exit().  A writer that unlinks an object passes it to
+ * epoch_retire(), and the object's release function is called only once
+ * every reader that might still hold a pointer to it has left its
+ * critical section.  Critical sections must not nest.  They may block,
+ * but a blocked reader holds up the release of all retired objects.
+ */
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void (*release)(void *), void *obj);
+void epoch_barrier(void);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Log-bucketed histogram of 64-bit values, in the style of HDR histograms.
+ *
+ * Values below HIST_SUB each have their own bucket.  Above that, every
+ * power of two is split into HIST_SUB equal sub-buckets, so a value is
+ * known to within 1/HIST_SUB of itself (12.5%) over the whole range.
+ *
+ * A histogram is meant to be written by a single thread and read, possibly
+ * concurrently, by others: counters are atomic but are updated without
+ * read-modify-write operations, so readers see each counter whole but not
+ * necessarily a consistent snapshot of all of them.  Histograms of several
+ * threads are combined with hist_merge().  A histogram that several threads
+ * must share is instead written with hist_record_shared().
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    atomic_ulong count;
+    atomic_ulong sum;
+    atomic_ulong max;
+    atomic_ulong buckets[HIST_BUCKETS];
+} HIST;
+
+/*
+ * Get the bucket in which a value is counted.
+ */
+static inline int hist_bucket(uint64_t v) {
+    int e;
+    if(v < HIST_SUB)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_inc(atomic_ulong *c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*
+ * Record a value in a histogram.  Only one thread may record in a given
+ * histogram.
+ */
+static inline void hist_record(HIST *h, uint64_t v) {
+    hist_inc(&h->buckets[hist_bucket(v)], 1);
+    hist_inc(&h->count, 1);
+    hist_inc(&h->sum, v);
+    if(v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+/*
+ * Record a value in a histogram in which other threads may be recording
+ * at the same time.
+ */
+static inline void hist_record_shared(HIST *h, uint64_t v) {
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[hist_bucket(v)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+    while(v > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, v,
+                                                           memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void hist_reset(HIST *h);
+void hist_merge(HIST *into, HIST *from);
+uint64_t hist_bucket_limit(int b);
+uint64_t hist_quantile(HIST *h, double q);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Per-connection buffered line reader.
+ *
+ * Input from the client is read in large chunks into a fixed buffer and
+ * lines are located in place.  A line is handed back as a pointer into the
+ * buffer together with its length; the EOL sequence is stripped and replaced
+ * by a NUL byte, so the line may also be used as a C string.  The view stays
+ * valid only until the next call on the same LINEBUF.
+ *
+ * A line that does not fit in the buffer is discarded up to and including
+ * its terminating newline.
+ *
+ * Setting MSG_DONTWAIT in rdflags makes linebuf_fill() return -1 with errno
+ * set to EAGAIN instead of blocking, for use with an event loop.
+ */
+#define LINEBUF_SIZE 4096
+
+typedef struct linebuf{
+    int fd;
+    int rdflags;    /* Flags passed to recv(), e.g. MSG_DONTWAIT. */
+    size_t head;    /* Offset of first unconsumed byte. */
+    size_t tail;    /* Offset one past the last buffered byte. */
+    size_t scan;    /* Offset from which to resume the search for '\n'. */
+    int discard;    /* Set while skipping the remainder of an overlong line. */
+    char buf[LINEBUF_SIZE];
+}LINEBUF;
+
+void linebuf_init(LINEBUF *lb, int fd);
+ssize_t linebuf_fill(LINEBUF *lb);
+int linebuf_next(LINEBUF *lb, char **line, size_t *len);
+ssize_t linebuf_readline(LINEBUF *lb, char **line);
+
+#endif
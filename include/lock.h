@@ -0,0 +1,192 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Mutual-exclusion lock used for the PBX registry and for TUs.
+ *
+ * The implementation is chosen at build time (make LOCK=...):
+ *   LOCK_FUTEX    (default) Adaptive lock: a waiter spins for a while, then
+ *                 sleeps on a futex.  The spin limit of each lock follows the
+ *                 time it has recently taken to acquire it.
+ *   LOCK_PTHREAD  A default pthread mutex.
+ *   LOCK_SEM      A POSIX semaphore used with the csapp P/V wrappers.
+ *
+ * A lock must be released by the thread that acquired it.  None of them is
+ * recursive.  The uncontended paths are inline; only waiting and waking go
+ * through lock.c.
+ *
+ * Every lock belongs to a class.  When built with LOCK_STATS (make
+ * lockstats), the time spent waiting for and holding the locks of each class
+ * is recorded in histograms (see lockstat.c); otherwise the class is ignored
+ * and the instrumentation compiles to nothing.
+ */
+#if !defined(LOCK_FUTEX) && !defined(LOCK_PTHREAD) && !defined(LOCK_SEM)
+#define LOCK_FUTEX
+#endif
+
+typedef enum {
+    LOCK_CLASS_REGISTRY,    /* The PBX registry */
+    LOCK_CLASS_TU,          /* A TU that is not in a call */
+    LOCK_CLASS_CALL,        /* A call, guarding the TUs at both ends */
+    LOCK_CLASS_OTHER,
+    LOCK_NUM_CLASSES
+} LOCK_CLASS;
+
+#if defined(LOCK_FUTEX)
+
+#include <stdatomic.h>
+
+#define LOCK_NAME "futex"
+#define LOCK_SPIN_MIN 16
+#define LOCK_SPIN_MAX 1024
+
+typedef struct {
+    atomic_int state;   /* 0 unlocked, 1 locked, 2 locked with sleepers */
+    atomic_int spin;    /* Recent number of spins needed to acquire */
+} LOCK_RAW;
+
+void lock_wait(LOCK_RAW *lk);
+void lock_wake(LOCK_RAW *lk);
+
+static inline void lock_raw_init(LOCK_RAW *lk) {
+    atomic_init(&lk->state, 0);
+    atomic_init(&lk->spin, LOCK_SPIN_MIN);
+}
+
+static inline int lock_raw_try(LOCK_RAW *lk) {
+    int c = 0;
+    return atomic_compare_exchange_strong_explicit(&lk->state, &c, 1,
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+static inline void lock_raw_acquire(LOCK_RAW *lk) {
+    if(!lock_raw_try(lk))
+        lock_wait(lk);
+}
+
+static inline void lock_raw_release(LOCK_RAW *lk) {
+    if(atomic_exchange_explicit(&lk->state, 0, memory_order_release) == 2)
+        lock_wake(lk);
+}
+
+#elif defined(LOCK_PTHREAD)
+
+#include <pthread.h>
+
+#define LOCK_NAME "pthread"
+
+typedef pthread_mutex_t LOCK_RAW;
+
+static inline void lock_raw_init(LOCK_RAW *lk) {
+    pthread_mutex_init(lk, NULL);
+}
+
+static inline int lock_raw_try(LOCK_RAW *lk) {
+    return pthread_mutex_trylock(lk) == 0;
+}
+
+static inline void lock_raw_acquire(LOCK_RAW *lk) {
+    pthread_mutex_lock(lk);
+}
+
+static inline void lock_raw_release(LOCK_RAW *lk) {
+    pthread_mutex_unlock(lk);
+}
+
+#else
+
+#include <semaphore.h>
+#include "csapp.h"
+
+#define LOCK_NAME "sem"
+
+typedef sem_t LOCK_RAW;
+
+static inline void lock_raw_init(LOCK_RAW *lk) {
+    sem_init(lk, 0, 1);
+}
+
+static inline int lock_raw_try(LOCK_RAW *lk) {
+    return sem_trywait(lk) == 0;
+}
+
+static inline void lock_raw_acquire(LOCK_RAW *lk) {
+    P(lk);
+}
+
+static inline void lock_raw_release(LOCK_RAW *lk) {
+    V(lk);
+}
+
+#endif
+
+#ifdef LOCK_STATS
+
+#include "lockstat.h"
+
+typedef struct {
+    LOCK_RAW raw;
+    LOCK_CLASS cls;
+    uint64_t since;     /* Time at which the holder acquired the lock */
+} LOCK;
+
+static inline void lock_init(LOCK *lk, LOCK_CLASS cls) {
+    lock_raw_init(&lk->raw);
+    lk->cls = cls;
+}
+
+static inline int lock_try(LOCK *lk) {
+    if(!lock_raw_try(&lk->raw))
+        return 0;
+    lk->since = lockstat_now();
+    lockstat_acquired(lk->cls, 0, 0);
+    return 1;
+}
+
+static inline void lock_acquire(LOCK *lk) {
+    uint64_t t0 = lockstat_now(), t1;
+    if(lock_raw_try(&lk->raw)){
+        lk->since = t0;
+        lockstat_acquired(lk->cls, 0, 0);
+        return;
+    }
+    lock_raw_acquire(&lk->raw);
+    lk->since = t1 = lockstat_now();
+    lockstat_acquired(lk->cls, t1 - t0, 1);
+}
+
+static inline void lock_release(LOCK *lk) {
+    uint64_t held = lockstat_now() - lk->since;
+    LOCK_CLASS cls = lk->cls;
+    lock_raw_release(&lk->raw);
+    lockstat_released(cls, held);
+}
+
+#else
+
+typedef LOCK_RAW LOCK;
+
+static inline void lock_init(LOCK *lk, LOCK_CLASS cls) {
+    lock_raw_init(lk);
+}
+
+static inline int lock_try(LOCK *lk) {
+    return lock_raw_try(lk);
+}
+
+static inline void lock_acquire(LOCK *lk) {
+    lock_raw_acquire(lk);
+}
+
+static inline void lock_release(LOCK *lk) {
+    lock_raw_release(lk);
+}
+
+#endif
+
+int lockstat_dump(FILE *out);
+
+#endif
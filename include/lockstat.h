@@ -0,0 +1,46 @@
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hist.h"
+
+/*
+ * Lock wait and hold time statistics, collected per lock class when built
+ * with LOCK_STATS.  lock.h calls the recording functions; they should not be
+ * needed elsewhere.
+ *
+ * Times are read from the TSC where there is one, otherwise from
+ * CLOCK_MONOTONIC_COARSE (whose resolution is a scheduler tick), and are
+ * converted to nanoseconds only when reported.  Each thread records into
+ * histograms of its own, which are merged when the statistics are read.
+ */
+
+/* Statistics of one lock class. */
+typedef struct {
+    atomic_ulong contended;     /* Acquisitions that had to wait */
+    HIST wait;                  /* Time waited for each acquisition */
+    HIST hold;                  /* Time held after each acquisition */
+} LOCKSTAT;
+
+static inline uint64_t lockstat_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void lockstat_acquired(int cls, uint64_t wait, int contended);
+void lockstat_released(int cls, uint64_t held);
+const char *lockstat_class_name(int cls);
+double lockstat_ns_per_tick(void);
+void lockstat_collect(int cls, LOCKSTAT *st);
+
+#endif
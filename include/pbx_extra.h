@@ -0,0 +1,43 @@
+#ifndef PBX_EXTRA_H
+#define PBX_EXTRA_H
+
+#include <stdio.h>
+
+#include "pbx.h"
+
+/*
+ * Additional PBX-module interfaces that are not part of pbx.h.
+ */
+
+/*
+ * The PBX registry grows in chunks of PBX_CHUNK_SIZE slots, up to a
+ * ceiling on the number of extensions.  Extension numbers must lie in
+ * [0, ceiling).  The ceiling is rounded up to a whole number of chunks.
+ */
+#define PBX_CHUNK_BITS 10
+#define PBX_CHUNK_SIZE (1 << PBX_CHUNK_BITS)
+#define PBX_DEFAULT_MAX_EXTENSIONS (1 << 20)
+
+/*
+ * Set the ceiling on the number of extensions for PBXs created by
+ * subsequent calls to pbx_init().
+ *
+ * @param max  The ceiling, which must be positive.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_set_max_extensions(int max);
+
+/*
+ * Get the ceiling on the number of extensions, rounded up as it will be
+ * by pbx_init(): every extension lies below it.
+ */
+int pbx_get_max_extensions(void);
+
+/*
+ * Print the output queue state of each registered TU.
+ *
+ * @return the number of TUs printed.
+ */
+int pbx_dump_queues(PBX *pbx, FILE *out);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SBUF_H
+#define SBUF_H
+
+#include <stdint.h>
+#include <time.h>
+#include <semaphore.h>
+
+/*
+ * Bounded producer/consumer buffer of ints, after the CS:APP sbuf package.
+ * In addition to the items, the time at which each item was inserted is
+ * recorded, so that the buffer can report how long items wait in it.
+ */
+typedef struct {
+    int *buf;                   /* Buffer array */
+    struct timespec *stamp;     /* Insertion time of each item */
+    int n;                      /* Maximum number of slots */
+    int front;                  /* buf[(front+1)%n] is first item */
+    int rear;                   /* buf[rear%n] is last item */
+    sem_t mutex;                /* Protects accesses to buf and statistics */
+    sem_t slots;                /* Counts available slots */
+    sem_t items;                /* Counts available items */
+
+    /* Statistics, protected by mutex. */
+    int depth;                  /* Current number of items */
+    int max_depth;              /* High-water mark of depth */
+    uint64_t removed;           /* Number of items removed */
+    uint64_t wait_ns;           /* Total time removed items spent queued */
+    uint64_t max_wait_ns;       /* Longest time an item spent queued */
+} sbuf_t;
+
+/* Snapshot of the statistics of an sbuf. */
+typedef struct {
+    int capacity;
+    int depth;
+    int max_depth;
+    uint64_t removed;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+} SBUF_STATS;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_tryinsert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+int sbuf_tryremove(sbuf_t *sp, int *item);
+void sbuf_stats(sbuf_t *sp, SBUF_STATS *st);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SERVER_EXTRA_H
+#define SERVER_EXTRA_H
+
+#include <stddef.h>
+
+#include "tu.h"
+#include "tu_extra.h"
+#include "server.h"
+#include "sbuf.h"
+
+/*
+ * Additional server-module interfaces that are not part of server.h.
+ */
+
+/*
+ * Parse a single line of client input, without carrying it out.
+ * For a dial command whose extension is malformed, *ext is set to -1.
+ *
+ * @return the command, or TU_NO_CMD if the line is malformed.
+ */
+TU_COMMAND pbx_client_parse(char *line, size_t len, char **msg, int *ext);
+
+/*
+ * Parse a single line of client input and carry out the command.
+ * A chat that fills the recipient's output queue either waits for it to
+ * drain, if w is NULL, or registers w and returns 1 (see tu_chat_nowait()).
+ */
+int pbx_client_dispatch(TU *tu, char *line, size_t len, TU_WAITER *w);
+
+/*
+ * Serve a single client connection until EOF, on the calling thread.
+ */
+void pbx_client_serve(int client_fd);
+
+/*
+ * Event-driven serving mode.
+ * A fixed set of threads multiplexes all client connections with
+ * edge-triggered epoll, instead of one service thread per connection.
+ */
+int pbx_event_init(int nloops);
+int pbx_event_add(int client_fd);
+void pbx_event_stop(void);
+
+/*
+ * Prethreaded serving mode.
+ * A fixed pool of worker threads takes accepted connections from a bounded
+ * queue, and each worker serves one connection at a time.
+ */
+int pbx_pool_init(int nthreads, int qcap);
+int pbx_pool_add(int client_fd);
+void pbx_pool_stop(void);
+int pbx_pool_stats(SBUF_STATS *st);
+
+/*
+ * Administrative listener.
+ * A single thread serves server metrics, in the Prometheus text format,
+ * to each connection on a separate port of the loopback interface.
+ */
+int pbx_admin_init(char *port);
+void pbx_admin_stop(void);
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef SHMSTAT_H
+#define SHMSTAT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "stats.h"
+#include "server.h"
+
+/*
+ * Statistics published in a POSIX shared-memory segment, so that a monitor
+ * such as pbxtop can watch the server without making it do any work.
+ *
+ * The segment holds a header of server-wide counters, refreshed a few
+ * times a second by a publisher thread, followed by a table indexed by
+ * extension giving the state and peer of each registered TU, which the TU
+ * module updates as transitions happen.  The header and every table entry
+ * are each guarded by a sequence count, odd while a write is in progress:
+ * a reader copies the data between two reads of the count, and retries if
+ * the count was odd or changed.  The writers of an entry are serialized by
+ * the lock of its TU; the header has a single writer.  All fields are
+ * atomics accessed with relaxed ordering, with fences around them.  The
+ * table is sized for every possible extension, but pages of it that are
+ * never written take no memory.
+ */
+#define SHMSTAT_MAGIC 0x50425853        /* "PBXS" */
+#define SHMSTAT_VERSION 1
+
+/* How often the header is refreshed, in milliseconds. */
+#define SHMSTAT_INTERVAL 250
+
+/* State and peer of the TU at one extension. */
+typedef struct {
+    atomic_uint seq;
+    atomic_int state;           /* TU_STATE plus one, or 0 if the extension is free */
+    atomic_int peer;            /* Extension of the peer plus one, or 0 if none */
+} SHMSTAT_EXT;
+
+typedef struct {
+    /* Layout; fixed when the segment is created. */
+    uint32_t magic;
+    uint32_t version;
+    int32_t nstats;             /* STAT_COUNT */
+    int32_t ncommands;          /* TU_NUM_COMMANDS */
+    int32_t nexts;              /* Size of the extension table */
+    int32_t pid;                /* The server */
+
+    /* One more than the highest extension ever published. */
+    atomic_int ext_limit;
+
+    /* Counters, guarded by seq. */
+    atomic_uint seq;
+    atomic_ulong updated_ns;    /* CLOCK_MONOTONIC time of the last refresh */
+    atomic_long stats[STAT_COUNT];
+    atomic_ulong commands[TU_NUM_COMMANDS];
+
+    SHMSTAT_EXT ext[];
+} SHMSTAT;
+
+/* Snapshot of the header counters. */
+typedef struct {
+    uint64_t updated_ns;
+    long stats[STAT_COUNT];
+    unsigned long commands[TU_NUM_COMMANDS];
+} SHMSTAT_COUNTERS;
+
+/* The segment, if the server is publishing one. */
+extern SHMSTAT *shmstat;
+
+int shmstat_init(char *name, int nexts);
+void shmstat_stop(void);
+void shmstat_set_ext(int ext, int state, int peer);
+
+/*
+ * Begin and end a write guarded by a sequence count.
+ */
+static inline void shmstat_write_begin(atomic_uint *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void shmstat_write_end(atomic_uint *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+/*
+ * Begin a read guarded by a sequence count.
+ *
+ * @return the count, to be passed to shmstat_read_retry().
+ */
+static inline unsigned int shmstat_read_begin(atomic_uint *seq) {
+    unsigned int s;
+    while((s = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+        ;
+    return s;
+}
+
+/*
+ * End a read guarded by a sequence count.
+ *
+ * @return nonzero if the data read may be inconsistent and must be read again.
+ */
+static inline int shmstat_read_retry(atomic_uint *seq, unsigned int s) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != s;
+}
+
+/*
+ * Read the header counters of a segment consistently.
+ */
+static inline void shmstat_read_counters(SHMSTAT *shm, SHMSTAT_COUNTERS *c) {
+    unsigned int s;
+    int i;
+    do{
+        s = shmstat_read_begin(&shm->seq);
+        c->updated_ns = atomic_load_explicit(&shm->updated_ns, memory_order_relaxed);
+        for(i=0; i<STAT_COUNT; i++)
+            c->stats[i] = atomic_load_explicit(&shm->stats[i], memory_order_relaxed);
+        for(i=0; i<TU_NUM_COMMANDS; i++)
+            c->commands[i] = atomic_load_explicit(&shm->commands[i], memory_order_relaxed);
+    }while(shmstat_read_retry(&shm->seq, s));
+}
+
+/*
+ * Read one extension of a segment consistently.
+ *
+ * @param state  Set to the state of the TU, or -1 if there is none.
+ * @param peer  Set to the extension of its peer, or -1 if there is none.
+ */
+static inline void shmstat_read_ext(SHMSTAT *shm, int ext, int *state, int *peer) {
+    SHMSTAT_EXT *e = &shm->ext[ext];
+    unsigned int s;
+    do{
+        s = shmstat_read_begin(&e->seq);
+        *state = atomic_load_explicit(&e->state, memory_order_relaxed) - 1;
+        *peer = atomic_load_explicit(&e->peer, memory_order_relaxed) - 1;
+    }while(shmstat_read_retry(&e->seq, s));
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Object pool for fixed-size objects.
+ *
+ * Objects are carved out of cache-line-aligned slabs and are never returned
+ * to the system allocator.  The constructor runs only once, when an object is
+ * first carved out, so state that is expensive to set up (e.g. a semaphore)
+ * survives across uses; the user must leave such state as it found it before
+ * freeing the object.
+ *
+ * Each thread keeps a small cache of free objects, so that most allocations
+ * and frees touch no shared state.  Caches are refilled from and flushed to
+ * a shared depot in batches.
+ */
+#define SLAB_ALIGN 64
+#define SLAB_CACHE_SIZE 32
+#define SLAB_BATCH 16
+
+typedef struct slab SLAB;
+
+/* Snapshot of the statistics of a slab pool. */
+typedef struct {
+    size_t obj_size;            /* Size of each object, after alignment */
+    uint64_t allocs;            /* Number of allocations */
+    uint64_t cache_hits;        /* Allocations served by a per-thread cache */
+    uint64_t depot_refills;     /* Cache refills from the depot */
+    uint64_t slabs;             /* Number of slabs carved out */
+    long objects;               /* Number of objects carved out */
+    long in_use;                /* Objects currently allocated */
+    long high_water;            /* High-water mark of in_use */
+} SLAB_STATS;
+
+SLAB *slab_create(size_t size, void (*ctor)(void *));
+void *slab_alloc(SLAB *sp);
+void slab_free(SLAB *sp, void *obj);
+void slab_stats(SLAB *sp, SLAB_STATS *st);
+
+#endif
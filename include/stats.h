@@ -0,0 +1,48 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+
+#include "tu_fsm.h"
+
+/*
+ * Server-wide counters and gauges.
+ *
+ * Each thread keeps its own copy of every statistic and updates it without
+ * atomic read-modify-write operations; a statistic is read by summing the
+ * copies of all threads, live or exited.  A gauge (e.g. the number of TUs in
+ * a state) may be raised by one thread and lowered by another, so one
+ * thread's copy may be negative, but the sum is not.  TUs are counted from
+ * tu_init() until freed, so the TU states include unregistered TUs whose
+ * release is still deferred.
+ */
+typedef enum {
+    STAT_REGISTERED,                            /* TUs registered with the PBX */
+    STAT_TU_STATE,                              /* TUs in each state, from here on */
+    STAT_CALLS = STAT_TU_STATE + TU_NUM_STATES, /* Calls in progress */
+    STAT_CONNECTIONS,                           /* Client connections accepted */
+    STAT_BYTES_IN,                              /* Bytes received from clients */
+    STAT_BYTES_OUT,                             /* Bytes sent to clients */
+    STAT_MALFORMED,                             /* Malformed lines received */
+    STAT_EVICTIONS,                             /* Slow clients disconnected */
+    STAT_COUNT
+} STAT_ID;
+
+extern __thread atomic_long *stat_self;
+atomic_long *stat_self_create(void);
+
+/*
+ * Add to a statistic.
+ */
+static inline void stat_add(STAT_ID id, long n) {
+    atomic_long *v = stat_self;
+    if(v == NULL && (v = stat_self_create()) == NULL)
+        return;
+    atomic_store_explicit(&v[id], atomic_load_explicit(&v[id], memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+long stat_read(STAT_ID id);
+void stat_read_all(long vals[STAT_COUNT]);
+
+#endif
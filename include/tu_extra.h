@@ -0,0 +1,131 @@
+#ifndef TU_EXTRA_H
+#define TU_EXTRA_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "tu.h"
+#include "slab.h"
+
+/*
+ * Additional TU-module interfaces that are not part of tu.h.
+ */
+
+/*
+ * A destination for the notifications of a TU, in place of a file
+ * descriptor, e.g. to drive the PBX in process with no sockets.  write is
+ * called, with no TU lock held, with one or more complete notifications,
+ * each ending with EOL.  It returns the number of bytes it took (at least
+ * one), or -1 if the client is gone, after which all further output to it
+ * is dropped.  It must not call the TU or PBX functions.
+ */
+typedef struct tu_sink {
+    ssize_t (*write)(void *arg, const char *buf, size_t len);
+    void *arg;
+} TU_SINK;
+
+TU *tu_init_sink(int fd, const TU_SINK *sink);
+
+/*
+ * Mark a TU as no longer reachable through the PBX.  A subsequent
+ * tu_dial() that names it as the target behaves as if no target had
+ * been found.
+ */
+void tu_unplug(TU *tu);
+
+/*
+ * Send the client of a TU a notification of its current state, without
+ * changing it.
+ */
+int tu_report(TU *tu);
+
+/*
+ * Stop all output to the client of a TU.  Notifications are written to
+ * the client after the TU has been unlocked, possibly by another thread;
+ * once this returns, no such write is in progress or will be started,
+ * so the client's file descriptor may be closed.
+ */
+void tu_disconnect(TU *tu);
+
+/*
+ * In builds with TU_REF_DEBUG defined, print every TU that has not yet been
+ * freed, with the reasons for its most recent reference count changes.
+ * Otherwise this does nothing.
+ *
+ * @return the number of TUs reported.
+ */
+int tu_report_leaks(FILE *out);
+
+/*
+ * Get statistics of the pool from which TUs are allocated.
+ *
+ * @return 0 if successful, -1 if no TU has been allocated yet.
+ */
+int tu_pool_stats(SLAB_STATS *st);
+
+/*
+ * Handling of output to clients that do not keep up.
+ * Output to each client is queued and written without blocking.  Once a
+ * client's queue holds more than the high-water mark:
+ *   TU_OUTPUT_PAUSE: no more input is read from the sender of a chat
+ *     until the queue drains (the default; see tu_chat_nowait()).
+ *   TU_OUTPUT_DROP: further chat text for the client is discarded.
+ *   TU_OUTPUT_DISCONNECT: the client is disconnected.
+ * State notifications are never dropped; any client whose queue grows to
+ * several times the high-water mark is disconnected.
+ *
+ * A write that would block is finished by a background thread once the
+ * client's socket becomes writable.  That thread waits on an epoll set,
+ * with no limit on the number of clients blocked at once; a client is
+ * disconnected only under the policy above, or if its socket cannot be
+ * added to the set (e.g. beyond the system's max_user_watches).  Each
+ * disconnection of a slow client is counted in STAT_EVICTIONS.
+ */
+typedef enum tu_output_policy {
+    TU_OUTPUT_PAUSE, TU_OUTPUT_DROP, TU_OUTPUT_DISCONNECT
+} TU_OUTPUT_POLICY;
+
+#define TU_DEFAULT_OUTPUT_HIWAT (64 * 1024)
+
+/* State of the output queue of one client. */
+typedef struct tu_output_stats {
+    size_t queued;              /* Bytes currently queued */
+    size_t max_queued;          /* High-water mark of queued */
+    unsigned long dropped;      /* Chat messages dropped */
+    int blocked;                /* Waiting for the socket to become writable */
+    int evicted;                /* Disconnected for being too slow */
+} TU_OUTPUT_STATS;
+
+int tu_set_output_limit(size_t hiwat, TU_OUTPUT_POLICY policy);
+void tu_output_stats(TU *tu, TU_OUTPUT_STATS *st);
+
+/*
+ * A request to be told when the output queue of a chat's recipient has
+ * drained, so that an event loop can stop reading from the sender without
+ * waiting.  resume is called once, with no TU lock held and possibly on
+ * another thread, when the queue is back under the high-water mark or its
+ * client is gone.  It must not call the TU or PBX functions.
+ */
+typedef struct tu_waiter {
+    void (*resume)(struct tu_waiter *w);
+    struct tu_waiter *next;     /* Used by the TU module while registered. */
+} TU_WAITER;
+
+/*
+ * Send a chat as tu_chat() does, except that under TU_OUTPUT_PAUSE the
+ * caller does not wait for the recipient's queue to drain: if it would
+ * have to, w is registered with the recipient and 1 is returned, and the
+ * caller should read no more from its client until w->resume is called.
+ * If w is NULL, this waits as tu_chat() does.
+ *
+ * @return as tu_chat(), or 1 if the chat was sent and w was registered.
+ */
+int tu_chat_nowait(TU *tu, char *msg, TU_WAITER *w);
+
+/*
+ * Stop the background thread that finishes writes to slow clients.
+ * Called by pbx_shutdown() once all TUs have been unregistered.
+ */
+void tu_output_shutdown(void);
+
+#endif
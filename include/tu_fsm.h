@@ -0,0 +1,58 @@
+#ifndef TU_FSM_H
+#define TU_FSM_H
+
+#include "tu.h"
+#include "server.h"
+
+/*
+ * Transition table for the TU state machine.
+ *
+ * A transition is selected by the current state of a TU and an event.
+ * Each command is one event, except dial, which is split by what was
+ * found at the target, because that decides the outcome.  The "other" TU
+ * of a transition is the target for a dial event and the current peer for
+ * every other event.
+ */
+typedef enum tu_fsm_event {
+    TU_EV_PICKUP,
+    TU_EV_HANGUP,
+    TU_EV_DIAL_NONE,    /* No such extension, or it is being unregistered. */
+    TU_EV_DIAL_SELF,    /* The TU dialed its own extension. */
+    TU_EV_DIAL_BUSY,    /* The target has a peer or is off hook. */
+    TU_EV_DIAL_OK,      /* The target is on hook and free. */
+    TU_EV_CHAT,
+    TU_EV_COUNT
+} TU_FSM_EVENT;
+
+#define TU_NUM_STATES (TU_ERROR + 1)
+#define TU_NUM_COMMANDS (TU_CHAT_CMD + 1)
+
+/* Value of other_next for transitions that leave the other TU alone. */
+#define TU_FSM_SAME (-1)
+
+/* What happens to the call linking the TU and the other TU. */
+typedef enum tu_fsm_link {
+    TU_LINK_KEEP,       /* Nothing. */
+    TU_LINK_SET,        /* Record them as peers; each gains a reference. */
+    TU_LINK_CLEAR       /* Clear their peers; each loses a reference. */
+} TU_FSM_LINK;
+
+/* Notifications to send, as a bit set. */
+#define TU_NOTIFY_SELF  0x1     /* State of the TU, to its client. */
+#define TU_NOTIFY_OTHER 0x2     /* State of the other TU, to its client. */
+#define TU_NOTIFY_CHAT  0x4     /* The chat text, to the other TU's client. */
+
+typedef struct tu_transition {
+    signed char next;           /* Next state of the TU. */
+    signed char other_next;     /* Next state of the other TU, or TU_FSM_SAME. */
+    unsigned char link;         /* A TU_FSM_LINK value. */
+    unsigned char notify;       /* TU_NOTIFY_* bits. */
+    signed char ret;            /* Result of the command: 0 or -1. */
+} TU_TRANSITION;
+
+extern const TU_TRANSITION tu_fsm[TU_NUM_STATES][TU_EV_COUNT];
+extern const TU_COMMAND tu_fsm_event_command[TU_EV_COUNT];
+
+int tu_fsm_next_states(TU_STATE state, TU_COMMAND cmd);
+
+#endif
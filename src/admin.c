@@ -0,0 +1,283 @@
+/*
+ * Administrative listener.
+ * A single thread accepts connections on a separate port and answers each
+ * with a snapshot of the server's metrics, in the Prometheus text exposition
+ * format, then closes it.  An HTTP request (as sent by a Prometheus scraper
+ * or curl) gets an HTTP/1.0 response; anything else, including no request
+ * at all (e.g. from nc), gets the bare metrics.  The listener is bound to
+ * the loopback interface only, as the metrics are served to anyone who
+ * connects.
+ *
+ * Nothing here takes the PBX registry lock: the metrics are read from the
+ * per-thread statistics kept by stats.c, cmdstat.c and lockstat.c, and from
+ * the pool's connection queue.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/eventfd.h>
+
+#include "pbx.h"
+#include "server_extra.h"
+#include "stats.h"
+#include "cmdstat.h"
+#include "lock.h"
+#include "lockstat.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* The address on which the listener accepts connections. */
+#define ADMIN_ADDRESS "127.0.0.1"
+
+/* How long to wait for a client to send its request, in milliseconds. */
+#define ADMIN_REQUEST_TIMEOUT 100
+
+/* How long to wait for a client to take the response, in seconds. */
+#define ADMIN_SEND_TIMEOUT 1
+
+static int listenfd = -1;
+static int stopfd = -1;
+static pthread_t admin_tid;
+
+/*
+ * Print a metric's HELP and TYPE lines.
+ */
+static void admin_header(FILE *out, char *name, char *type, char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Print the quantiles, sum and count of a histogram as a summary.
+ *
+ * @param labels  Labels of the series, without braces, e.g. "lock=\"tu\"".
+ * @param scale  Seconds per unit of the values in the histogram.
+ */
+static void admin_summary(FILE *out, char *name, char *labels, HIST *h, double scale) {
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    int i;
+
+    for(i=0; i<sizeof(quantiles)/sizeof(quantiles[0]); i++)
+        fprintf(out, "%s{%s,quantile=\"%g\"} %.9g\n", name, labels, quantiles[i],
+                hist_quantile(h, quantiles[i]) * scale);
+    fprintf(out, "%s_sum{%s} %.9g\n", name, labels,
+            atomic_load_explicit(&h->sum, memory_order_relaxed) * scale);
+    fprintf(out, "%s_count{%s} %lu\n", name, labels,
+            atomic_load_explicit(&h->count, memory_order_relaxed));
+}
+
+/*
+ * Write a label value for a TU state: its name, in lower case, with spaces
+ * replaced by underscores.
+ */
+static void admin_state_label(char *buf, size_t size, char *name) {
+    size_t i;
+    for(i=0; i+1<size && name[i] != '\0'; i++)
+        buf[i] = name[i] == ' ' ? '_' : (name[i] >= 'A' && name[i] <= 'Z' ? name[i] - 'A' + 'a' : name[i]);
+    buf[i] = '\0';
+}
+
+/*
+ * Print every metric.
+ */
+static void admin_metrics(FILE *out) {
+    static HIST h;
+    long vals[STAT_COUNT];
+    char label[64];
+    SBUF_STATS st;
+    int i;
+
+    stat_read_all(vals);
+
+    admin_header(out, "pbx_registered_tus", "gauge", "TUs registered with the PBX.");
+    fprintf(out, "pbx_registered_tus %ld\n", vals[STAT_REGISTERED]);
+    admin_header(out, "pbx_tus", "gauge", "TUs in each state.");
+    for(i=0; i<TU_NUM_STATES; i++){
+        admin_state_label(label, sizeof(label), tu_state_names[i]);
+        fprintf(out, "pbx_tus{state=\"%s\"} %ld\n", label, vals[STAT_TU_STATE + i]);
+    }
+    admin_header(out, "pbx_active_calls", "gauge", "Calls in progress.");
+    fprintf(out, "pbx_active_calls %ld\n", vals[STAT_CALLS]);
+    admin_header(out, "pbx_connections_total", "counter", "Client connections accepted.");
+    fprintf(out, "pbx_connections_total %ld\n", vals[STAT_CONNECTIONS]);
+    admin_header(out, "pbx_received_bytes_total", "counter", "Bytes received from clients.");
+    fprintf(out, "pbx_received_bytes_total %ld\n", vals[STAT_BYTES_IN]);
+    admin_header(out, "pbx_sent_bytes_total", "counter", "Bytes sent to clients.");
+    fprintf(out, "pbx_sent_bytes_total %ld\n", vals[STAT_BYTES_OUT]);
+
+    admin_header(out, "pbx_malformed_lines_total", "counter", "Malformed lines received from clients.");
+    fprintf(out, "pbx_malformed_lines_total %ld\n", vals[STAT_MALFORMED]);
+    admin_header(out, "pbx_evicted_clients_total", "counter", "Slow clients disconnected.");
+    fprintf(out, "pbx_evicted_clients_total %ld\n", vals[STAT_EVICTIONS]);
+
+    admin_header(out, "pbx_command_latency_seconds", "summary",
+                 "Time to carry out each client command.");
+    for(i=0; i<TU_NUM_COMMANDS; i++){
+        cmdstat_collect(i, &h);
+        snprintf(label, sizeof(label), "command=\"%s\"", tu_command_names[i]);
+        admin_summary(out, "pbx_command_latency_seconds", label, &h, 1e-9);
+    }
+
+#ifdef LOCK_STATS
+    static LOCKSTAT ls;
+    double scale = lockstat_ns_per_tick() * 1e-9;
+
+    admin_header(out, "pbx_lock_contended_total", "counter", "Lock acquisitions that had to wait.");
+    for(i=0; i<LOCK_NUM_CLASSES; i++){
+        lockstat_collect(i, &ls);
+        fprintf(out, "pbx_lock_contended_total{lock=\"%s\"} %lu\n", lockstat_class_name(i),
+                atomic_load_explicit(&ls.contended, memory_order_relaxed));
+    }
+    admin_header(out, "pbx_lock_wait_seconds", "summary", "Time waited to acquire each lock.");
+    for(i=0; i<LOCK_NUM_CLASSES; i++){
+        lockstat_collect(i, &ls);
+        snprintf(label, sizeof(label), "lock=\"%s\"", lockstat_class_name(i));
+        admin_summary(out, "pbx_lock_wait_seconds", label, &ls.wait, scale);
+    }
+    admin_header(out, "pbx_lock_hold_seconds", "summary", "Time each lock was held.");
+    for(i=0; i<LOCK_NUM_CLASSES; i++){
+        lockstat_collect(i, &ls);
+        snprintf(label, sizeof(label), "lock=\"%s\"", lockstat_class_name(i));
+        admin_summary(out, "pbx_lock_hold_seconds", label, &ls.hold, scale);
+    }
+#endif
+
+    if(pbx_pool_stats(&st) == 0){
+        admin_header(out, "pbx_pool_queue_depth", "gauge", "Connections waiting for a worker.");
+        fprintf(out, "pbx_pool_queue_depth %d\n", st.depth);
+        admin_header(out, "pbx_pool_queue_max_depth", "gauge", "Most connections ever waiting for a worker.");
+        fprintf(out, "pbx_pool_queue_max_depth %d\n", st.max_depth);
+        admin_header(out, "pbx_pool_queue_capacity", "gauge", "Capacity of the connection queue.");
+        fprintf(out, "pbx_pool_queue_capacity %d\n", st.capacity);
+        admin_header(out, "pbx_pool_dequeued_total", "counter", "Connections taken by a worker.");
+        fprintf(out, "pbx_pool_dequeued_total %lu\n", st.removed);
+        admin_header(out, "pbx_pool_queue_wait_seconds_total", "counter",
+                     "Time connections have spent waiting for a worker.");
+        fprintf(out, "pbx_pool_queue_wait_seconds_total %.9g\n", st.wait_ns * 1e-9);
+    }
+}
+
+/*
+ * Answer one admin connection.
+ */
+static void admin_serve(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timeval tv = { .tv_sec = ADMIN_SEND_TIMEOUT };
+    char req[512], *body = NULL;
+    size_t len = 0;
+    ssize_t n = 0;
+    FILE *out;
+
+    // Wait briefly for a request; only its first line matters.
+    if(poll(&pfd, 1, ADMIN_REQUEST_TIMEOUT) > 0)
+        n = read(fd, req, sizeof(req) - 1);
+    req[n > 0 ? n : 0] = '\0';
+
+    if((out = open_memstream(&body, &len)) == NULL)
+        return;
+    admin_metrics(out);
+    fclose(out);
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(strncmp(req, "GET ", 4) == 0 || strncmp(req, "HEAD ", 5) == 0){
+        char head[160];
+        int hlen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n\r\n", len);
+        if(rio_writen(fd, head, hlen) < 0 || req[0] == 'H'){
+            free(body);
+            return;
+        }
+    }
+    rio_writen(fd, body, len);
+    free(body);
+}
+
+/*
+ * Thread function for the admin listener.
+ */
+static void *admin_thread(void *arg) {
+    struct pollfd pfds[2] = {
+        { .fd = listenfd, .events = POLLIN },
+        { .fd = stopfd, .events = POLLIN }
+    };
+    int fd;
+
+    while(1){
+        if(poll(pfds, 2, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            unix_error("admin poll error");
+        }
+        if(pfds[1].revents)
+            break;
+        if(!pfds[0].revents || (fd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        admin_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Open a listening socket on a port of the loopback interface.
+ *
+ * @return the socket, or -1 if it could not be opened.
+ */
+static int admin_listen(char *port) {
+    struct addrinfo hints, *ai;
+    int fd, optval = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if(getaddrinfo(ADMIN_ADDRESS, port, &hints, &ai) != 0)
+        return -1;
+    if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0){
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if(bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, LISTENQ) < 0){
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/*
+ * Start the admin listener.
+ *
+ * @param port  The port on which to listen, on the loopback interface.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_admin_init(char *port) {
+    if((listenfd = admin_listen(port)) < 0)
+        return -1;
+    if((stopfd = eventfd(0, EFD_CLOEXEC)) < 0){
+        close(listenfd);
+        listenfd = -1;
+        return -1;
+    }
+    Pthread_create(&admin_tid, NULL, admin_thread, NULL);
+    debug("Admin listener on %s port %s", ADMIN_ADDRESS, port);
+    return 0;
+}
+
+/*
+ * Stop the admin listener, if it was started, and wait for its thread to
+ * exit.
+ */
+void pbx_admin_stop(void) {
+    uint64_t one = 1;
+
+    if(stopfd < 0)
+        return;
+    if(write(stopfd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+    Pthread_join(admin_tid, NULL);
+    close(stopfd);
+    close(listenfd);
+    stopfd = listenfd = -1;
+}
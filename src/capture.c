@@ -0,0 +1,191 @@
+/*
+ * Capture of client traffic (see capture.h).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "capture.h"
+#include "debug.h"
+
+/* Buffer for the log; records are written out when it fills. */
+#define CAPTURE_BUFSIZE (1 << 20)
+
+struct capture {
+    FILE *out;
+    uint64_t start_ns;          /* CLOCK_MONOTONIC when the capture began */
+    uint32_t next_conn;         /* Id of the next connection */
+    uint32_t *conns;            /* Connection id by descriptor, or 0 */
+    int nconns;                 /* Size of conns */
+    pthread_mutex_t lock;       /* Protects everything above */
+};
+
+CAPTURE *capture;
+
+static uint64_t capture_clock(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Append one record, from text gathered from iovcnt buffers.  Must be
+ * called with the capture's lock held.
+ */
+static void capture_write(CAPTURE *cap, int type, uint32_t conn, const struct iovec *iov, int iovcnt) {
+    CAPTURE_RECORD rec = { .conn = conn, .type = type };
+    size_t len = 0, n;
+    int i;
+
+    if(cap->out == NULL)
+        return;
+    for(i=0; i<iovcnt; i++)
+        len += iov[i].iov_len;
+    rec.len = len > CAPTURE_MAX_TEXT ? CAPTURE_MAX_TEXT : len;
+    rec.ns = capture_clock(CLOCK_MONOTONIC) - cap->start_ns;
+    fwrite_unlocked(&rec, sizeof(rec), 1, cap->out);
+    for(i=0, len=rec.len; i<iovcnt && len > 0; i++){
+        n = iov[i].iov_len < len ? iov[i].iov_len : len;
+        fwrite_unlocked(iov[i].iov_base, 1, n, cap->out);
+        len -= n;
+    }
+}
+
+/*
+ * Start capturing to a file, which is replaced if it exists.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int capture_init(char *path) {
+    CAPTURE_HEADER hdr = { .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION };
+    CAPTURE *cap;
+
+    if((cap = calloc(1, sizeof(CAPTURE))) == NULL)
+        return -1;
+    if((cap->out = fopen(path, "w")) == NULL){
+        free(cap);
+        return -1;
+    }
+    setvbuf(cap->out, NULL, _IOFBF, CAPTURE_BUFSIZE);
+    pthread_mutex_init(&cap->lock, NULL);
+    cap->next_conn = 1;
+    hdr.start_ns = capture_clock(CLOCK_REALTIME);
+    cap->start_ns = capture_clock(CLOCK_MONOTONIC);
+    if(fwrite(&hdr, sizeof(hdr), 1, cap->out) != 1){
+        fclose(cap->out);
+        free(cap);
+        return -1;
+    }
+    capture = cap;
+    debug("Capturing traffic to %s", path);
+    return 0;
+}
+
+/*
+ * Stop capturing and write out what is buffered.  Anything recorded after
+ * is dropped.  The capture itself is not freed, as another thread may be
+ * about to record into it.
+ */
+void capture_stop(void) {
+    CAPTURE *cap = capture;
+
+    if(cap == NULL)
+        return;
+    capture = NULL;
+    pthread_mutex_lock(&cap->lock);
+    if(fclose(cap->out) != 0)
+        debug("Capture could not be written");
+    cap->out = NULL;
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/*
+ * Record a new connection, before its TU is registered.
+ */
+void capture_connect(int fd) {
+    CAPTURE *cap = capture;
+    uint32_t *nconns;
+    int n;
+
+    if(cap == NULL || fd < 0)
+        return;
+    pthread_mutex_lock(&cap->lock);
+    if(cap->out == NULL){
+        pthread_mutex_unlock(&cap->lock);
+        return;
+    }
+    if(fd >= cap->nconns){
+        for(n = cap->nconns ? cap->nconns : 64; n <= fd; n *= 2)
+            ;
+        if((nconns = realloc(cap->conns, n * sizeof(uint32_t))) == NULL){
+            pthread_mutex_unlock(&cap->lock);
+            return;
+        }
+        memset(nconns + cap->nconns, 0, (n - cap->nconns) * sizeof(uint32_t));
+        cap->conns = nconns;
+        cap->nconns = n;
+    }
+    cap->conns[fd] = cap->next_conn++;
+    capture_write(cap, CAPTURE_CONNECT, cap->conns[fd], NULL, 0);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/*
+ * Record the end of a connection, after its TU is unregistered and before
+ * its descriptor is closed.
+ */
+void capture_disconnect(int fd) {
+    CAPTURE *cap = capture;
+
+    if(cap == NULL || fd < 0)
+        return;
+    pthread_mutex_lock(&cap->lock);
+    if(fd < cap->nconns && cap->conns[fd] != 0){
+        capture_write(cap, CAPTURE_DISCONNECT, cap->conns[fd], NULL, 0);
+        cap->conns[fd] = 0;
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/*
+ * Record a line received from a client, with its EOL stripped.
+ */
+void capture_command(int fd, const char *line, size_t len) {
+    CAPTURE *cap = capture;
+
+    if(cap == NULL || fd < 0)
+        return;
+    pthread_mutex_lock(&cap->lock);
+    if(fd < cap->nconns && cap->conns[fd] != 0)
+        capture_write(cap, CAPTURE_COMMAND, cap->conns[fd], &(struct iovec){ (void *)line, len }, 1);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/*
+ * Record the notifications about to be written to a client: one or more
+ * lines, each ending with an EOL, which is not recorded.
+ */
+void capture_notify(int fd, const char *buf, size_t len) {
+    CAPTURE *cap = capture;
+    const char *end = buf + len, *nl;
+    size_t n;
+
+    if(cap == NULL || fd < 0)
+        return;
+    pthread_mutex_lock(&cap->lock);
+    if(fd < cap->nconns && cap->conns[fd] != 0){
+        while(buf < end){
+            if((nl = memchr(buf, '\n', end - buf)) == NULL)
+                nl = end;
+            n = nl - buf;
+            if(n > 0 && buf[n - 1] == '\r')
+                n--;
+            capture_write(cap, CAPTURE_NOTIFY, cap->conns[fd], &(struct iovec){ (void *)buf, n }, 1);
+            buf = nl < end ? nl + 1 : end;
+        }
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
@@ -0,0 +1,71 @@
+/*
+ * Parsing of client command lines.
+ * Kept apart from the rest of the server module, so that tools such as
+ * pbx_replay can read commands exactly as the server does.
+ */
+#include <string.h>
+#include <limits.h>
+
+#include "server_extra.h"
+
+/*
+ * Parse a single line of client input, in one pass.  The command is told by
+ * the first byte of the line and then checked in full:
+ *
+ *   pickup
+ *   hangup
+ *   dial <extension>     (one or more spaces, then decimal digits, then
+ *                         optionally spaces)
+ *   chat [<message>]     (the message starts after the spaces that follow
+ *                         the command, and runs to the end of the line)
+ *
+ * An extension too large for an int is taken as INT_MAX, which no TU can
+ * have, so that the dial reaches no one.
+ *
+ * @param line  The line, with the EOL stripped and NUL-terminated.
+ * @param len  The length of the line.
+ * @param msg  Set to the message of a chat command.
+ * @param ext  Set to the extension of a dial command, or to -1 if the line
+ * is a dial command whose extension is missing or malformed.
+ * @return the command, or TU_NO_CMD if the line is malformed.
+ */
+TU_COMMAND pbx_client_parse(char *line, size_t len, char **msg, int *ext) {
+    char *p, *digits, *end = line + len;
+    unsigned long n;
+
+    switch(line[0]){
+        case 'p':
+            if(len == 6 && memcmp(line, "pickup", 6) == 0)
+                return TU_PICKUP_CMD;
+            break;
+        case 'h':
+            if(len == 6 && memcmp(line, "hangup", 6) == 0)
+                return TU_HANGUP_CMD;
+            break;
+        case 'd':
+            if(len < 4 || memcmp(line, "dial", 4) != 0 || (len > 4 && line[4] != ' '))
+                break;
+            *ext = -1;
+            for(p = line + 4; *p == ' '; p++)
+                ;
+            for(n = 0, digits = p; (unsigned char)(*p - '0') < 10; p++)
+                if((n = n * 10 + (*p - '0')) > INT_MAX)
+                    n = INT_MAX;
+            if(p == digits)
+                break;
+            while(*p == ' ')
+                p++;
+            if(p != end)
+                break;
+            *ext = n;
+            return TU_DIAL_CMD;
+        case 'c':
+            if(len < 4 || memcmp(line, "chat", 4) != 0 || (len > 4 && line[4] != ' '))
+                break;
+            for(p = line + 4; *p == ' '; p++)
+                ;
+            *msg = p;
+            return TU_CHAT_CMD;
+    }
+    return TU_NO_CMD;
+}
@@ -0,0 +1,77 @@
+/*
+ * Per-command latency statistics.
+ */
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "cmdstat.h"
+
+/*
+ * Histograms are kept in a fixed number of sets, each shared by the threads
+ * assigned to it, in turn, when they first record.  The event loops and
+ * pool workers are normally few enough to get a set each; in the default
+ * thread-per-connection mode, memory stays bounded however many clients
+ * there are.  Each set is about 4KB per command.
+ */
+#define CMDSTAT_SETS 64
+
+typedef struct cmdstat_set{
+    HIST cmd[TU_NUM_COMMANDS];
+}CMDSTAT_SET;
+
+static CMDSTAT_SET sets[CMDSTAT_SETS];
+static atomic_uint next_set;
+static __thread CMDSTAT_SET *self;
+
+/*
+ * Record the latency of a command.
+ *
+ * @param cmd  The command, which must be one that a client can issue.
+ * @param ns  Its latency, in nanoseconds.
+ */
+void cmdstat_record(TU_COMMAND cmd, uint64_t ns) {
+    if(self == NULL)
+        self = &sets[atomic_fetch_add_explicit(&next_set, 1, memory_order_relaxed) % CMDSTAT_SETS];
+    hist_record_shared(&self->cmd[cmd], ns);
+}
+
+/*
+ * Collect the latencies of a command over all threads.
+ *
+ * @param h  Set to the combined histogram.
+ */
+void cmdstat_collect(TU_COMMAND cmd, HIST *h) {
+    int i;
+
+    hist_reset(h);
+    for(i=0; i<CMDSTAT_SETS; i++)
+        hist_merge(h, &sets[i].cmd[cmd]);
+}
+
+/*
+ * Print the number of each command carried out, with the mean, p50, p99,
+ * p999 and maximum of its latency.
+ *
+ * @param out  Where to print.
+ * @return the number of commands printed.
+ */
+int cmdstat_dump(FILE *out) {
+    static HIST h;
+    static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t count;
+    int c;
+
+    pthread_mutex_lock(&dump_lock);
+    fprintf(out, "%-8s %12s %10s %10s %10s %10s %10s  (ns)\n", "command", "count",
+            "mean", "p50", "p99", "p999", "max");
+    for(c=0; c<TU_NUM_COMMANDS; c++){
+        cmdstat_collect(c, &h);
+        count = atomic_load_explicit(&h.count, memory_order_relaxed);
+        fprintf(out, "%-8s %12lu %10lu %10lu %10lu %10lu %10lu\n", tu_command_names[c], count,
+                count ? atomic_load_explicit(&h.sum, memory_order_relaxed) / count : 0,
+                hist_quantile(&h, 0.5), hist_quantile(&h, 0.99), hist_quantile(&h, 0.999),
+                atomic_load_explicit(&h.max, memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return c;
+}
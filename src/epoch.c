@@ -0,0 +1,160 @@
+/*
+ * Epoch-based reclamation, using three epochs.
+ *
+ * Each thread that reads has a record holding the global epoch it
+ * observed on entry, with the low bit set while it is inside a critical
+ * section.  The global epoch may advance from e to e+1 only when every
+ * active reader has observed e.  An object retired during epoch r can no
+ * longer be referenced by any reader once the global epoch reaches r+2.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+#include "csapp.h"
+
+#define EPOCH_ACTIVE 1UL
+
+typedef struct epoch_record{
+    _Atomic unsigned long state;        /* Observed epoch << 1 | EPOCH_ACTIVE */
+    atomic_int in_use;                  /* Owned by a live thread */
+    struct epoch_record *next;
+}EPOCH_RECORD;
+
+typedef struct retired{
+    void (*release)(void *);
+    void *obj;
+    struct retired *next;
+}RETIRED;
+
+static _Atomic unsigned long global_epoch;
+static _Atomic(EPOCH_RECORD *) records;
+
+/* Objects retired in epoch r, on limbo[r % 3]; protected by limbo_lock. */
+static RETIRED *limbo[3];
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread EPOCH_RECORD *my_record;
+
+/* Give a record back for reuse when its thread exits. */
+static void epoch_record_release(void *arg) {
+    EPOCH_RECORD *rec = arg;
+    atomic_store_explicit(&rec->state, 0, memory_order_release);
+    atomic_store_explicit(&rec->in_use, 0, memory_order_release);
+}
+
+static void epoch_key_init(void) {
+    pthread_key_create(&record_key, epoch_record_release);
+}
+
+/* Find this thread's record, claiming a free one or adding a new one. */
+static EPOCH_RECORD *epoch_record(void) {
+    EPOCH_RECORD *rec;
+    int expected;
+
+    if((rec = my_record) != NULL)
+        return rec;
+    Pthread_once(&record_once, epoch_key_init);
+    for(rec = atomic_load(&records); rec != NULL; rec = rec->next){
+        expected = 0;
+        if(atomic_compare_exchange_strong(&rec->in_use, &expected, 1))
+            break;
+    }
+    if(rec == NULL){
+        rec = Calloc(1, sizeof(EPOCH_RECORD));
+        atomic_init(&rec->in_use, 1);
+        rec->next = atomic_load(&records);
+        while(!atomic_compare_exchange_weak(&records, &rec->next, rec))
+            ;
+    }
+    pthread_setspecific(record_key, rec);
+    return my_record = rec;
+}
+
+/*
+ * Enter a read-side critical section.
+ */
+void epoch_enter(void) {
+    EPOCH_RECORD *rec = epoch_record();
+    unsigned long e = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    atomic_store_explicit(&rec->state, e << 1 | EPOCH_ACTIVE, memory_order_relaxed);
+    /* The announcement must be visible before any shared pointer is read. */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * Leave a read-side critical section.
+ */
+void epoch_exit(void) {
+    EPOCH_RECORD *rec = my_record;
+    atomic_store_explicit(&rec->state, atomic_load_explicit(&rec->state, memory_order_relaxed)
+                          & ~EPOCH_ACTIVE, memory_order_release);
+}
+
+/*
+ * Advance the global epoch if every active reader has caught up with it,
+ * and release the objects that thereby became unreachable.
+ * Must be called with limbo_lock held.
+ */
+static void epoch_try_advance(void) {
+    EPOCH_RECORD *rec;
+    RETIRED *r, *next;
+    unsigned long e = atomic_load(&global_epoch), s;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    for(rec = atomic_load(&records); rec != NULL; rec = rec->next){
+        s = atomic_load_explicit(&rec->state, memory_order_acquire);
+        if((s & EPOCH_ACTIVE) && (s >> 1) != e)
+            return;
+    }
+    atomic_store(&global_epoch, e + 1);
+
+    /* Objects retired in epoch e-1 are now safe to release. */
+    r = limbo[(e + 2) % 3];
+    limbo[(e + 2) % 3] = NULL;
+    for(; r != NULL; r = next){
+        next = r->next;
+        r->release(r->obj);
+        free(r);
+    }
+}
+
+/*
+ * Defer releasing an object that has been unlinked from all shared
+ * structures until no reader can still be using it.
+ *
+ * @param release  The function to call to release the object.
+ * @param obj  The object.
+ */
+void epoch_retire(void (*release)(void *), void *obj) {
+    RETIRED *r = Malloc(sizeof(RETIRED));
+    r->release = release;
+    r->obj = obj;
+    pthread_mutex_lock(&limbo_lock);
+    unsigned long e = atomic_load(&global_epoch);
+    r->next = limbo[e % 3];
+    limbo[e % 3] = r;
+    epoch_try_advance();
+    pthread_mutex_unlock(&limbo_lock);
+}
+
+/*
+ * Wait until every retired object has been released.
+ * Must not be called from within a critical section.
+ */
+void epoch_barrier(void) {
+    while(1){
+        pthread_mutex_lock(&limbo_lock);
+        epoch_try_advance();
+        if(limbo[0] == NULL && limbo[1] == NULL && limbo[2] == NULL){
+            pthread_mutex_unlock(&limbo_lock);
+            return;
+        }
+        pthread_mutex_unlock(&limbo_lock);
+        sched_yield();
+    }
+}
@@ -0,0 +1,290 @@
+/*
+ * Event-driven serving mode.
+ * A small, fixed set of event-loop threads multiplexes all client TU
+ * connections using edge-triggered epoll.  Each connection is owned by
+ * exactly one loop, so its input is never processed concurrently.  A
+ * connection whose chat fills a slow recipient's output queue is paused,
+ * rather than blocking its loop: it is taken off EPOLLIN until the
+ * recipient drains, and then handed back to its loop to be read again.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "pbx.h"
+#include "server_extra.h"
+#include "tu_extra.h"
+#include "linebuf.h"
+#include "capture.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define EVENT_BATCH 64
+
+#define CONN_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+
+/* State kept for each client connection. */
+typedef struct pbx_conn{
+    TU *tu;
+    LINEBUF lb;
+    struct event_loop *loop;    /* The loop that owns the connection. */
+    TU_WAITER waiter;   /* Registered while the connection is paused. */
+    int paused;         /* Set while no input is read; used only by the loop. */
+    struct pbx_conn *next;  /* Link in the loop's list of resumed connections. */
+}PBX_CONN;
+
+/* State kept for each event-loop thread. */
+typedef struct event_loop{
+    int epfd;
+    int wakefd;     /* eventfd used to wake the loop, to resume connections or exit. */
+    pthread_mutex_t lock;   /* Protects resumed and stop. */
+    PBX_CONN *resumed;      /* Paused connections ready to be read again. */
+    int stop;
+    pthread_t tid;
+}EVENT_LOOP;
+
+static EVENT_LOOP *loops;
+static int nloops;
+static unsigned int next_loop;
+
+static void pbx_loop_wake(EVENT_LOOP *loop) {
+    uint64_t one = 1;
+    if(write(loop->wakefd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
+
+/*
+ * Stop reading from a connection whose chat recipient must first drain its
+ * output queue.  EPOLLIN is dropped, and any hangup still reported is
+ * ignored until the connection is resumed.
+ */
+static void pbx_conn_pause(PBX_CONN *conn) {
+    struct epoll_event ev;
+
+    conn->paused = 1;
+    ev.events = EPOLLET;
+    ev.data.ptr = conn;
+    if(epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->lb.fd, &ev) < 0)
+        debug("Failed to pause connection %d", conn->lb.fd);
+}
+
+/*
+ * Called, possibly on another thread, once the recipient that paused a
+ * connection has drained.  The connection is handed back to its own loop.
+ */
+static void pbx_conn_resume(TU_WAITER *w) {
+    PBX_CONN *conn = (PBX_CONN *)((char *)w - offsetof(PBX_CONN, waiter));
+    EVENT_LOOP *loop = conn->loop;
+
+    pthread_mutex_lock(&loop->lock);
+    conn->next = loop->resumed;
+    loop->resumed = conn;
+    pthread_mutex_unlock(&loop->lock);
+    pbx_loop_wake(loop);
+}
+
+/*
+ * Consume all input currently available on a connection, dispatching
+ * each complete line, until the connection is paused.  On EOF or error the
+ * connection is torn down in the same order as in pbx_client_service().
+ *
+ * @return 0 if the connection remains open, -1 if it was closed.
+ */
+static int pbx_conn_service(PBX_CONN *conn) {
+    char *line;
+    size_t len;
+    ssize_t n;
+
+    while(1){
+        while(linebuf_next(&conn->lb, &line, &len)){
+            if(pbx_client_dispatch(conn->tu, line, len, &conn->waiter)){
+                pbx_conn_pause(conn);
+                return 0;
+            }
+        }
+        if((n = linebuf_fill(&conn->lb)) > 0)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        break;
+    }
+
+    pbx_unregister(pbx, conn->tu);
+    capture_disconnect(conn->lb.fd);
+    close(conn->lb.fd);
+    free(conn);
+    return -1;
+}
+
+/*
+ * Read again from the connections that have been resumed, with EPOLLIN
+ * restored, picking up first any lines already buffered.
+ *
+ * @return 1 if the loop has been told to exit, otherwise 0.
+ */
+static int pbx_loop_woken(EVENT_LOOP *loop) {
+    struct epoll_event ev;
+    PBX_CONN *conn, *next;
+    uint64_t count;
+    int stop;
+
+    if(read(loop->wakefd, &count, sizeof(count)) < 0)
+        debug("eventfd read failed");
+    pthread_mutex_lock(&loop->lock);
+    conn = loop->resumed;
+    loop->resumed = NULL;
+    stop = loop->stop;
+    pthread_mutex_unlock(&loop->lock);
+
+    for(; conn != NULL; conn = next){
+        next = conn->next;
+        conn->paused = 0;
+        ev.events = CONN_EVENTS;
+        ev.data.ptr = conn;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->lb.fd, &ev) < 0)
+            debug("Failed to resume connection %d", conn->lb.fd);
+        pbx_conn_service(conn);
+    }
+    return stop;
+}
+
+/*
+ * Thread function for an event-loop thread.
+ * Resumed connections are serviced only after the batch of events, as
+ * servicing one may close it while an event for it is still pending.
+ */
+static void *pbx_event_loop(void *arg) {
+    EVENT_LOOP *loop = arg;
+    struct epoll_event events[EVENT_BATCH];
+    PBX_CONN *conn;
+    int i, n, woken;
+
+    while(1){
+        if((n = epoll_wait(loop->epfd, events, EVENT_BATCH, -1)) < 0){
+            if(errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        woken = 0;
+        for(i=0; i<n; i++){
+            if((conn = events[i].data.ptr) == NULL)
+                woken = 1;
+            else if(!conn->paused)
+                pbx_conn_service(conn);
+        }
+        if(woken && pbx_loop_woken(loop))
+            return NULL;
+    }
+}
+
+/*
+ * Start the event-loop threads.
+ *
+ * @param n  The number of event-loop threads to start.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_event_init(int n) {
+    struct epoll_event ev;
+    int i;
+
+    if((loops = calloc(n, sizeof(EVENT_LOOP))) == NULL)
+        return -1;
+    for(i=0; i<n; i++){
+        if((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            return -1;
+        if((loops[i].wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
+            return -1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd, &ev) < 0)
+            return -1;
+        pthread_mutex_init(&loops[i].lock, NULL);
+        Pthread_create(&loops[i].tid, NULL, pbx_event_loop, &loops[i]);
+    }
+    nloops = n;
+    debug("Started %d event loops", n);
+    return 0;
+}
+
+/*
+ * Hand a newly accepted client connection to one of the event loops.
+ * The TU is created and registered here; from then on all input on the
+ * connection is handled by the loop it was assigned to.
+ *
+ * @param client_fd  The file descriptor of the client connection.
+ * @return 0 if successful, otherwise -1, in which case the connection is closed.
+ */
+int pbx_event_add(int client_fd) {
+    PBX_CONN *conn;
+    EVENT_LOOP *loop;
+    TU *tu;
+    struct epoll_event ev;
+
+    if((tu = tu_init(client_fd)) == NULL){
+        fprintf(stderr, "Failed to initialize tu.\n");
+        close(client_fd);
+        return -1;
+    }
+    capture_connect(client_fd);
+    // On failure, free the TU, which has no references yet.
+    if(pbx_register(pbx, tu, client_fd) == -1){
+        fprintf(stderr, "Failed to register tu.\n");
+        tu_ref(tu, "Registration failed.\n");
+        tu_unref(tu, "Registration failed.\n");
+        capture_disconnect(client_fd);
+        close(client_fd);
+        return -1;
+    }
+    if((conn = malloc(sizeof(PBX_CONN))) == NULL){
+        pbx_unregister(pbx, tu);
+        capture_disconnect(client_fd);
+        close(client_fd);
+        return -1;
+    }
+    loop = &loops[next_loop++ % nloops];
+    conn->tu = tu;
+    linebuf_init(&conn->lb, client_fd);
+    conn->lb.rdflags = MSG_DONTWAIT;
+    conn->loop = loop;
+    conn->waiter.resume = pbx_conn_resume;
+    conn->paused = 0;
+
+    // Adding the descriptor reports any input that is already pending.
+    ev.events = CONN_EVENTS;
+    ev.data.ptr = conn;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0){
+        pbx_unregister(pbx, tu);
+        capture_disconnect(client_fd);
+        close(client_fd);
+        free(conn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Stop all event-loop threads and wait for them to exit.
+ * This should be called after pbx_shutdown(), once all connections are gone.
+ */
+void pbx_event_stop(void) {
+    int i;
+
+    for(i=0; i<nloops; i++){
+        pthread_mutex_lock(&loops[i].lock);
+        loops[i].stop = 1;
+        pthread_mutex_unlock(&loops[i].lock);
+        pbx_loop_wake(&loops[i]);
+    }
+    for(i=0; i<nloops; i++){
+        Pthread_join(loops[i].tid, NULL);
+        close(loops[i].wakefd);
+        close(loops[i].epfd);
+        pthread_mutex_destroy(&loops[i].lock);
+    }
+    free(loops);
+    loops = NULL;
+    nloops = 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Log-bucketed histograms.
+ */
+#include "hist.h"
+
+/*
+ * Clear a histogram.
+ */
+void hist_reset(HIST *h) {
+    int b;
+    atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+    for(b=0; b<HIST_BUCKETS; b++)
+        atomic_store_explicit(&h->buckets[b], 0, memory_order_relaxed);
+}
+
+/*
+ * Add the counts of one histogram to another, which only the calling
+ * thread may be writing.
+ */
+void hist_merge(HIST *into, HIST *from) {
+    uint64_t n, max;
+    int b;
+    for(b=0; b<HIST_BUCKETS; b++){
+        if((n = atomic_load_explicit(&from->buckets[b], memory_order_relaxed)) != 0)
+            hist_inc(&into->buckets[b], n);
+    }
+    hist_inc(&into->count, atomic_load_explicit(&from->count, memory_order_relaxed));
+    hist_inc(&into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed));
+    max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    if(max > atomic_load_explicit(&into->max, memory_order_relaxed))
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+}
+
+/*
+ * Get the largest value counted in a bucket.
+ */
+uint64_t hist_bucket_limit(int b) {
+    int shift;
+    if(b < HIST_SUB)
+        return b;
+    shift = b / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * Estimate a quantile of the recorded values, as the upper limit of the
+ * bucket in which it falls (but no more than the largest value recorded).
+ *
+ * @param q  The quantile, in [0, 1].
+ * @return the estimate, or 0 if the histogram is empty.
+ */
+uint64_t hist_quantile(HIST *h, double q) {
+    uint64_t count = 0, target, limit, max, n;
+    int b;
+
+    for(b=0; b<HIST_BUCKETS; b++)
+        count += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+    if(count == 0)
+        return 0;
+    target = q * count;
+    if(target < q * count || target == 0)
+        target++;
+    for(b=0; b<HIST_BUCKETS - 1; b++){
+        n = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        if(n >= target)
+            break;
+        target -= n;
+    }
+    limit = hist_bucket_limit(b);
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    return limit < max ? limit : max;
+}
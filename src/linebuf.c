@@ -0,0 +1,104 @@
+/*
+ * Buffered line framing for client connections.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "linebuf.h"
+#include "stats.h"
+
+/*
+ * Initialize a line buffer for reading from a file descriptor.
+ *
+ * @param lb  The line buffer.
+ * @param fd  The file descriptor to read from.
+ */
+void linebuf_init(LINEBUF *lb, int fd) {
+    lb->fd = fd;
+    lb->rdflags = 0;
+    lb->head = 0;
+    lb->tail = 0;
+    lb->scan = 0;
+    lb->discard = 0;
+}
+
+/*
+ * Read as much input as fits into the free space of the buffer, with a
+ * single recv().  Unconsumed bytes are first moved to the front of the buffer.
+ * If the buffer is full and contains no complete line, its contents are
+ * dropped and the rest of that line will be skipped.
+ *
+ * @param lb  The line buffer.
+ * @return the number of bytes read, 0 on EOF, or -1 on error.
+ */
+ssize_t linebuf_fill(LINEBUF *lb) {
+    if(lb->head > 0){
+        memmove(lb->buf, lb->buf + lb->head, lb->tail - lb->head);
+        lb->tail -= lb->head;
+        lb->scan -= lb->head;
+        lb->head = 0;
+    }
+    if(lb->tail == LINEBUF_SIZE){
+        lb->tail = 0;
+        lb->scan = 0;
+        lb->discard = 1;
+    }
+
+    ssize_t n;
+    while((n = recv(lb->fd, lb->buf + lb->tail, LINEBUF_SIZE - lb->tail, lb->rdflags)) < 0){
+        if(errno != EINTR)
+            return -1;
+    }
+    lb->tail += n;
+    stat_add(STAT_BYTES_IN, n);
+    return n;
+}
+
+/*
+ * Extract the next complete line already present in the buffer.
+ * No input is performed.
+ *
+ * @param lb  The line buffer.
+ * @param line  Set to point at the first byte of the line.
+ * @param len  Set to the length of the line, not counting the EOL.
+ * @return 1 if a line was extracted, 0 if more input is needed.
+ */
+int linebuf_next(LINEBUF *lb, char **line, size_t *len) {
+    char *nl;
+    while((nl = memchr(lb->buf + lb->scan, '\n', lb->tail - lb->scan)) != NULL){
+        char *start = lb->buf + lb->head;
+        lb->head = lb->scan = (nl - lb->buf) + 1;
+        if(lb->discard){
+            lb->discard = 0;
+            continue;
+        }
+        if(nl > start && *(nl-1) == '\r')
+            nl--;
+        *nl = 0;
+        *line = start;
+        *len = nl - start;
+        return 1;
+    }
+    lb->scan = lb->tail;
+    if(lb->head == lb->tail)
+        lb->head = lb->tail = lb->scan = 0;
+    return 0;
+}
+
+/*
+ * Read the next line, blocking as necessary.
+ *
+ * @param lb  The line buffer.
+ * @param line  Set to point at the first byte of the line.
+ * @return the length of the line, or -1 on EOF or error.
+ */
+ssize_t linebuf_readline(LINEBUF *lb, char **line) {
+    size_t len;
+    while(!linebuf_next(lb, line, &len)){
+        if(linebuf_fill(lb) <= 0)
+            return -1;
+    }
+    return len;
+}
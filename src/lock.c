@@ -0,0 +1,79 @@
+/*
+ * Slow paths of the adaptive futex lock.
+ */
+#include "lock.h"
+
+#ifdef LOCK_FUTEX
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void lock_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int lock_spins = 1;
+static pthread_once_t lock_spins_once = PTHREAD_ONCE_INIT;
+
+/* Spinning can only help if the holder of a lock may be running meanwhile. */
+static void lock_spins_init(void) {
+    lock_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
+
+static void futex(atomic_int *addr, int op, int val) {
+    syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/*
+ * Move the spin estimate of a lock one eighth of the way towards n.
+ * Only a hint, so concurrent updates may be lost.
+ */
+static void lock_adapt(LOCK_RAW *lk, int n) {
+    int spin = atomic_load_explicit(&lk->spin, memory_order_relaxed);
+    atomic_store_explicit(&lk->spin, spin + (n - spin) / 8, memory_order_relaxed);
+}
+
+/*
+ * Wait for a lock that was found to be held, and acquire it.
+ * The waiter first spins for up to twice the number of iterations recently
+ * needed to acquire the lock.  If that succeeds, the estimate follows the
+ * number of iterations taken; if not, it shrinks, since the lock is being
+ * held too long for spinning to pay, and the waiter sleeps on the futex.
+ * On a uniprocessor the waiter sleeps at once.
+ */
+void lock_wait(LOCK_RAW *lk) {
+    int limit = 2 * atomic_load_explicit(&lk->spin, memory_order_relaxed);
+    int n;
+
+    pthread_once(&lock_spins_once, lock_spins_init);
+    if(!lock_spins)
+        limit = 0;
+    else if(limit > LOCK_SPIN_MAX)
+        limit = LOCK_SPIN_MAX;
+    for(n=0; n<limit; n++){
+        lock_pause();
+        if(atomic_load_explicit(&lk->state, memory_order_relaxed) == 0 && lock_raw_try(lk)){
+            lock_adapt(lk, n < LOCK_SPIN_MIN ? LOCK_SPIN_MIN : n);
+            return;
+        }
+    }
+    if(limit > 0)
+        lock_adapt(lk, LOCK_SPIN_MIN);
+
+    /* Mark the lock as having sleepers, so that its holder wakes one. */
+    while(atomic_exchange_explicit(&lk->state, 2, memory_order_acquire) != 0)
+        futex(&lk->state, FUTEX_WAIT_PRIVATE, 2);
+}
+
+/*
+ * Wake one thread sleeping on a lock that has just been released.
+ */
+void lock_wake(LOCK_RAW *lk) {
+    futex(&lk->state, FUTEX_WAKE_PRIVATE, 1);
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Lock contention and hold-time statistics.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "lock.h"
+
+#ifdef LOCK_STATS
+
+/* Statistics recorded by one thread. */
+typedef struct lockstat_thread{
+    LOCKSTAT cls[LOCK_NUM_CLASSES];
+    struct lockstat_thread *prev, *next;
+}LOCKSTAT_THREAD;
+
+static const char *lockstat_names[LOCK_NUM_CLASSES] = {
+    [LOCK_CLASS_REGISTRY] = "registry",
+    [LOCK_CLASS_TU] = "tu",
+    [LOCK_CLASS_CALL] = "call",
+    [LOCK_CLASS_OTHER] = "other"
+};
+
+static __thread LOCKSTAT_THREAD *self;
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+/* Threads' statistics; protected by stats_lock, as is everything below. */
+static LOCKSTAT_THREAD *threads;
+static LOCKSTAT exited[LOCK_NUM_CLASSES];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Times at which statistics began, to convert TSC ticks to nanoseconds. */
+static uint64_t base_ticks;
+static struct timespec base_time;
+
+static void lockstat_merge(LOCKSTAT *into, LOCKSTAT *from) {
+    hist_inc(&into->contended, atomic_load_explicit(&from->contended, memory_order_relaxed));
+    hist_merge(&into->wait, &from->wait);
+    hist_merge(&into->hold, &from->hold);
+}
+
+/*
+ * Destructor for a thread's statistics: fold them into those of exited
+ * threads.
+ */
+static void self_release(void *arg) {
+    LOCKSTAT_THREAD *ts = arg;
+    int c;
+
+    pthread_mutex_lock(&stats_lock);
+    for(c=0; c<LOCK_NUM_CLASSES; c++)
+        lockstat_merge(&exited[c], &ts->cls[c]);
+    if(ts->prev != NULL)
+        ts->prev->next = ts->next;
+    else
+        threads = ts->next;
+    if(ts->next != NULL)
+        ts->next->prev = ts->prev;
+    pthread_mutex_unlock(&stats_lock);
+    self = NULL;
+    free(ts);
+}
+
+static void self_init(void) {
+    pthread_key_create(&self_key, self_release);
+    base_ticks = lockstat_now();
+    clock_gettime(CLOCK_MONOTONIC, &base_time);
+}
+
+/*
+ * Get the statistics of the calling thread, creating them on first use.
+ *
+ * @return the statistics, or NULL if out of memory.
+ */
+static LOCKSTAT_THREAD *self_get(void) {
+    LOCKSTAT_THREAD *ts;
+
+    if(self != NULL)
+        return self;
+    pthread_once(&self_once, self_init);
+    if((ts = calloc(1, sizeof(LOCKSTAT_THREAD))) == NULL)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    ts->prev = NULL;
+    if((ts->next = threads) != NULL)
+        threads->prev = ts;
+    threads = ts;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(self_key, ts);
+    return self = ts;
+}
+
+/*
+ * Record an acquisition of a lock of a given class.
+ *
+ * @param wait  The time waited, in ticks.
+ * @param contended  Nonzero if the lock was not free.
+ */
+void lockstat_acquired(int cls, uint64_t wait, int contended) {
+    LOCKSTAT_THREAD *ts;
+    if((ts = self_get()) == NULL)
+        return;
+    if(contended)
+        hist_inc(&ts->cls[cls].contended, 1);
+    hist_record(&ts->cls[cls].wait, wait);
+}
+
+/*
+ * Record the release of a lock of a given class.
+ *
+ * @param held  The time for which it was held, in ticks.
+ */
+void lockstat_released(int cls, uint64_t held) {
+    LOCKSTAT_THREAD *ts;
+    if((ts = self_get()) == NULL)
+        return;
+    hist_record(&ts->cls[cls].hold, held);
+}
+
+const char *lockstat_class_name(int cls) {
+    return lockstat_names[cls];
+}
+
+/*
+ * Get the length of a tick, measured against CLOCK_MONOTONIC over the time
+ * since statistics began.
+ */
+double lockstat_ns_per_tick(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec now;
+    uint64_t ticks;
+    double ns;
+
+    pthread_once(&self_once, self_init);
+    do{
+        ticks = lockstat_now() - base_ticks;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = (now.tv_sec - base_time.tv_sec) * 1e9 + (now.tv_nsec - base_time.tv_nsec);
+        if(ns < 1e7)
+            nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+    }while(ns < 1e7);
+    return ns / ticks;
+#else
+    return 1.0;
+#endif
+}
+
+/*
+ * Collect the statistics of a lock class over all threads, live or exited.
+ *
+ * @param st  Set to the combined statistics.
+ */
+void lockstat_collect(int cls, LOCKSTAT *st) {
+    LOCKSTAT_THREAD *ts;
+
+    atomic_store_explicit(&st->contended, 0, memory_order_relaxed);
+    hist_reset(&st->wait);
+    hist_reset(&st->hold);
+    pthread_mutex_lock(&stats_lock);
+    lockstat_merge(st, &exited[cls]);
+    for(ts = threads; ts != NULL; ts = ts->next)
+        lockstat_merge(st, &ts->cls[cls]);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Print the statistics of each lock class: the number of acquisitions, how
+ * many of them had to wait, and percentiles of wait and hold times.
+ *
+ * @param out  Where to print.
+ * @return the number of classes printed.
+ */
+int lockstat_dump(FILE *out) {
+    static LOCKSTAT st;
+    static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+    double scale = lockstat_ns_per_tick();
+    int c;
+
+    pthread_mutex_lock(&dump_lock);
+    fprintf(out, "%-8s %12s %10s %10s %10s %10s %10s %10s %10s  (ns)\n", "lock", "acquires",
+            "contended", "wait p50", "wait p99", "wait max", "hold p50", "hold p99", "hold max");
+    for(c=0; c<LOCK_NUM_CLASSES; c++){
+        lockstat_collect(c, &st);
+        fprintf(out, "%-8s %12lu %10lu %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+                lockstat_names[c], atomic_load(&st.wait.count), atomic_load(&st.contended),
+                hist_quantile(&st.wait, 0.5) * scale, hist_quantile(&st.wait, 0.99) * scale,
+                atomic_load(&st.wait.max) * scale, hist_quantile(&st.hold, 0.5) * scale,
+                hist_quantile(&st.hold, 0.99) * scale, atomic_load(&st.hold.max) * scale);
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return c;
+}
+
+#else
+
+int lockstat_dump(FILE *out) {
+    return 0;
+}
+
+#endif
@@ -1,50 +1,163 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/select.h>
+#include <netinet/tcp.h>
 
 #include "pbx.h"
 #include "server.h"
+#include "server_extra.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "lock.h"
+#include "cmdstat.h"
+#include "stats.h"
+#include "shmstat.h"
+#include "capture.h"
 #include "debug.h"
 #include "csapp.h"
 
 static volatile sig_atomic_t got_hup_signal = 0;
+static volatile sig_atomic_t got_usr1_signal = 0;
 
 static void terminate(int status);
 
+/*
+ * Ways of serving client connections.
+ *   MODE_THREAD: one service thread per connection (the default).
+ *   MODE_EPOLL: a fixed set of event-loop threads multiplexing all connections.
+ *   MODE_POOL: a fixed pool of worker threads fed from a bounded queue.
+ */
+typedef enum serve_mode {
+    MODE_THREAD, MODE_EPOLL, MODE_POOL
+} SERVE_MODE;
+
+static SERVE_MODE mode = MODE_THREAD;
+
+#define DEFAULT_POOL_THREADS 64
+
+// How often to retry queueing a connection while the pool queue is full.
+#define POOL_RETRY_NS 10000000
+
+#define USAGE "usage: -p <port> [-m thread|epoll|pool] [-n <threads>] [-q <queue size>] [-x <max extensions>]" \
+              " [-w <output high-water bytes>] [-o pause|drop|disconnect] [-a <local admin port>]" \
+              " [-s <shm name>] [-c <capture file>]%s"
+
 static void hup_handler(int sig){
     got_hup_signal = 1;
 }
 
+static void usr1_handler(int sig){
+    got_usr1_signal = 1;
+}
+
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-m thread|epoll|pool] [-n <threads>] [-q <queue size>]
+ *            [-x <max extensions>] [-w <output high-water bytes>]
+ *            [-o pause|drop|disconnect] [-a <local admin port>] [-s <shm name>]
+ *            [-c <capture file>]
+ *
+ * The number of threads applies to the event loops in epoll mode and to the
+ * workers in pool mode.  The queue size applies only to pool mode.
+ * The maximum number of extensions bounds the growth of the PBX registry.
+ * The high-water mark and policy govern output to clients that do not keep
+ * up (see tu_extra.h); in epoll mode a paused chat sender is only taken
+ * off its event loop, which goes on serving other clients.  SIGUSR1 prints the output queue of each client
+ * to stderr, followed by command latencies and, in builds with LOCK_STATS,
+ * lock statistics.  If an admin port is given, the same statistics, with
+ * counts of TUs, calls and traffic, are served on that port of 127.0.0.1
+ * only, in the Prometheus text format (see admin.c).  If a shared-memory name (e.g. /pbx) is given,
+ * counters and the state of every extension are published in a segment of
+ * that name, for pbxtop (see shmstat.h).  If a capture file is given, all
+ * client traffic is recorded in it, for pbx_replay (see capture.h).
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
 
-    // Parse port number.
-    if(argc > 3){
-        fprintf(stderr, "usage: -p <port>%s", EOL);
-        exit(EXIT_SUCCESS);
-    }
-
-    char *portno;
+    // Parse port number and serving mode.
+    char *portno = NULL, *adminport = NULL, *shmname = NULL, *capname = NULL;
+    int nthreads = 0, qcap = 0;
+    long hiwat = TU_DEFAULT_OUTPUT_HIWAT;
+    TU_OUTPUT_POLICY policy = TU_OUTPUT_PAUSE;
     int opt;
-    while((opt = getopt(argc, argv, "-:p:")) != -1)
+    while((opt = getopt(argc, argv, "-:p:m:n:q:x:w:o:a:s:c:")) != -1)
     {
         switch(opt)
         {
             case 'p':
                 portno = optarg;
                 break;
+            case 'a':
+                adminport = optarg;
+                break;
+            case 's':
+                shmname = optarg;
+                break;
+            case 'c':
+                capname = optarg;
+                break;
+            case 'm':
+                if(strcmp(optarg, "thread") == 0)
+                    mode = MODE_THREAD;
+                else if(strcmp(optarg, "epoll") == 0)
+                    mode = MODE_EPOLL;
+                else if(strcmp(optarg, "pool") == 0)
+                    mode = MODE_POOL;
+                else{
+                    fprintf(stderr, USAGE, EOL);
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'n':
+                if((nthreads = atoi(optarg)) <= 0){
+                    fprintf(stderr, USAGE, EOL);
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'q':
+                if((qcap = atoi(optarg)) <= 0){
+                    fprintf(stderr, USAGE, EOL);
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'x':
+                if(pbx_set_max_extensions(atoi(optarg)) < 0){
+                    fprintf(stderr, USAGE, EOL);
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'w':
+                if((hiwat = atol(optarg)) <= 0){
+                    fprintf(stderr, USAGE, EOL);
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'o':
+                if(strcmp(optarg, "pause") == 0)
+                    policy = TU_OUTPUT_PAUSE;
+                else if(strcmp(optarg, "drop") == 0)
+                    policy = TU_OUTPUT_DROP;
+                else if(strcmp(optarg, "disconnect") == 0)
+                    policy = TU_OUTPUT_DISCONNECT;
+                else{
+                    fprintf(stderr, USAGE, EOL);
+                    exit(EXIT_SUCCESS);
+                }
+                break;
             default:
-                fprintf(stderr, "usage: -p <port>%s", EOL);
+                fprintf(stderr, USAGE, EOL);
                 exit(EXIT_SUCCESS);
         }
     }
+    if(portno == NULL){
+        fprintf(stderr, USAGE, EOL);
+        exit(EXIT_SUCCESS);
+    }
+    tu_set_output_limit(hiwat, policy);
 
     // Perform required initialization of the PBX module.
     debug("Initializing PBX...");
@@ -62,6 +175,17 @@ int main(int argc, char* argv[]){
     sigemptyset(&action.sa_mask);
     action.sa_flags = 0;
     sigaction(SIGHUP, &action, &old_action);
+    action.sa_handler = usr1_handler;
+    sigaction(SIGUSR1, &action, NULL);
+
+    // Keep SIGHUP and SIGUSR1 blocked except while this thread waits for a
+    // connection, so that they are never taken by a service thread, all of
+    // which inherit the blocked mask.
+    sigset_t hupmask, waitmask;
+    sigemptyset(&hupmask);
+    sigaddset(&hupmask, SIGHUP);
+    sigaddset(&hupmask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &hupmask, &waitmask);
 
     // Ignore SIGPIPE
     struct sigaction ignact;
@@ -75,19 +199,96 @@ int main(int argc, char* argv[]){
     struct sockaddr_storage clientaddr;
     pthread_t tid;
 
+    if(mode == MODE_EPOLL){
+        if(nthreads == 0){
+            long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+            nthreads = ncpus > 0 ? ncpus : 1;
+        }
+        if(pbx_event_init(nthreads) < 0){
+            fprintf(stderr, "Failed to start event loops.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(mode == MODE_POOL){
+        if(nthreads == 0)
+            nthreads = DEFAULT_POOL_THREADS;
+        if(pbx_pool_init(nthreads, qcap ? qcap : 2*nthreads) < 0){
+            fprintf(stderr, "Failed to start worker pool.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(shmname != NULL && shmstat_init(shmname, pbx_get_max_extensions()) < 0){
+        fprintf(stderr, "Failed to create shared-memory statistics.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(capname != NULL && capture_init(capname) < 0){
+        fprintf(stderr, "Failed to open capture file.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(adminport != NULL && pbx_admin_init(adminport) < 0){
+        fprintf(stderr, "Failed to start admin listener.\n");
+        exit(EXIT_FAILURE);
+    }
+
     listenfd = Open_listenfd(portno);
+    fd_set listenset;
+    // In pool mode, a connection accepted while the queue was full, which
+    // is held here, without accepting more, until a slot frees up.
+    int pending = -1;
+    struct timespec retry = { 0, POOL_RETRY_NS };
     while(1){
 
+        // Atomically unblock SIGHUP and SIGUSR1 while waiting.
+        FD_ZERO(&listenset);
+        if(pending < 0)
+            FD_SET(listenfd, &listenset);
+        int ready = pselect(listenfd+1, &listenset, NULL, NULL,
+                            pending < 0 ? NULL : &retry, &waitmask);
+        if(got_hup_signal)
+            break;
+        if(got_usr1_signal){
+            got_usr1_signal = 0;
+            pbx_dump_queues(pbx, stderr);
+            cmdstat_dump(stderr);
+            lockstat_dump(stderr);
+        }
+        if(pending >= 0){
+            if(pbx_pool_add(pending) == 0)
+                pending = -1;
+            continue;
+        }
+        if(ready <= 0)
+            continue;
+
         clientlen = sizeof(struct sockaddr_storage);
         connfdp = Malloc(sizeof(int));
         *connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen);
-        if(got_hup_signal){
-            close(*connfdp);
+        if(*connfdp < 0){
             free(connfdp);
-            break;
+            continue;
+        }
+        stat_add(STAT_CONNECTIONS, 1);
+
+        // Notifications are small writes that must not wait behind
+        // delayed ACKs for earlier ones.
+        int one = 1;
+        setsockopt(*connfdp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(mode == MODE_EPOLL){
+            pbx_event_add(*connfdp);
+            free(connfdp);
+            continue;
+        }
+        if(mode == MODE_POOL){
+            if(pbx_pool_add(*connfdp) < 0)
+                pending = *connfdp;
+            free(connfdp);
+            continue;
         }
         Pthread_create(&tid, NULL, pbx_client_service, connfdp);
     }
+    if(pending >= 0)
+        close(pending);
     close(listenfd);
     terminate(EXIT_SUCCESS);
 
@@ -102,7 +303,19 @@ int main(int argc, char* argv[]){
  */
 static void terminate(int status) {
     debug("Shutting down PBX...");
+    pbx_admin_stop();
+    if(mode == MODE_POOL)
+        pbx_pool_stop();
     pbx_shutdown(pbx);
+    if(mode == MODE_EPOLL)
+        pbx_event_stop();
+    capture_stop();
+    shmstat_stop();
+    SLAB_STATS st;
+    if(tu_pool_stats(&st) == 0)
+        debug("TU pool: %lu allocs, %lu%% cache hits, %lu refills, %ld objects, %ld in use, high water %ld",
+              st.allocs, st.allocs ? st.cache_hits * 100 / st.allocs : 0, st.depot_refills,
+              st.objects, st.in_use, st.high_water);
     debug("PBX server terminating");
     pthread_exit(NULL);
 }
@@ -2,9 +2,16 @@
  * PBX: simulates a Private Branch Exchange.
  */
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <semaphore.h>
 
 #include "pbx.h"
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "epoch.h"
+#include "lock.h"
+#include "stats.h"
 #include "debug.h"
 #include "csapp.h"
 
@@ -16,13 +23,120 @@
 //     TU *tu_ptr;
 // }PBX_NODE;
 
+#define PBX_CHUNK_MASK (PBX_CHUNK_SIZE - 1)
+#define PBX_BITMAP_WORDS (PBX_CHUNK_SIZE / 64)
+
+/*
+ * The registry is held in fixed-size chunks, reached through directories
+ * that are allocated once, at their full size, by pbx_init().  Growing the
+ * registry allocates one more chunk; nothing is ever moved, so pointers
+ * into chunks remain valid until pbx_shutdown().
+ *
+ * Registration and unregistration are serialized by the mutex.  Lookups
+ * through the extension index take no lock: index entries and directory
+ * entries are published with release stores and read with acquire loads,
+ * and lookups run inside an epoch critical section.  The reference that
+ * the PBX holds on a TU is released only after a grace period, so a TU
+ * found by a lookup cannot be freed while the lookup is still using it.
+ */
+
+/* A chunk of slots holding registered TUs. */
+typedef struct slot_chunk{
+    TU *tu_storage[PBX_CHUNK_SIZE];
+    int free_next[PBX_CHUNK_SIZE];      /* Next slot on the free stack, for an unused slot. */
+    uint64_t occupied[PBX_BITMAP_WORDS]; /* Bit i set iff tu_storage[i] is in use. */
+}SLOT_CHUNK;
+
+/* A chunk of the extension index. */
+typedef struct ext_chunk{
+    _Atomic(TU *) tu[PBX_CHUNK_SIZE];   /* Registered TU for each extension number. */
+    int slot[PBX_CHUNK_SIZE];           /* Its slot number; protected by the mutex. */
+}EXT_CHUNK;
+
 typedef struct pbx{
-    TU *tu_storage[PBX_MAX_EXTENSIONS];
-    sem_t mutex;
+    SLOT_CHUNK **slots;                 /* Directory of slot chunks. */
+    _Atomic(EXT_CHUNK *) *exts;         /* Directory of extension index chunks. */
+    int max_chunks;                     /* Size of each directory. */
+    int nslot_chunks;                   /* Slot chunks allocated so far. */
+    int free_top;                       /* Top of the free-slot stack, or -1. */
+    LOCK mutex;
     sem_t shutdown_flag;
     int active_tu;
 }PBX;
 
+static int pbx_max_extensions = PBX_DEFAULT_MAX_EXTENSIONS;
+
+/*
+ * Set the ceiling on the number of extensions for PBXs created by
+ * subsequent calls to pbx_init().
+ *
+ * @param max  The ceiling, which must be positive.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_set_max_extensions(int max) {
+    if(max <= 0 || max > INT32_MAX - PBX_CHUNK_SIZE)
+        return -1;
+    pbx_max_extensions = max;
+    return 0;
+}
+
+/*
+ * Get the ceiling on the number of extensions, rounded up to a whole
+ * number of chunks.
+ */
+int pbx_get_max_extensions(void) {
+    return (pbx_max_extensions + PBX_CHUNK_SIZE - 1) & ~(PBX_CHUNK_SIZE - 1);
+}
+
+/* Get the slot chunk and offset of a slot number. */
+#define SLOT_CHUNK_OF(pbx, i) ((pbx)->slots[(i) >> PBX_CHUNK_BITS])
+#define CHUNK_OFFSET(i) ((i) & PBX_CHUNK_MASK)
+
+/*
+ * Look up the TU registered at an extension number.
+ * Must be called with the mutex held or inside an epoch critical section.
+ *
+ * @return the TU, or NULL if none is registered there.
+ */
+static TU *pbx_lookup(PBX *pbx, int ext) {
+    EXT_CHUNK *ec;
+    if(ext < 0 || (ext >> PBX_CHUNK_BITS) >= pbx->max_chunks)
+        return NULL;
+    if((ec = atomic_load_explicit(&pbx->exts[ext >> PBX_CHUNK_BITS], memory_order_acquire)) == NULL)
+        return NULL;
+    return atomic_load_explicit(&ec->tu[CHUNK_OFFSET(ext)], memory_order_acquire);
+}
+
+/* Release the reference the PBX held on an unregistered TU. */
+static void pbx_release_tu(void *tu) {
+    tu_unref(tu, "TU unregistered from pbx.");
+}
+
+/*
+ * Add one more chunk of slots and push its slots on the free stack.
+ * Must be called with the mutex held.
+ *
+ * @return 0 if successful, -1 if the ceiling has been reached or
+ * allocation fails.
+ */
+static int pbx_grow(PBX *pbx) {
+    SLOT_CHUNK *sc;
+    int base, i;
+    if(pbx->nslot_chunks == pbx->max_chunks)
+        return -1;
+    if((sc = calloc(1, sizeof(SLOT_CHUNK))) == NULL)
+        return -1;
+    base = pbx->nslot_chunks << PBX_CHUNK_BITS;
+    /* Push slots in reverse, so that the lowest slots are handed out first. */
+    for(i=PBX_CHUNK_SIZE-1; i>=0; i--){
+        sc->free_next[i] = pbx->free_top;
+        pbx->free_top = base + i;
+    }
+    pbx->slots[pbx->nslot_chunks++] = sc;
+    debug("PBX grown to %d slots", pbx->nslot_chunks << PBX_CHUNK_BITS);
+    return 0;
+}
+
 /*
  * Initialize a new PBX.
  *
@@ -35,7 +149,18 @@ PBX *pbx_init() {
     if( (pbx_storage = (PBX *)calloc(1, sizeof(PBX))) == NULL ){
         return NULL;
     }
-    sem_init(&(pbx_storage->mutex), 0, 1);
+    pbx_storage->max_chunks = (pbx_max_extensions + PBX_CHUNK_SIZE - 1) >> PBX_CHUNK_BITS;
+    pbx_storage->slots = calloc(pbx_storage->max_chunks, sizeof(SLOT_CHUNK *));
+    pbx_storage->exts = calloc(pbx_storage->max_chunks, sizeof(EXT_CHUNK *));
+    if(pbx_storage->slots == NULL || pbx_storage->exts == NULL){
+        free(pbx_storage->slots);
+        free(pbx_storage->exts);
+        free(pbx_storage);
+        return NULL;
+    }
+    pbx_storage->nslot_chunks = 0;
+    pbx_storage->free_top = -1;
+    lock_init(&(pbx_storage->mutex), LOCK_CLASS_REGISTRY);
     sem_init(&(pbx_storage->shutdown_flag), 0, 1);
     pbx_storage->active_tu = 0;
     return pbx_storage;
@@ -53,20 +178,73 @@ PBX *pbx_init() {
  */
 void pbx_shutdown(PBX *pbx) {
 
-    /* Loop through pbx. */
-    int i, tufd;
-    TU *current_tu;
-    for(i=0; i<PBX_MAX_EXTENSIONS; i++){
-        if((current_tu=pbx->tu_storage[i])!=NULL){
-            tufd=tu_fileno(current_tu);
-            shutdown(tufd, SHUT_RDWR);
+    /* Visit only occupied slots, a bitmap word at a time. */
+    int c, w, i, tufd;
+    uint64_t bits;
+    SLOT_CHUNK *sc;
+    lock_acquire(&(pbx->mutex));
+    for(c=0; c<pbx->nslot_chunks; c++){
+        sc = pbx->slots[c];
+        for(w=0; w<PBX_BITMAP_WORDS; w++){
+            for(bits=sc->occupied[w]; bits!=0; bits&=bits-1){
+                i = w*64 + __builtin_ctzll(bits);
+                tufd=tu_fileno(sc->tu_storage[i]);
+                shutdown(tufd, SHUT_RDWR);
+            }
         }
     }
+    lock_release(&(pbx->mutex));
 
     // wait for semaphore here, when count = 0, call post inside unregister
     // sem_wait
     P(&(pbx->shutdown_flag));
+    tu_output_shutdown();
+    epoch_barrier();
+    for(c=0; c<pbx->max_chunks; c++){
+        free(pbx->slots[c]);
+        free(pbx->exts[c]);
+    }
+    free(pbx->slots);
+    free(pbx->exts);
     free(pbx);
+    if(tu_report_leaks(stderr) > 0)
+        debug("TUs remain after PBX shutdown");
+}
+
+/*
+ * Print the output queue state of each registered TU, one line per
+ * extension: queued bytes, high-water mark of the queue, chat messages
+ * dropped, and whether output is waiting for the socket to drain.
+ *
+ * @param pbx  The PBX registry.
+ * @param out  Where to print.
+ * @return the number of TUs printed.
+ */
+int pbx_dump_queues(PBX *pbx, FILE *out) {
+    int c, w, i, n = 0;
+    uint64_t bits;
+    SLOT_CHUNK *sc;
+    TU_OUTPUT_STATS st;
+    TU *tu;
+
+    fprintf(out, "%8s %10s %10s %8s %s\n", "ext", "queued", "max", "dropped", "state");
+    lock_acquire(&(pbx->mutex));
+    for(c=0; c<pbx->nslot_chunks; c++){
+        sc = pbx->slots[c];
+        for(w=0; w<PBX_BITMAP_WORDS; w++){
+            for(bits=sc->occupied[w]; bits!=0; bits&=bits-1){
+                i = w*64 + __builtin_ctzll(bits);
+                tu = sc->tu_storage[i];
+                tu_output_stats(tu, &st);
+                fprintf(out, "%8d %10zu %10zu %8lu %s\n", tu_extension(tu), st.queued,
+                        st.max_queued, st.dropped,
+                        st.evicted ? "evicted" : st.blocked ? "blocked" : "ok");
+                n++;
+            }
+        }
+    }
+    lock_release(&(pbx->mutex));
+    return n;
 }
 
 /*
@@ -77,6 +255,8 @@ void pbx_shutdown(PBX *pbx) {
  *for as long as the TU remains registered.
  * A notification of the assigned extension number is sent to the underlying network
  * client.
+ * Registration fails if the extension number is outside [0, ceiling), where
+ * the ceiling is set by pbx_set_max_extensions(), or is already in use.
  *
  * @param pbx  The PBX registry.
  * @param tu  The TU to be registered.
@@ -84,28 +264,47 @@ void pbx_shutdown(PBX *pbx) {
  * @return 0 if registration succeeds, otherwise -1.
  */
 int pbx_register(PBX *pbx, TU *tu, int ext) {
-    P(&(pbx->mutex));
-    if(tu_set_extension(tu, ext) < 0){
-        V(&(pbx->mutex));
+    if(tu == NULL)
+        return -1;
+    lock_acquire(&(pbx->mutex));
+    if(ext < 0 || (ext >> PBX_CHUNK_BITS) >= pbx->max_chunks || pbx_lookup(pbx, ext) != NULL){
+        lock_release(&(pbx->mutex));
         return -1;
     }
-    /* Loop the array and store tu in an empty slot. */
-    int i;
-    for(i=0; i<PBX_MAX_EXTENSIONS; i++){
-        if(pbx->tu_storage[i]==NULL){
-            pbx->tu_storage[i]=tu;
-            tu_ref(tu, "TU registered to pbx.");\
-            // Write ON HOOK 4
-            if(pbx->active_tu == 0){
-                P(&(pbx->shutdown_flag));
-            }
-            (pbx->active_tu)++;
-            V(&(pbx->mutex));
-            return 0;
+    /* Make sure there is a free slot and an index chunk for ext. */
+    if(pbx->free_top < 0 && pbx_grow(pbx) < 0){
+        lock_release(&(pbx->mutex));
+        return -1;
+    }
+    EXT_CHUNK *ec = atomic_load_explicit(&pbx->exts[ext >> PBX_CHUNK_BITS], memory_order_relaxed);
+    if(ec == NULL){
+        if((ec = calloc(1, sizeof(EXT_CHUNK))) == NULL){
+            lock_release(&(pbx->mutex));
+            return -1;
         }
+        atomic_store_explicit(&pbx->exts[ext >> PBX_CHUNK_BITS], ec, memory_order_release);
     }
-    V(&(pbx->mutex));
-    return -1;
+    /* Store tu in a slot taken from the free stack. */
+    int i = pbx->free_top;
+    SLOT_CHUNK *sc = SLOT_CHUNK_OF(pbx, i);
+    pbx->free_top = sc->free_next[CHUNK_OFFSET(i)];
+    sc->tu_storage[CHUNK_OFFSET(i)]=tu;
+    sc->occupied[CHUNK_OFFSET(i)/64] |= (uint64_t)1 << (i%64);
+    ec->slot[CHUNK_OFFSET(ext)]=i;
+    tu_ref(tu, "TU registered to pbx.");
+    /*
+     * Publish the TU before its client is told its extension, so that a
+     * dial by anyone who has learned the extension is sure to find it.
+     */
+    atomic_store_explicit(&ec->tu[CHUNK_OFFSET(ext)], tu, memory_order_release);
+    tu_set_extension(tu, ext);
+    if(pbx->active_tu == 0){
+        P(&(pbx->shutdown_flag));
+    }
+    (pbx->active_tu)++;
+    stat_add(STAT_REGISTERED, 1);
+    lock_release(&(pbx->mutex));
+    return 0;
 
 }
 
@@ -115,7 +314,11 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
  * The TU is disassociated from its extension number.
  * Then a hangup operation is performed on the TU to cancel any
  * call that might be in progress.
- * Finally, the reference held by the PBX to the TU is released.
+ * Finally, the reference held by the PBX to the TU is released, once no
+ * concurrent pbx_dial() can still be using the TU.
+ * Only the removal from the index and the slots is done under the mutex:
+ * hanging up and disconnecting may wait for output to the client, which
+ * must not hold up other registrations.
  *
  * @param pbx  The PBX.
  * @param tu  The TU to be unregistered.
@@ -123,32 +326,46 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
  */
 //#if 0
 int pbx_unregister(PBX *pbx, TU *tu) {
-    P(&(pbx->mutex));
-    /* Loop through pbx. */
-    int i;
-    for(i=0; i<PBX_MAX_EXTENSIONS; i++){
-        if(pbx->tu_storage[i]==tu){
-            tu_hangup(tu);
-            pbx->tu_storage[i]=NULL;
-            tu_unref(tu, "TU unregistered from pbx.");
-
-            // if active tu == 0, post(semaphore)
-            (pbx->active_tu)--;
-            if(pbx->active_tu == 0){
-                V(&(pbx->shutdown_flag));
-            }
+    lock_acquire(&(pbx->mutex));
+    /* Find the slot through the extension index. */
+    int ext = tu_extension(tu);
+    if(pbx_lookup(pbx, ext) != tu){
+        lock_release(&(pbx->mutex));
+        return -1;
+    }
+    EXT_CHUNK *ec = atomic_load_explicit(&pbx->exts[ext >> PBX_CHUNK_BITS], memory_order_relaxed);
+    int i = ec->slot[CHUNK_OFFSET(ext)];
+    SLOT_CHUNK *sc = SLOT_CHUNK_OF(pbx, i);
+    atomic_store_explicit(&ec->tu[CHUNK_OFFSET(ext)], NULL, memory_order_release);
+    sc->tu_storage[CHUNK_OFFSET(i)]=NULL;
+    sc->occupied[CHUNK_OFFSET(i)/64] &= ~((uint64_t)1 << (i%64));
+    sc->free_next[CHUNK_OFFSET(i)] = pbx->free_top;
+    pbx->free_top = i;
+    lock_release(&(pbx->mutex));
 
-            V(&(pbx->mutex));
-            return 0;
-        }
+    tu_unplug(tu);
+    tu_hangup(tu);
+    tu_disconnect(tu);
+    epoch_retire(pbx_release_tu, tu);
+
+    // The TU stays counted as active until it is done with, so that
+    // pbx_shutdown() does not go on while it is still being disconnected.
+    // if active tu == 0, post(semaphore)
+    lock_acquire(&(pbx->mutex));
+    (pbx->active_tu)--;
+    stat_add(STAT_REGISTERED, -1);
+    if(pbx->active_tu == 0){
+        V(&(pbx->shutdown_flag));
     }
-    V(&(pbx->mutex));
-    return -1;
+
+    lock_release(&(pbx->mutex));
+    return 0;
 }
 
 
 /*
  * Use the PBX to initiate a call from a specified TU to a specified extension.
+ * The registry is read without taking the mutex.
  *
  * @param pbx  The PBX registry.
  * @param tu  The TU that is initiating the call.
@@ -156,30 +373,23 @@ int pbx_unregister(PBX *pbx, TU *tu) {
  * @return 0 if dialing succeeds, otherwise -1.
  */
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
-    P(&(pbx->mutex));
+    epoch_enter();
     TU *src=NULL, *dst=NULL;
-    /* Loop through pbx. */
-    int i;
-    for(i=0; i<PBX_MAX_EXTENSIONS; i++){
-        if(pbx->tu_storage[i]!=NULL){
-            if(pbx->tu_storage[i]==tu)
-                src = pbx->tu_storage[i];
-            if(tu_extension(pbx->tu_storage[i])==ext)
-                dst = pbx->tu_storage[i];
-        }
-    }
+    /* Look up the originating TU and the target through the extension index. */
+    if(pbx_lookup(pbx, tu_extension(tu)) == tu)
+        src = tu;
+    dst = pbx_lookup(pbx, ext);
 
     if(src == NULL){
-        V(&(pbx->mutex));
+        epoch_exit();
         return -1;
     }
 
     if(tu_dial(src, dst) < 0){
-        V(&(pbx->mutex));
+        epoch_exit();
         return -1;
     }
 
-    V(&(pbx->mutex));
+    epoch_exit();
     return 0;
 }
-
@@ -0,0 +1,101 @@
+/*
+ * Prethreaded serving mode.
+ * The main thread inserts accepted connections into a bounded queue, from
+ * which a fixed pool of worker threads removes and serves them.  When all
+ * workers are busy, new connections wait in the queue; when the queue is
+ * full, the main thread holds on to the connection it has just accepted
+ * and stops accepting until a slot frees up (see main.c).
+ */
+#include <stdlib.h>
+
+#include "pbx.h"
+#include "server_extra.h"
+#include "sbuf.h"
+#include "debug.h"
+#include "csapp.h"
+
+static sbuf_t queue;
+static int nworkers;
+
+/*
+ * Thread function for a worker thread.
+ * A negative descriptor in the queue tells the worker to exit.
+ */
+static void *pbx_pool_worker(void *arg) {
+    int client_fd;
+    Pthread_detach(pthread_self());
+    while((client_fd = sbuf_remove(&queue)) >= 0)
+        pbx_client_serve(client_fd);
+    return NULL;
+}
+
+/*
+ * Start the worker pool.
+ *
+ * @param nthreads  The number of worker threads.
+ * @param qcap  The capacity of the connection queue.  It is raised to
+ * nthreads if smaller, so that shutdown never blocks on a full queue.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_pool_init(int nthreads, int qcap) {
+    pthread_t tid;
+    int i;
+
+    if(nthreads <= 0)
+        return -1;
+    if(qcap < nthreads)
+        qcap = nthreads;
+    sbuf_init(&queue, qcap);
+    for(i=0; i<nthreads; i++)
+        Pthread_create(&tid, NULL, pbx_pool_worker, NULL);
+    nworkers = nthreads;
+    debug("Started %d workers, queue capacity %d", nthreads, qcap);
+    return 0;
+}
+
+/*
+ * Queue an accepted connection for service by the pool, without blocking.
+ *
+ * @param client_fd  The file descriptor of the client connection.
+ * @return 0 if successful, or -1 if the queue is full, in which case the
+ * connection is left open and the caller should try again later.
+ */
+int pbx_pool_add(int client_fd) {
+    return sbuf_tryinsert(&queue, client_fd);
+}
+
+/*
+ * Stop the worker pool.  Connections still waiting in the queue are closed,
+ * and each worker is told to exit once it finishes its current connection.
+ * This must be called before pbx_shutdown(), so that no queued connection
+ * is registered while the PBX is being shut down, and with no concurrent
+ * calls to pbx_pool_add().
+ */
+void pbx_pool_stop(void) {
+    SBUF_STATS st;
+    int client_fd, i;
+
+    while(sbuf_tryremove(&queue, &client_fd) == 0)
+        close(client_fd);
+
+    sbuf_stats(&queue, &st);
+    debug("Pool: %lu dequeued, max depth %d/%d, mean wait %lu ns, max wait %lu ns",
+          st.removed, st.max_depth, st.capacity,
+          st.removed ? st.wait_ns / st.removed : 0, st.max_wait_ns);
+
+    for(i=0; i<nworkers; i++)
+        sbuf_insert(&queue, -1);
+}
+
+/*
+ * Get statistics on the connection queue: current and maximum depth,
+ * and how long connections have waited in it for a worker.
+ *
+ * @return 0 if successful, or -1 if the pool has not been started.
+ */
+int pbx_pool_stats(SBUF_STATS *st) {
+    if(nworkers == 0)
+        return -1;
+    sbuf_stats(&queue, st);
+    return 0;
+}
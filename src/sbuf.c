@@ -0,0 +1,137 @@
+/*
+ * sbuf: bounded producer/consumer buffer of ints.
+ */
+#include <stdlib.h>
+#include <errno.h>
+
+#include "sbuf.h"
+#include "csapp.h"
+
+static uint64_t elapsed_ns(struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - from->tv_sec) * 1000000000 + (now.tv_nsec - from->tv_nsec);
+}
+
+/*
+ * Take the item at the front of the buffer.  The caller must hold an
+ * "items" token and the mutex.
+ */
+static int sbuf_take(sbuf_t *sp) {
+    int i = (++sp->front) % (sp->n);
+    uint64_t ns = elapsed_ns(&sp->stamp[i]);
+    sp->depth--;
+    sp->removed++;
+    sp->wait_ns += ns;
+    if(ns > sp->max_wait_ns)
+        sp->max_wait_ns = ns;
+    return sp->buf[i];
+}
+
+/*
+ * Create an empty, bounded, shared FIFO buffer with n slots.
+ */
+void sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamp = Calloc(n, sizeof(struct timespec));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+    sp->depth = sp->max_depth = 0;
+    sp->removed = sp->wait_ns = sp->max_wait_ns = 0;
+}
+
+/*
+ * Clean up buffer sp.
+ */
+void sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+    Free(sp->stamp);
+}
+
+/*
+ * Put item at the rear of the buffer.  The caller must hold a "slots"
+ * token and the mutex.
+ */
+static void sbuf_put(sbuf_t *sp, int item) {
+    int i = (++sp->rear) % (sp->n);
+    sp->buf[i] = item;
+    clock_gettime(CLOCK_MONOTONIC, &sp->stamp[i]);
+    if(++sp->depth > sp->max_depth)
+        sp->max_depth = sp->depth;
+}
+
+/*
+ * Insert item onto the rear of shared buffer sp, blocking while it is full.
+ */
+void sbuf_insert(sbuf_t *sp, int item) {
+    P(&sp->slots);
+    P(&sp->mutex);
+    sbuf_put(sp, item);
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/*
+ * Insert item onto the rear of shared buffer sp, if there is room,
+ * without blocking.
+ *
+ * @return 0 if item was inserted, -1 if sp was full.
+ */
+int sbuf_tryinsert(sbuf_t *sp, int item) {
+    while(sem_trywait(&sp->slots) < 0){
+        if(errno != EINTR)
+            return -1;
+    }
+    P(&sp->mutex);
+    sbuf_put(sp, item);
+    V(&sp->mutex);
+    V(&sp->items);
+    return 0;
+}
+
+/*
+ * Remove and return the first item from buffer sp, blocking while it is empty.
+ */
+int sbuf_remove(sbuf_t *sp) {
+    int item;
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sbuf_take(sp);
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/*
+ * Remove the first item from buffer sp, if there is one, without blocking.
+ *
+ * @return 0 if an item was removed and stored in *item, -1 if sp was empty.
+ */
+int sbuf_tryremove(sbuf_t *sp, int *item) {
+    while(sem_trywait(&sp->items) < 0){
+        if(errno != EINTR)
+            return -1;
+    }
+    P(&sp->mutex);
+    *item = sbuf_take(sp);
+    V(&sp->mutex);
+    V(&sp->slots);
+    return 0;
+}
+
+/*
+ * Take a consistent snapshot of the statistics of buffer sp.
+ */
+void sbuf_stats(sbuf_t *sp, SBUF_STATS *st) {
+    P(&sp->mutex);
+    st->capacity = sp->n;
+    st->depth = sp->depth;
+    st->max_depth = sp->max_depth;
+    st->removed = sp->removed;
+    st->wait_ns = sp->wait_ns;
+    st->max_wait_ns = sp->max_wait_ns;
+    V(&sp->mutex);
+}
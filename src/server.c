@@ -8,102 +8,122 @@
 #include "debug.h"
 #include "pbx.h"
 #include "server.h"
+#include "server_extra.h"
+#include "tu_extra.h"
 #include "csapp.h"
+#include "linebuf.h"
+#include "cmdstat.h"
+#include "stats.h"
+#include "capture.h"
 
 /*
- * Thread function for the thread that handles interaction with a client TU.
- * This is called after a network connection has been made via the main server
- * thread and a new thread has been created to handle the connection.
+ * Parse a single line of client input and carry out the command.
+ * The latency of each command carried out is recorded (see cmdstat.h).
+ * Malformed lines are counted, and answered as a dial of a nonexistent
+ * extension if they are dial commands, or otherwise with the current state.
+ *
+ * @param tu  The TU of the client that sent the line.
+ * @param line  The line, with the EOL stripped and NUL-terminated.
+ * @param len  The length of the line.
+ * @param w  For a chat, the waiter to register if the client is to be
+ * paused, or NULL to wait here instead (see tu_chat_nowait()).
+ * @return 1 if no more input should be read from the client until w is
+ * resumed, otherwise 0.
  */
-void *pbx_client_service(void *arg) {
+int pbx_client_dispatch(TU *tu, char *line, size_t len, TU_WAITER *w) {
+    uint64_t start = cmdstat_now();
+    char *msg;
+    int ext = 0, paused = 0;
+    TU_COMMAND cmd = pbx_client_parse(line, len, &msg, &ext);
+
+    if(capture != NULL)
+        capture_command(tu_fileno(tu), line, len);
+    switch(cmd){
+        case TU_PICKUP_CMD:
+            tu_pickup(tu);
+            break;
+        case TU_HANGUP_CMD:
+            tu_hangup(tu);
+            break;
+        case TU_DIAL_CMD:
+            pbx_dial(pbx, tu, ext);
+            break;
+        case TU_CHAT_CMD:
+            paused = tu_chat_nowait(tu, msg, w) > 0;
+            break;
+        default:
+            debug("Malformed line from extension %d: %s", tu_extension(tu), line);
+            stat_add(STAT_MALFORMED, 1);
+            if(ext == -1)
+                pbx_dial(pbx, tu, -1);
+            else
+                tu_report(tu);
+            return 0;
+    }
+    cmdstat_record(cmd, cmdstat_now() - start);
+    return paused;
+}
 
-    // Get the file descriptor and free the arg.
-    int client_fd = *((int *)arg);
-    Pthread_detach(pthread_self());
-    free(arg);
+/*
+ * Serve a client connection until EOF is seen on it.
+ * A TU is created for the connection and registered with the PBX, input
+ * lines are dispatched as they arrive, and on EOF the TU is unregistered
+ * and the connection closed.  The connection is closed also if the TU
+ * cannot be created or registered.
+ *
+ * @param client_fd  The file descriptor of the client connection.
+ */
+void pbx_client_serve(int client_fd) {
 
     // Create a tu with the fd.
     TU *new_tu;
     if((new_tu = tu_init(client_fd)) == NULL){
         fprintf(stderr, "Failed to initialize tu.\n");
-        return NULL;
+        close(client_fd);
+        return;
     }
 
-    // Register tu to pbx.
+    // Register tu to pbx.  A TU starts with no references, so one is
+    // taken and dropped to free it if registration fails.
+    capture_connect(client_fd);
     if(pbx_register(pbx, new_tu, client_fd) == -1){
         fprintf(stderr, "Failed to register tu.\n");
-        return NULL;
+        tu_ref(new_tu, "Registration failed.\n");
+        tu_unref(new_tu, "Registration failed.\n");
+        capture_disconnect(client_fd);
+        close(client_fd);
+        return;
     }
 
-    // Read input from client_fd.
-    FILE *stream;
-    char *buf, c;
-    size_t len;
-
-    char *msg;
-
-    int target_ext;
-    char *endp;
-
-    char *client_input;
-
-    stream = open_memstream(&buf, &len);
-
-    while(read(client_fd, &c, 1 ) > 0)
-    {
-        fprintf(stream, "%c", c);
-        if(c == '\n'){
-            fflush(stream);
-            if( (client_input = (char *) malloc((len+1)*sizeof(char))) == NULL){
-                return NULL;
-            }
-            memcpy(client_input, buf, len-strlen(EOL));
-            *(client_input+len-strlen(EOL)) = 0;
-            fclose(stream);
-            free(buf);
+    // Read input from client_fd, one line at a time.
+    LINEBUF lb;
+    char *line;
+    ssize_t len;
 
-            // parse client input.
-            if( (strcmp(client_input, tu_command_names[TU_PICKUP_CMD]) == 0)){
-                if(tu_pickup(new_tu) < 0)
-                    ;
-            }
-            else if(strcmp(client_input, tu_command_names[TU_HANGUP_CMD]) == 0){
-                if(tu_hangup(new_tu) < 0)
-                    ;
-            }
-            else if(strncmp(client_input, tu_command_names[TU_DIAL_CMD], strlen(tu_command_names[TU_DIAL_CMD])) == 0){
-                if((*(client_input+strlen(tu_command_names[TU_DIAL_CMD])) == ' ') && *(client_input+strlen(tu_command_names[TU_DIAL_CMD])+1) != 0)
-                {
-                    target_ext = (int)strtol(client_input+strlen(tu_command_names[TU_DIAL_CMD])+1, &endp, 10);
-                    //if(*endp == 0){
-                    if(pbx_dial(pbx, new_tu, target_ext) < 0)
-                        ;
-                    //}
-                }
-            }
-            else if(strncmp(client_input, tu_command_names[TU_CHAT_CMD], strlen(tu_command_names[TU_CHAT_CMD])) == 0){
-                for(msg=client_input+strlen(tu_command_names[TU_CHAT_CMD]); *msg==' '; msg++)
-                    ;
-                if(tu_chat(new_tu, msg) < 0)
-                    ;
-            }
+    linebuf_init(&lb, client_fd);
+    while((len = linebuf_readline(&lb, &line)) >= 0)
+        pbx_client_dispatch(new_tu, line, len, NULL);
 
-            free(client_input);
-            // reopen memstream
-            stream = open_memstream(&buf, &len);
-        }
-
-    }
-    fclose(stream);
-    free(buf);
+    // Unregister before closing, so that the extension (the descriptor
+    // number) is free again before the descriptor can be reused.
+    pbx_unregister(pbx, new_tu);
+    capture_disconnect(client_fd);
 
     close(client_fd);
+}
 
-    pbx_unregister(pbx, new_tu);
-
-    return NULL;
+/*
+ * Thread function for the thread that handles interaction with a client TU.
+ * This is called after a network connection has been made via the main server
+ * thread and a new thread has been created to handle the connection.
+ */
+void *pbx_client_service(void *arg) {
 
+    // Get the file descriptor and free the arg.
+    int client_fd = *((int *)arg);
+    Pthread_detach(pthread_self());
+    free(arg);
 
-    // TO BE IMPLEMENTED
-    //abort();
+    pbx_client_serve(client_fd);
+    return NULL;
 }
@@ -0,0 +1,156 @@
+/*
+ * Statistics published in shared memory (see shmstat.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "shmstat.h"
+#include "cmdstat.h"
+#include "debug.h"
+#include "csapp.h"
+
+SHMSTAT *shmstat;
+
+static char *shm_name;
+static int stopfd = -1;
+static pthread_t publisher_tid;
+
+/*
+ * Copy the server-wide counters into the header of the segment.
+ */
+static void shmstat_publish(void) {
+    static HIST h;
+    long vals[STAT_COUNT];
+    unsigned long counts[TU_NUM_COMMANDS];
+    int i;
+
+    // Collect first, so that the header is odd for as short a time as possible.
+    stat_read_all(vals);
+    for(i=0; i<TU_NUM_COMMANDS; i++){
+        cmdstat_collect(i, &h);
+        counts[i] = atomic_load_explicit(&h.count, memory_order_relaxed);
+    }
+
+    shmstat_write_begin(&shmstat->seq);
+    atomic_store_explicit(&shmstat->updated_ns, cmdstat_now(), memory_order_relaxed);
+    for(i=0; i<STAT_COUNT; i++)
+        atomic_store_explicit(&shmstat->stats[i], vals[i], memory_order_relaxed);
+    for(i=0; i<TU_NUM_COMMANDS; i++)
+        atomic_store_explicit(&shmstat->commands[i], counts[i], memory_order_relaxed);
+    shmstat_write_end(&shmstat->seq);
+}
+
+/*
+ * Thread function for the publisher, which refreshes the header every
+ * SHMSTAT_INTERVAL milliseconds until told to stop.
+ */
+static void *shmstat_thread(void *arg) {
+    struct pollfd pfd = { .fd = stopfd, .events = POLLIN };
+    int n;
+
+    while(1){
+        shmstat_publish();
+        if((n = poll(&pfd, 1, SHMSTAT_INTERVAL)) < 0 && errno != EINTR)
+            unix_error("shmstat poll error");
+        if(n > 0)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * Create the shared-memory segment and start publishing to it.  Any
+ * existing segment of the same name, e.g. from a server that did not shut
+ * down cleanly, is replaced.
+ *
+ * @param name  The name of the segment, e.g. "/pbx".
+ * @param nexts  The number of extensions for which to make room.
+ * @return 0 if successful, otherwise -1.
+ */
+int shmstat_init(char *name, int nexts) {
+    size_t size = sizeof(SHMSTAT) + nexts * sizeof(SHMSTAT_EXT);
+    SHMSTAT *shm;
+    int fd;
+
+    if(nexts <= 0)
+        return -1;
+    shm_unlink(name);
+    if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+        return -1;
+    if(ftruncate(fd, size) < 0
+       || (shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    close(fd);
+    if((stopfd = eventfd(0, EFD_CLOEXEC)) < 0){
+        munmap(shm, size);
+        shm_unlink(name);
+        return -1;
+    }
+
+    // The segment is zero-filled, which leaves every extension free.
+    shm->version = SHMSTAT_VERSION;
+    shm->nstats = STAT_COUNT;
+    shm->ncommands = TU_NUM_COMMANDS;
+    shm->nexts = nexts;
+    shm->pid = getpid();
+    shmstat = shm;
+    shm_name = name;
+    Pthread_create(&publisher_tid, NULL, shmstat_thread, NULL);
+    // Readers check the magic number last, once the layout is filled in.
+    atomic_thread_fence(memory_order_release);
+    shm->magic = SHMSTAT_MAGIC;
+    debug("Publishing statistics in %s (%zu bytes)", name, size);
+    return 0;
+}
+
+/*
+ * Stop publishing and remove the segment's name, so that monitors see the
+ * server is gone.  The segment stays mapped, because TUs may still update
+ * it until the process exits.
+ */
+void shmstat_stop(void) {
+    uint64_t one = 1;
+
+    if(stopfd < 0)
+        return;
+    if(write(stopfd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+    Pthread_join(publisher_tid, NULL);
+    close(stopfd);
+    stopfd = -1;
+    shm_unlink(shm_name);
+}
+
+/*
+ * Publish the state and peer of the TU at an extension.  The caller must
+ * hold the lock of that TU, which serializes the writers of the entry.
+ *
+ * @param state  The state of the TU, or -1 if the extension is now free.
+ * @param peer  The extension of its peer, or -1 if none.
+ */
+void shmstat_set_ext(int ext, int state, int peer) {
+    SHMSTAT_EXT *e;
+    int limit;
+
+    if(ext < 0 || ext >= shmstat->nexts)
+        return;
+    e = &shmstat->ext[ext];
+    shmstat_write_begin(&e->seq);
+    atomic_store_explicit(&e->state, state + 1, memory_order_relaxed);
+    atomic_store_explicit(&e->peer, peer + 1, memory_order_relaxed);
+    shmstat_write_end(&e->seq);
+
+    limit = atomic_load_explicit(&shmstat->ext_limit, memory_order_relaxed);
+    while(ext >= limit && !atomic_compare_exchange_weak_explicit(&shmstat->ext_limit, &limit, ext + 1,
+                                                                 memory_order_relaxed,
+                                                                 memory_order_relaxed))
+        ;
+}
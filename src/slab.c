@@ -0,0 +1,245 @@
+/*
+ * slab: object pool with per-thread caches.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "slab.h"
+
+/* Cache of free objects owned by one thread. */
+typedef struct slab_cache{
+    SLAB *sp;
+    int n;
+    int batch;                  /* Number of objects to take on the next refill */
+    void *objs[SLAB_CACHE_SIZE];
+    /* Statistics, written only by the owning thread. */
+    atomic_ulong allocs;
+    atomic_ulong hits;
+    struct slab_cache *prev, *next;
+}SLAB_CACHE;
+
+struct slab{
+    size_t size;
+    void (*ctor)(void *);
+    pthread_key_t key;          /* Each thread's SLAB_CACHE */
+    pthread_mutex_t lock;       /* Protects everything below */
+    void **depot;               /* Stack of free objects */
+    size_t ndepot, depot_cap;
+    SLAB_CACHE *caches;         /* Caches of live threads */
+    uint64_t allocs, hits;      /* Totals of caches of exited threads */
+    uint64_t refills, slabs;
+    long objects;
+    atomic_long in_use;
+    atomic_long high_water;
+};
+
+/*
+ * Count an object as allocated (delta 1) or freed (delta -1).
+ */
+static void slab_count(SLAB *sp, long delta) {
+    long n = atomic_fetch_add_explicit(&sp->in_use, delta, memory_order_relaxed) + delta;
+    long hw = atomic_load_explicit(&sp->high_water, memory_order_relaxed);
+    while(n > hw && !atomic_compare_exchange_weak_explicit(&sp->high_water, &hw, n,
+                                                           memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/*
+ * Increment a statistics counter that only the calling thread writes.
+ */
+static void cache_count(atomic_ulong *c) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/*
+ * Push an object onto the depot.  Must be called with sp->lock held.
+ *
+ * @return 0 if successful, -1 if the depot could not be grown.
+ */
+static int depot_push(SLAB *sp, void *obj) {
+    if(sp->ndepot == sp->depot_cap){
+        size_t cap = sp->depot_cap ? 2 * sp->depot_cap : SLAB_CACHE_SIZE;
+        void **depot = realloc(sp->depot, cap * sizeof(void *));
+        if(depot == NULL)
+            return -1;
+        sp->depot = depot;
+        sp->depot_cap = cap;
+    }
+    sp->depot[sp->ndepot++] = obj;
+    return 0;
+}
+
+/*
+ * Carve a new slab into objects, construct them and add them to the depot.
+ * Must be called with sp->lock held.
+ *
+ * @return 0 if successful, -1 if out of memory.
+ */
+static int slab_grow(SLAB *sp) {
+    char *mem;
+    int i;
+
+    if((mem = aligned_alloc(SLAB_ALIGN, SLAB_BATCH * sp->size)) == NULL)
+        return -1;
+    for(i=SLAB_BATCH-1; i>=0; i--){
+        if(sp->ctor != NULL)
+            sp->ctor(mem + i * sp->size);
+        if(depot_push(sp, mem + i * sp->size) < 0)
+            return -1;
+        sp->objects++;
+    }
+    sp->slabs++;
+    return 0;
+}
+
+/*
+ * Destructor for a thread's cache: return its objects to the depot and
+ * fold its statistics into the totals.
+ */
+static void cache_release(void *arg) {
+    SLAB_CACHE *cache = arg;
+    SLAB *sp = cache->sp;
+
+    pthread_mutex_lock(&sp->lock);
+    while(cache->n > 0)
+        depot_push(sp, cache->objs[--cache->n]);
+    sp->allocs += atomic_load(&cache->allocs);
+    sp->hits += atomic_load(&cache->hits);
+    if(cache->prev != NULL)
+        cache->prev->next = cache->next;
+    else
+        sp->caches = cache->next;
+    if(cache->next != NULL)
+        cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&sp->lock);
+    free(cache);
+}
+
+/*
+ * Get the calling thread's cache, creating it if necessary.
+ *
+ * @return the cache, or NULL if out of memory.
+ */
+static SLAB_CACHE *cache_get(SLAB *sp) {
+    SLAB_CACHE *cache = pthread_getspecific(sp->key);
+    if(cache != NULL)
+        return cache;
+    if((cache = calloc(1, sizeof(SLAB_CACHE))) == NULL)
+        return NULL;
+    cache->sp = sp;
+    cache->batch = 1;
+    pthread_mutex_lock(&sp->lock);
+    if((cache->next = sp->caches) != NULL)
+        sp->caches->prev = cache;
+    sp->caches = cache;
+    pthread_mutex_unlock(&sp->lock);
+    pthread_setspecific(sp->key, cache);
+    return cache;
+}
+
+/*
+ * Create a pool of objects.
+ *
+ * @param size  The size of each object; it is rounded up to a whole number
+ * of cache lines, so that no two objects share a line.
+ * @param ctor  If not NULL, called once for each object when it is first
+ * carved out of a slab.
+ * @return the pool, or NULL if it could not be created.
+ */
+SLAB *slab_create(size_t size, void (*ctor)(void *)) {
+    SLAB *sp;
+    if((sp = calloc(1, sizeof(SLAB))) == NULL)
+        return NULL;
+    if(pthread_key_create(&sp->key, cache_release) != 0){
+        free(sp);
+        return NULL;
+    }
+    sp->size = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    sp->ctor = ctor;
+    pthread_mutex_init(&sp->lock, NULL);
+    atomic_init(&sp->in_use, 0);
+    atomic_init(&sp->high_water, 0);
+    return sp;
+}
+
+/*
+ * Allocate an object from a pool.  The object is in the state in which it
+ * was last freed, or as left by the constructor if it has not been used.
+ *
+ * @return the object, or NULL if out of memory.
+ */
+void *slab_alloc(SLAB *sp) {
+    SLAB_CACHE *cache;
+    void *obj = NULL;
+
+    if((cache = cache_get(sp)) == NULL)
+        return NULL;
+    cache_count(&cache->allocs);
+    if(cache->n > 0){
+        cache_count(&cache->hits);
+        slab_count(sp, 1);
+        return cache->objs[--cache->n];
+    }
+
+    /*
+     * Refill the cache from the depot, carving a new slab if needed.
+     * The batch size doubles with each refill, up to half the cache, so
+     * that threads which allocate only a few objects do not hoard them.
+     */
+    pthread_mutex_lock(&sp->lock);
+    sp->refills++;
+    if(sp->ndepot > 0 || slab_grow(sp) == 0){
+        while(sp->ndepot > 1 && cache->n < cache->batch - 1)
+            cache->objs[cache->n++] = sp->depot[--sp->ndepot];
+        obj = sp->depot[--sp->ndepot];
+    }
+    pthread_mutex_unlock(&sp->lock);
+    if(cache->batch < SLAB_CACHE_SIZE / 2)
+        cache->batch *= 2;
+    if(obj != NULL)
+        slab_count(sp, 1);
+    return obj;
+}
+
+/*
+ * Return an object to a pool.
+ */
+void slab_free(SLAB *sp, void *obj) {
+    SLAB_CACHE *cache;
+
+    slab_count(sp, -1);
+    if((cache = cache_get(sp)) != NULL && cache->n < SLAB_CACHE_SIZE){
+        cache->objs[cache->n++] = obj;
+        return;
+    }
+
+    // Flush half of the cache to the depot, along with obj.
+    pthread_mutex_lock(&sp->lock);
+    while(cache != NULL && cache->n > SLAB_CACHE_SIZE / 2)
+        depot_push(sp, cache->objs[--cache->n]);
+    depot_push(sp, obj);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * Take a snapshot of the statistics of a pool.
+ */
+void slab_stats(SLAB *sp, SLAB_STATS *st) {
+    SLAB_CACHE *cache;
+
+    pthread_mutex_lock(&sp->lock);
+    st->obj_size = sp->size;
+    st->allocs = sp->allocs;
+    st->cache_hits = sp->hits;
+    for(cache = sp->caches; cache != NULL; cache = cache->next){
+        st->allocs += atomic_load_explicit(&cache->allocs, memory_order_relaxed);
+        st->cache_hits += atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    }
+    st->depot_refills = sp->refills;
+    st->slabs = sp->slabs;
+    st->objects = sp->objects;
+    pthread_mutex_unlock(&sp->lock);
+    st->in_use = atomic_load(&sp->in_use);
+    st->high_water = atomic_load(&sp->high_water);
+}
@@ -0,0 +1,97 @@
+/*
+ * Server-wide counters, kept per thread.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+/* Statistics kept by one thread. */
+typedef struct stat_thread{
+    atomic_long vals[STAT_COUNT];
+    struct stat_thread *prev, *next;
+}STAT_THREAD;
+
+__thread atomic_long *stat_self;
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+/* Threads' statistics; protected by stats_lock, as is everything below. */
+static STAT_THREAD *threads;
+static long exited[STAT_COUNT];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Destructor for a thread's statistics: fold them into those of exited
+ * threads.
+ */
+static void self_release(void *arg) {
+    STAT_THREAD *ts = arg;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for(i=0; i<STAT_COUNT; i++)
+        exited[i] += atomic_load_explicit(&ts->vals[i], memory_order_relaxed);
+    if(ts->prev != NULL)
+        ts->prev->next = ts->next;
+    else
+        threads = ts->next;
+    if(ts->next != NULL)
+        ts->next->prev = ts->prev;
+    pthread_mutex_unlock(&stats_lock);
+    stat_self = NULL;
+    free(ts);
+}
+
+static void self_init(void) {
+    pthread_key_create(&self_key, self_release);
+}
+
+/*
+ * Create the statistics of the calling thread, on its first update.
+ *
+ * @return the thread's values, or NULL if out of memory.
+ */
+atomic_long *stat_self_create(void) {
+    STAT_THREAD *ts;
+
+    pthread_once(&self_once, self_init);
+    if((ts = calloc(1, sizeof(STAT_THREAD))) == NULL)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    ts->prev = NULL;
+    if((ts->next = threads) != NULL)
+        threads->prev = ts;
+    threads = ts;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(self_key, ts);
+    return stat_self = ts->vals;
+}
+
+/*
+ * Read every statistic.
+ *
+ * @param vals  Set to the value of each statistic, indexed by STAT_ID.
+ */
+void stat_read_all(long vals[STAT_COUNT]) {
+    STAT_THREAD *ts;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for(i=0; i<STAT_COUNT; i++)
+        vals[i] = exited[i];
+    for(ts = threads; ts != NULL; ts = ts->next){
+        for(i=0; i<STAT_COUNT; i++)
+            vals[i] += atomic_load_explicit(&ts->vals[i], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Read one statistic.
+ */
+long stat_read(STAT_ID id) {
+    long vals[STAT_COUNT];
+    stat_read_all(vals);
+    return vals[id];
+}
@@ -2,66 +2,815 @@
  * TU: simulates a "telephone unit", which interfaces a client with the PBX.
  */
 #include <stdlib.h>
-#include <semaphore.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "pbx.h"
+#include "tu_extra.h"
+#include "tu_fsm.h"
+#include "lock.h"
+#include "stats.h"
+#include "shmstat.h"
+#include "capture.h"
 #include "debug.h"
 #include "csapp.h"
 
 int report_current_state(TU *tu);
+static TU *tu_peer(TU *tu);
+
+#ifdef TU_REF_DEBUG
+/*
+ * In TU_REF_DEBUG builds, each TU records its most recent reference count
+ * changes, with their reasons, in a ring buffer, and all live TUs are kept
+ * on a list so that those still alive at shutdown can be reported.
+ */
+#define TU_REF_HISTORY 16
+
+typedef struct tu_ref_event{
+    const char *reason;
+    int delta;
+    int count;      /* Reference count after the change. */
+}TU_REF_EVENT;
+
+static TU *live_tus;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * A call between two TUs, created when one dials the other and ended when
+ * either hangs up.  While a TU is in a call, its state is guarded by the lock
+ * of the call, which is shared with its peer, instead of by its own mutex.
+ * Calls are allocated from a slab pool, like TUs, so the lock of a call that
+ * has ended remains a valid lock.
+ */
+typedef struct tu_call{
+    LOCK lock;
+    TU *ends[2];
+}TU_CALL;
 
 /* The actual structure definitions.*/
 typedef struct tu{
-    int refcnt;
+    atomic_int refcnt;
     int extno;
     int tufd;
+    TU_SINK sink;   /* Where notifications go instead of tufd, if sink.write is set. */
     TU_STATE state;
-    TU *peer;
-    sem_t mutex;
+    /*
+     * The call the TU is in, if any.  It is changed only while holding the
+     * lock it designates, and always as the last step before releasing it.
+     */
+    _Atomic(TU_CALL *) call;
+    int unplugged;  /* Set once the TU has been unregistered from the PBX. */
+    LOCK mutex;
+
+    /*
+     * Notifications are queued under the TU's lock and written to the
+     * client only after it has been released.  The queue is protected by
+     * outlock, which is never held across a write.
+     */
+    pthread_mutex_t outlock;
+    pthread_cond_t drained;     /* Signalled when outlen drops to the high-water mark. */
+    TU_WAITER *waiters;         /* Chat senders paused until then (see tu_chat_nowait()). */
+    char *outbuf;   /* Queued bytes not yet taken by a writer. */
+    size_t outlen, outcap;
+    size_t captured; /* Bytes at the front of outbuf already captured. */
+    char *spare;    /* Buffer to swap in when a writer takes outbuf. */
+    size_t sparecap;
+    int flushing;   /* Set while a thread is writing the queue to the client. */
+    int blocked;    /* Set while the drainer waits for the socket to become writable. */
+    int connected;  /* Cleared once a write to the client has failed. */
+    int evicted;    /* Set if the client was disconnected for being too slow. */
+    size_t maxqueued;
+    unsigned long dropped;
+#ifdef TU_REF_DEBUG
+    atomic_uint nevents;
+    TU_REF_EVENT events[TU_REF_HISTORY];
+    TU *live_prev, *live_next;
+#endif
 }TU;
 
-/* Response the current stare of tu to client. */
-int report_current_state(TU *tu){
+#ifdef TU_REF_DEBUG
+static void tu_ref_record(TU *tu, const char *reason, int delta, int count) {
+    unsigned int i = atomic_fetch_add_explicit(&tu->nevents, 1, memory_order_relaxed);
+    TU_REF_EVENT *ev = &tu->events[i % TU_REF_HISTORY];
+    ev->reason = reason;
+    ev->delta = delta;
+    ev->count = count;
+}
+
+/* Print the recorded reference history of a TU, oldest first. */
+static void tu_ref_history(TU *tu, FILE *out) {
+    unsigned int n = atomic_load(&tu->nevents), i;
+    fprintf(out, "TU %p (ext %d, refcnt %d), last %u of %u reference changes:\n", (void *)tu,
+            tu->extno, atomic_load(&tu->refcnt), n < TU_REF_HISTORY ? n : TU_REF_HISTORY, n);
+    for(i = n < TU_REF_HISTORY ? 0 : n - TU_REF_HISTORY; i < n; i++){
+        TU_REF_EVENT *ev = &tu->events[i % TU_REF_HISTORY];
+        fprintf(out, "  %+d -> %d: %s\n", ev->delta, ev->count, ev->reason);
+    }
+}
+
+/*
+ * Report every TU that has not been freed, with its reference history.
+ * Intended to be called once the PBX has shut down, when none should remain.
+ *
+ * @return the number of TUs reported.
+ */
+int tu_report_leaks(FILE *out) {
+    int n = 0;
+    pthread_mutex_lock(&live_lock);
+    for(TU *tu = live_tus; tu != NULL; tu = tu->live_next, n++)
+        tu_ref_history(tu, out);
+    pthread_mutex_unlock(&live_lock);
+    return n;
+}
+#else
+int tu_report_leaks(FILE *out) {
+    return 0;
+}
+#endif
+
+/*
+ * Preformatted state notifications, indexed by state.  The text matches
+ * tu_state_names[]; for ON HOOK and CONNECTED it is followed by an
+ * extension number and then EOL.
+ */
+#define TU_MSG(text) { text, sizeof(text) - 1 }
+
+static const struct tu_msg{
+    const char *text;
+    size_t len;
+}tu_state_msgs[] = {
+    [TU_ON_HOOK]       TU_MSG("ON HOOK "),
+    [TU_RINGING]       TU_MSG("RINGING" EOL),
+    [TU_DIAL_TONE]     TU_MSG("DIAL TONE" EOL),
+    [TU_RING_BACK]     TU_MSG("RING BACK" EOL),
+    [TU_BUSY_SIGNAL]   TU_MSG("BUSY SIGNAL" EOL),
+    [TU_CONNECTED]     TU_MSG("CONNECTED "),
+    [TU_ERROR]         TU_MSG("ERROR" EOL)
+};
 
-    if(fcntl(tu->tufd, F_GETFD) == -1){
+/* Longest notification: the longest prefix, an int and EOL. */
+#define TU_MSG_MAX 32
+
+/* Initial size of an output queue buffer, and the largest kept for reuse. */
+#define TU_OUTBUF_INIT 256
+#define TU_OUTBUF_KEEP 4096
+
+/*
+ * Limits on the output queue of each TU.  Once the queue holds more than
+ * tu_out_hiwat bytes, the policy decides what happens to further output.
+ * State notifications are never dropped; a client whose queue reaches
+ * TU_OUTBUF_HARD times the high-water mark is disconnected under any
+ * policy.
+ */
+#define TU_OUTBUF_HARD 4
+
+static size_t tu_out_hiwat = TU_DEFAULT_OUTPUT_HIWAT;
+static TU_OUTPUT_POLICY tu_out_policy = TU_OUTPUT_PAUSE;
+
+/*
+ * Format a non-negative integer in decimal.
+ *
+ * @param buf  Where to store the digits; no NUL is appended.
+ * @param n  The integer.
+ * @return the number of digits stored.
+ */
+static size_t tu_itoa(char *buf, unsigned int n) {
+    char tmp[10];
+    size_t len = 0, i;
+    do{
+        tmp[len++] = '0' + n % 10;
+        n /= 10;
+    }while(n != 0);
+    for(i=0; i<len; i++)
+        buf[i] = tmp[len - 1 - i];
+    return len;
+}
+
+/*
+ * Set the high-water mark of the per-client output queues, and the
+ * policy applied once a queue exceeds it.
+ *
+ * @param hiwat  The high-water mark, in bytes.
+ * @param policy  What to do with output beyond the high-water mark.
+ * @return 0 if successful, -1 if hiwat is zero.
+ */
+int tu_set_output_limit(size_t hiwat, TU_OUTPUT_POLICY policy) {
+    if(hiwat == 0)
         return -1;
+    tu_out_hiwat = hiwat;
+    tu_out_policy = policy;
+    return 0;
+}
+
+/*
+ * Take the chat senders paused on a TU, if its output queue is back under
+ * the high-water mark or its client is gone.  Must be called with outlock
+ * held; they are resumed by tu_resume_senders() once it has been released.
+ */
+static TU_WAITER *tu_take_waiters(TU *tu) {
+    TU_WAITER *w = NULL;
+
+    if(!tu->connected || tu->outlen <= tu_out_hiwat){
+        w = tu->waiters;
+        tu->waiters = NULL;
     }
+    return w;
+}
 
-    switch(tu->state)
-    {
-        case TU_ON_HOOK:
-            dprintf(tu->tufd, "%s %d%s", tu_state_names[TU_ON_HOOK], tu->extno, EOL);
-            break;
+static void tu_resume_senders(TU_WAITER *w) {
+    TU_WAITER *next;
 
-        case TU_RINGING:
-            dprintf(tu->tufd, "%s%s", tu_state_names[TU_RINGING], EOL);
-            break;
+    for(; w != NULL; w = next){
+        next = w->next;
+        w->resume(w);
+    }
+}
 
-        case TU_DIAL_TONE:
-            dprintf(tu->tufd, "%s%s", tu_state_names[TU_DIAL_TONE], EOL);
-            break;
+/*
+ * Drop all output to the client of a TU from now on and wake any thread
+ * waiting for its queue to drain.  Must be called with outlock held.
+ */
+static void tu_drop_client(TU *tu) {
+    tu->connected = 0;
+    tu->outlen = 0;
+    tu->captured = 0;
+    pthread_cond_broadcast(&tu->drained);
+}
 
-        case TU_RING_BACK:
-            dprintf(tu->tufd, "%s%s", tu_state_names[TU_RING_BACK], EOL);
-            break;
+/*
+ * Disconnect a client whose output queue has grown too long.  Its socket
+ * is shut down, so that its service thread sees EOF and unregisters it.
+ * Must be called with outlock held.
+ */
+static void tu_evict(TU *tu) {
+    debug("Disconnecting slow client %d (%zu bytes queued)", tu->tufd, tu->outlen);
+    if(!tu->evicted)
+        stat_add(STAT_EVICTIONS, 1);
+    tu->evicted = 1;
+    tu_drop_client(tu);
+    if(tu->tufd >= 0)
+        shutdown(tu->tufd, SHUT_RDWR);
+}
 
-        case TU_BUSY_SIGNAL:
-            dprintf(tu->tufd, "%s%s", tu_state_names[TU_BUSY_SIGNAL], EOL);
-            break;
+/*
+ * Append a message, gathered from iovcnt buffers, to the output queue of
+ * a TU.  It is sent to the client by the next call to tu_deliver().  The
+ * caller must hold the TU's lock, so that messages from different
+ * transitions are not interleaved.
+ *
+ * If the queue is above the high-water mark, the output policy applies:
+ * chat text may be dropped, or the client disconnected.
+ *
+ * @param chat  Nonzero if the message is chat text, rather than a state
+ * notification.
+ * @return 0 if successful, -1 if the message was not queued.
+ */
+static int tu_queue(TU *tu, const struct iovec *iov, int iovcnt, int chat) {
+    size_t len = 0, need;
+    int i, ret = -1;
 
-        case TU_CONNECTED:
-            dprintf(tu->tufd, "%s %d%s", tu_state_names[TU_CONNECTED], tu_extension(tu->peer), EOL);
-            break;
+    for(i=0; i<iovcnt; i++)
+        len += iov[i].iov_len;
+    pthread_mutex_lock(&tu->outlock);
+    if(!tu->connected)
+        goto out;
+    need = tu->outlen + len;
+    if(need > tu_out_hiwat){
+        if(tu_out_policy == TU_OUTPUT_DISCONNECT || need > TU_OUTBUF_HARD * tu_out_hiwat){
+            tu_evict(tu);
+            goto out;
+        }
+        if(tu_out_policy == TU_OUTPUT_DROP && chat){
+            tu->dropped++;
+            goto out;
+        }
+    }
+    if(need > tu->outcap){
+        size_t cap = tu->outcap ? tu->outcap : TU_OUTBUF_INIT;
+        char *nbuf;
+        while(cap < need)
+            cap *= 2;
+        if((nbuf = realloc(tu->outbuf, cap)) == NULL)
+            goto out;
+        tu->outbuf = nbuf;
+        tu->outcap = cap;
+    }
+    for(i=0; i<iovcnt; i++){
+        memcpy(tu->outbuf + tu->outlen, iov[i].iov_base, iov[i].iov_len);
+        tu->outlen += iov[i].iov_len;
+    }
+    if(tu->outlen > tu->maxqueued)
+        tu->maxqueued = tu->outlen;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&tu->outlock);
+    return ret;
+}
 
-        case TU_ERROR:
-            dprintf(tu->tufd, "%s%s", tu_state_names[TU_ERROR], EOL);
+/*
+ * Write bytes to a client without blocking.
+ *
+ * @return the number of bytes written, or -1 with errno set.
+ */
+static ssize_t tu_write(int fd, const char *buf, size_t len) {
+    ssize_t n = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(n < 0 && errno == ENOTSOCK)
+        n = write(fd, buf, len);
+    if(n > 0)
+        stat_add(STAT_BYTES_OUT, n);
+    return n;
+}
+
+/*
+ * Send bytes to the client of a TU, through its sink if it has one.
+ *
+ * @return the number of bytes taken, or -1 with errno set.
+ */
+static ssize_t tu_send(TU *tu, const char *buf, size_t len) {
+    ssize_t n;
+    if(tu->sink.write == NULL)
+        return tu_write(tu->tufd, buf, len);
+    if((n = tu->sink.write(tu->sink.arg, buf, len)) > 0)
+        stat_add(STAT_BYTES_OUT, n);
+    return n;
+}
+
+/*
+ * Writes that cannot complete without blocking are finished by a single
+ * background thread, which waits in an epoll set for the sockets concerned
+ * to become writable.  Each blocked TU is in the set, for one event, and
+ * carries a reference, which the drainer releases once it has resumed
+ * output on that TU.  A TU whose client disconnects while it is blocked is
+ * passed to the drainer on its "gone" list, with a further reference, so
+ * that the drainer releases it at once.
+ */
+static struct {
+    pthread_mutex_t lock;
+    int epfd;               /* epoll set of the sockets of blocked TUs */
+    int wakefd;             /* eventfd used to make the drainer check its gone list */
+    int nblocked;           /* Number of TUs in the epoll set */
+    TU **gone;              /* Blocked TUs whose clients have disconnected */
+    int ngone, gonecap;
+    int running;            /* Set once the drainer thread has been started */
+    int stop;               /* Tells the drainer to exit once no TU is blocked */
+    pthread_t tid;
+} drainer = { PTHREAD_MUTEX_INITIALIZER };
+
+#define DRAIN_EVENTS 64
+
+static void tu_deliver(TU *tu);
+
+static void drainer_wake(void) {
+    uint64_t one = 1;
+    if(write(drainer.wakefd, &one, sizeof(one)) < 0)
+        debug("drainer wakeup failed");
+}
+
+/*
+ * Take a blocked TU out of the epoll set, resume output on it, and drop
+ * the reference held for the drainer.  Its socket is removed from the set
+ * before the TU is marked as unblocked, as tu_disconnect() waits for that
+ * before the socket may be closed.
+ */
+static void drainer_resume(TU *tu) {
+    if(epoll_ctl(drainer.epfd, EPOLL_CTL_DEL, tu->tufd, NULL) < 0)
+        debug("drainer: failed to remove %d", tu->tufd);
+    pthread_mutex_lock(&drainer.lock);
+    drainer.nblocked--;
+    pthread_mutex_unlock(&drainer.lock);
+    pthread_mutex_lock(&tu->outlock);
+    tu->blocked = 0;
+    pthread_cond_broadcast(&tu->drained);
+    pthread_mutex_unlock(&tu->outlock);
+    tu_deliver(tu);
+    tu_unref(tu, "Drained.\n");
+}
+
+/*
+ * Thread function for the drainer.
+ */
+static void *drainer_thread(void *arg) {
+    struct epoll_event events[DRAIN_EVENTS];
+    TU **gone = NULL;
+    int ngone, cap = 0, n, i, stop;
+    uint64_t count;
+
+    while(1){
+        if((n = epoll_wait(drainer.epfd, events, DRAIN_EVENTS, -1)) < 0){
+            if(errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+
+        // Resume every TU whose socket is writable or has hung up.  Each
+        // is reported at most once, as it was added for a single event.
+        for(i=0; i<n; i++){
+            if(events[i].data.ptr == NULL){
+                if(read(drainer.wakefd, &count, sizeof(count)) < 0)
+                    debug("drainer wakeup read failed");
+                continue;
+            }
+            drainer_resume(events[i].data.ptr);
+        }
+
+        // Then release the TUs of disconnected clients, unless resumed above.
+        pthread_mutex_lock(&drainer.lock);
+        if(drainer.ngone > cap){
+            cap = drainer.gonecap;
+            gone = Realloc(gone, cap * sizeof(TU *));
+        }
+        ngone = drainer.ngone;
+        memcpy(gone, drainer.gone, ngone * sizeof(TU *));
+        drainer.ngone = 0;
+        pthread_mutex_unlock(&drainer.lock);
+        for(i=0; i<ngone; i++){
+            pthread_mutex_lock(&gone[i]->outlock);
+            int blocked = gone[i]->blocked;
+            pthread_mutex_unlock(&gone[i]->outlock);
+            if(blocked)
+                drainer_resume(gone[i]);
+            tu_unref(gone[i], "Released by drainer.\n");
+        }
+
+        pthread_mutex_lock(&drainer.lock);
+        stop = drainer.stop && drainer.nblocked == 0 && drainer.ngone == 0;
+        pthread_mutex_unlock(&drainer.lock);
+        if(stop)
             break;
+    }
+    free(gone);
+    return NULL;
+}
 
-        default:
+/*
+ * Stop the drainer thread, if it is running, and wait for it to exit.
+ * This should be called only once all clients have been disconnected,
+ * so that the drainer can release every blocked TU.
+ */
+void tu_output_shutdown(void) {
+    pthread_mutex_lock(&drainer.lock);
+    if(!drainer.running){
+        pthread_mutex_unlock(&drainer.lock);
+        return;
+    }
+    drainer.stop = 1;
+    pthread_mutex_unlock(&drainer.lock);
+    drainer_wake();
+    Pthread_join(drainer.tid, NULL);
+    close(drainer.wakefd);
+    close(drainer.epfd);
+    free(drainer.gone);
+    drainer.gone = NULL;
+    drainer.gonecap = 0;
+    drainer.running = drainer.stop = 0;
+}
+
+/*
+ * Start the drainer thread, if it is not already running.
+ * Must be called with the drainer's lock held.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int drainer_start(void) {
+    struct epoll_event ev;
+
+    if(drainer.running)
+        return 0;
+    if((drainer.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if((drainer.wakefd = eventfd(0, EFD_CLOEXEC)) < 0
+       || epoll_ctl(drainer.epfd, EPOLL_CTL_ADD, drainer.wakefd, &ev) < 0){
+        if(drainer.wakefd >= 0)
+            close(drainer.wakefd);
+        close(drainer.epfd);
+        return -1;
+    }
+    Pthread_create(&drainer.tid, NULL, drainer_thread, NULL);
+    drainer.running = 1;
+    return 0;
+}
+
+/*
+ * Hand a TU whose socket is full to the drainer.  The TU must be marked
+ * as blocked, and a reference taken for the drainer, beforehand.  There
+ * is no limit on the number of blocked TUs.
+ *
+ * @return 0 if successful, -1 if the socket could not be added to the
+ * drainer's epoll set.
+ */
+static int drainer_add(TU *tu) {
+    struct epoll_event ev;
+    int ret = -1;
+
+    pthread_mutex_lock(&drainer.lock);
+    if(drainer_start() == 0){
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        ev.data.ptr = tu;
+        if(epoll_ctl(drainer.epfd, EPOLL_CTL_ADD, tu->tufd, &ev) == 0){
+            drainer.nblocked++;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&drainer.lock);
+    return ret;
+}
+
+/*
+ * Put a blocked TU, whose client has disconnected, on the drainer's gone
+ * list, with a reference that the drainer drops once it has dealt with it.
+ *
+ * @return 0 if successful, -1 if out of memory.
+ */
+static int drainer_gone(TU *tu) {
+    pthread_mutex_lock(&drainer.lock);
+    if(drainer.ngone == drainer.gonecap){
+        int cap = drainer.gonecap ? 2 * drainer.gonecap : 16;
+        TU **nb = realloc(drainer.gone, cap * sizeof(TU *));
+        if(nb == NULL){
+            pthread_mutex_unlock(&drainer.lock);
+            return -1;
+        }
+        drainer.gone = nb;
+        drainer.gonecap = cap;
+    }
+    tu_ref(tu, "Gone while blocked.\n");
+    drainer.gone[drainer.ngone++] = tu;
+    pthread_mutex_unlock(&drainer.lock);
+    drainer_wake();
+    return 0;
+}
+
+/*
+ * Put the unwritten part of a buffer taken by a writer back at the front
+ * of the output queue, ahead of anything queued meanwhile.  Must be called
+ * with outlock held.
+ *
+ * @return 0 if successful, -1 if out of memory.
+ */
+static int tu_requeue(TU *tu, char *buf, size_t cap, size_t off, size_t len) {
+    size_t rest = len - off, need = rest + tu->outlen;
+    memmove(buf, buf + off, rest);
+    if(need > cap){
+        char *nbuf;
+        while(cap < need)
+            cap *= 2;
+        if((nbuf = realloc(buf, cap)) == NULL){
+            free(buf);
+            return -1;
+        }
+        buf = nbuf;
+    }
+    memcpy(buf + rest, tu->outbuf, tu->outlen);
+    tu->spare = tu->outbuf;
+    tu->sparecap = tu->outcap;
+    tu->outbuf = buf;
+    tu->outcap = cap;
+    tu->outlen = need;
+    tu->captured = rest;
+    return 0;
+}
+
+/*
+ * Write everything queued for a TU to its client, without blocking.  Must
+ * be called without holding any TU lock.  If another thread is already
+ * writing to this client, it will also pick up whatever has been queued
+ * meanwhile, so this returns at once; otherwise all messages queued so far
+ * are taken together and sent with a single write.  If the socket fills
+ * up, the rest is left queued and the drainer finishes the job once the
+ * socket becomes writable.  If a write fails, the TU is marked as no
+ * longer connected and its queue is discarded.  Notifications are
+ * captured here (see capture.h), once each and in the order in which
+ * they are written, rather than when queued, so that no TU lock is held.
+ *
+ * The caller must ensure that the TU cannot be freed during the call.
+ */
+static void tu_deliver(TU *tu) {
+    TU_WAITER *waiters;
+    char *buf;
+    size_t len, cap, off, captured;
+    ssize_t n;
+
+    pthread_mutex_lock(&tu->outlock);
+    if(tu->flushing || tu->blocked){
+        pthread_mutex_unlock(&tu->outlock);
+        return;
+    }
+    tu->flushing = 1;
+    while(tu->outlen > 0 && tu->connected){
+        buf = tu->outbuf;
+        len = tu->outlen;
+        cap = tu->outcap;
+        tu->outbuf = tu->spare;
+        tu->outcap = tu->sparecap;
+        tu->outlen = 0;
+        tu->spare = NULL;
+        tu->sparecap = 0;
+        captured = tu->captured;
+        tu->captured = 0;
+        pthread_mutex_unlock(&tu->outlock);
+
+        if(capture != NULL && len > captured)
+            capture_notify(tu->tufd, buf + captured, len - captured);
+
+        for(off = 0; off < len; off += n){
+            if((n = tu_send(tu, buf + off, len - off)) < 0){
+                if(errno == EINTR){
+                    n = 0;
+                    continue;
+                }
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&tu->outlock);
+        if(off == len){
+            free(tu->spare);
+            tu->spare = buf;
+            tu->sparecap = cap;
+        }
+        else if((errno == EAGAIN || errno == EWOULDBLOCK) && tu->connected && tu->sink.write == NULL){
+            if(tu_requeue(tu, buf, cap, off, len) < 0){
+                tu_drop_client(tu);
+                break;
+            }
+            tu->blocked = 1;
+            tu_ref(tu, "Wait for drain.\n");
+            if(drainer_add(tu) < 0){
+                tu->blocked = 0;
+                tu_unref(tu, "Drainer failed.\n");
+                tu_evict(tu);
+            }
             break;
+        }
+        else{
+            free(tu->spare);
+            tu->spare = buf;
+            tu->sparecap = cap;
+            tu_drop_client(tu);
+        }
+    }
+    if(tu->outlen <= tu_out_hiwat)
+        pthread_cond_broadcast(&tu->drained);
+    waiters = tu_take_waiters(tu);
+    tu->flushing = 0;
+    pthread_mutex_unlock(&tu->outlock);
+    tu_resume_senders(waiters);
+}
 
+/*
+ * Wait until the output queue of a TU is back under its high-water mark,
+ * or its client is gone.  Used to stop reading from a client whose chat
+ * is filling a slow peer's queue, when the output policy is TU_OUTPUT_PAUSE.
+ * Must be called without holding any TU lock.
+ */
+static void tu_wait_drained(TU *tu) {
+    pthread_mutex_lock(&tu->outlock);
+    while(tu->connected && tu->outlen > tu_out_hiwat)
+        pthread_cond_wait(&tu->drained, &tu->outlock);
+    pthread_mutex_unlock(&tu->outlock);
+}
+
+/*
+ * Pause a chat sender until the output queue of a TU is back under its
+ * high-water mark, without waiting: w is resumed by the next tu_deliver()
+ * that finds it so, or by tu_disconnect().  Must be called without holding
+ * any TU lock.
+ *
+ * @return 1 if w was registered, 0 if the queue has already drained.
+ */
+static int tu_add_waiter(TU *tu, TU_WAITER *w) {
+    int ret = 0;
+
+    pthread_mutex_lock(&tu->outlock);
+    if(tu->connected && tu->outlen > tu_out_hiwat){
+        w->next = tu->waiters;
+        tu->waiters = w;
+        ret = 1;
     }
+    pthread_mutex_unlock(&tu->outlock);
+    return ret;
+}
 
+/*
+ * Stop all further output to the client of a TU, waiting for a write in
+ * progress in another thread to finish, and for the drainer to release
+ * the TU if it is blocked.  After this returns, the TU no longer uses its
+ * file descriptor, which may then be closed.  Chat senders paused on the
+ * TU are resumed.
+ *
+ * @param tu  The TU whose client is disconnecting.
+ */
+void tu_disconnect(TU *tu) {
+    TU_WAITER *waiters;
+
+    if(tu==NULL)
+        return;
+
+    while(1){
+        pthread_mutex_lock(&tu->outlock);
+        tu_drop_client(tu);
+        if(!tu->flushing)
+            break;
+        pthread_mutex_unlock(&tu->outlock);
+        sched_yield();
+    }
+    if(tu->blocked){
+        if(drainer_gone(tu) < 0)
+            shutdown(tu->tufd, SHUT_RDWR);  // The drainer then sees a hangup.
+        while(tu->blocked)
+            pthread_cond_wait(&tu->drained, &tu->outlock);
+    }
+    waiters = tu_take_waiters(tu);
+    pthread_mutex_unlock(&tu->outlock);
+    tu_resume_senders(waiters);
+}
+
+/*
+ * Get the state of the output queue of a TU.
+ *
+ * @param tu  The TU.
+ * @param st  Where to store the state.
+ */
+void tu_output_stats(TU *tu, TU_OUTPUT_STATS *st) {
+    pthread_mutex_lock(&tu->outlock);
+    st->queued = tu->outlen;
+    st->max_queued = tu->maxqueued;
+    st->dropped = tu->dropped;
+    st->blocked = tu->blocked;
+    st->evicted = tu->evicted;
+    pthread_mutex_unlock(&tu->outlock);
+}
+
+/* Response the current stare of tu to client. */
+int report_current_state(TU *tu){
+    const struct tu_msg *msg;
+    char buf[TU_MSG_MAX];
+    size_t len;
+    int ext;
+
+    if((unsigned int)tu->state > TU_ERROR)
+        return 0;
+    msg = &tu_state_msgs[tu->state];
+    if(tu->state != TU_ON_HOOK && tu->state != TU_CONNECTED)
+        return tu_queue(tu, &(struct iovec){ (void *)msg->text, msg->len }, 1, 0);
+
+    ext = tu->state == TU_ON_HOOK ? tu->extno : tu_extension(tu_peer(tu));
+    memcpy(buf, msg->text, msg->len);
+    len = msg->len;
+    if(ext < 0)
+        buf[len++] = '-';
+    len += tu_itoa(buf + len, ext < 0 ? -(unsigned int)ext : ext);
+    memcpy(buf + len, EOL, sizeof(EOL) - 1);
+    len += sizeof(EOL) - 1;
+    return tu_queue(tu, &(struct iovec){ buf, len }, 1, 0);
+}
+
+/*
+ * TUs and calls are allocated from slab pools.  Their locks are initialized
+ * once per object and are always left unlocked when the object is freed.
+ */
+static SLAB *tu_pool;
+static SLAB *tu_call_pool;
+static pthread_once_t tu_pool_once = PTHREAD_ONCE_INIT;
+
+static void tu_construct(void *obj) {
+    TU *tu = obj;
+    lock_init(&tu->mutex, LOCK_CLASS_TU);
+    pthread_mutex_init(&tu->outlock, NULL);
+    pthread_cond_init(&tu->drained, NULL);
+    tu->outbuf = tu->spare = NULL;
+    tu->outcap = tu->sparecap = 0;
+}
+
+static void tu_call_construct(void *obj) {
+    TU_CALL *call = obj;
+    lock_init(&call->lock, LOCK_CLASS_CALL);
+}
+
+static void tu_pool_init(void) {
+    tu_pool = slab_create(sizeof(TU), tu_construct);
+    tu_call_pool = slab_create(sizeof(TU_CALL), tu_call_construct);
+}
+
+/*
+ * Get statistics of the pool from which TUs are allocated.
+ *
+ * @return 0 if successful, -1 if no TU has been allocated yet.
+ */
+int tu_pool_stats(SLAB_STATS *st) {
+    if(tu_pool == NULL)
+        return -1;
+    slab_stats(tu_pool, st);
     return 0;
 }
 
@@ -73,21 +822,91 @@ int report_current_state(TU *tu){
  * was successful, otherwise NULL.
  */
 TU *tu_init(int fd) {
+    return tu_init_sink(fd, NULL);
+}
+
+/*
+ * Initialize a TU whose notifications go to a sink rather than to a file
+ * descriptor.
+ *
+ * @param fd  The file descriptor of the underlying connection, if any,
+ * otherwise -1.
+ * @param sink  Where notifications are to be sent, or NULL to write them
+ * to fd.  The sink is copied.
+ * @return  The TU, newly initialized and in the TU_ON_HOOK state, if initialization
+ * was successful, otherwise NULL.
+ */
+TU *tu_init_sink(int fd, const TU_SINK *sink) {
     TU *telunit;
-    if( (telunit = (TU *)malloc(sizeof(TU))) == NULL ){
+    pthread_once(&tu_pool_once, tu_pool_init);
+    if(tu_pool == NULL || tu_call_pool == NULL || (telunit = slab_alloc(tu_pool)) == NULL){
         return NULL;
     }
-    telunit->refcnt=0;
+    atomic_init(&telunit->refcnt, 0);
     telunit->extno=-1;
     telunit->tufd=fd;
+    if(sink != NULL)
+        telunit->sink = *sink;
+    else
+        telunit->sink = (TU_SINK){ NULL, NULL };
     telunit->state=TU_ON_HOOK;
-    telunit->peer=NULL;
-    sem_init(&(telunit->mutex), 0, 1);
+    stat_add(STAT_TU_STATE + TU_ON_HOOK, 1);
+    atomic_init(&telunit->call, NULL);
+    telunit->unplugged=0;
+    telunit->outlen=0;
+    telunit->captured=0;
+    telunit->waiters=NULL;
+    telunit->flushing=0;
+    telunit->blocked=0;
+    telunit->connected=1;
+    telunit->evicted=0;
+    telunit->maxqueued=0;
+    telunit->dropped=0;
+#ifdef TU_REF_DEBUG
+    atomic_init(&telunit->nevents, 0);
+    pthread_mutex_lock(&live_lock);
+    telunit->live_prev = NULL;
+    if((telunit->live_next = live_tus) != NULL)
+        live_tus->live_prev = telunit;
+    live_tus = telunit;
+    pthread_mutex_unlock(&live_lock);
+#endif
     return telunit;
 }
 
+/*
+ * Return a TU whose reference count has dropped to zero to the pool.
+ */
+static void tu_free(TU *tu) {
+#ifdef TU_REF_DEBUG
+    pthread_mutex_lock(&live_lock);
+    if(tu->live_prev != NULL)
+        tu->live_prev->live_next = tu->live_next;
+    else
+        live_tus = tu->live_next;
+    if(tu->live_next != NULL)
+        tu->live_next->live_prev = tu->live_prev;
+    pthread_mutex_unlock(&live_lock);
+#endif
+    // Queue buffers are kept with the TU for reuse, unless a burst made them large.
+    if(tu->outcap > TU_OUTBUF_KEEP){
+        free(tu->outbuf);
+        tu->outbuf = NULL;
+        tu->outcap = 0;
+    }
+    if(tu->sparecap > TU_OUTBUF_KEEP){
+        free(tu->spare);
+        tu->spare = NULL;
+        tu->sparecap = 0;
+    }
+    stat_add(STAT_TU_STATE + tu->state, -1);
+    slab_free(tu_pool, tu);
+}
+
 /*
  * Increment the reference count on a TU.
+ * The caller must already hold a reference, or otherwise know that the TU
+ * cannot be freed concurrently, so no ordering is needed.
  *
  * @param tu  The TU whose reference count is to be incremented
  * @param reason  A string describing the reason why the count is being incremented
@@ -97,7 +916,12 @@ void tu_ref(TU *tu, char *reason) {
     if(tu==NULL)
         return;
 
-    tu->refcnt = tu->refcnt + 1;
+    int count = atomic_fetch_add_explicit(&tu->refcnt, 1, memory_order_relaxed) + 1;
+#ifdef TU_REF_DEBUG
+    tu_ref_record(tu, reason, 1, count);
+#else
+    (void)count;
+#endif
     return;
 }
 
@@ -112,9 +936,21 @@ void tu_unref(TU *tu, char *reason) {
     if(tu==NULL)
         return;
 
-    tu->refcnt = tu->refcnt - 1;
-    if(tu->refcnt <= 0)
-        free(tu);
+    /*
+     * Release orders this thread's accesses to the TU before the decrement;
+     * the thread that drops the last reference then acquires all of them
+     * before freeing.
+     */
+    int count = atomic_fetch_sub_explicit(&tu->refcnt, 1, memory_order_release) - 1;
+#ifdef TU_REF_DEBUG
+    tu_ref_record(tu, reason, -1, count);
+    if(count < 0)
+        tu_ref_history(tu, stderr);
+#endif
+    if(count <= 0){
+        atomic_thread_fence(memory_order_acquire);
+        tu_free(tu);
+    }
     return;
 }
 
@@ -149,6 +985,57 @@ int tu_extension(TU *tu) {
     return tu->extno;
 }
 
+/*
+ * Get the lock that guards the state of a TU, given the call it is in.
+ */
+static LOCK *tu_lock_of(TU *tu, TU_CALL *call) {
+    return call != NULL ? &call->lock : &tu->mutex;
+}
+
+/*
+ * Get the peer of a TU, which must be locked.
+ */
+static TU *tu_peer(TU *tu) {
+    TU_CALL *call = atomic_load_explicit(&tu->call, memory_order_relaxed);
+    if(call == NULL)
+        return NULL;
+    return call->ends[0] == tu ? call->ends[1] : call->ends[0];
+}
+
+/*
+ * Publish the state and peer of a TU, which must be locked, to the shared
+ * statistics segment, if there is one.  Once a TU has been unplugged its
+ * extension may belong to another TU, so it no longer publishes.
+ */
+static void tu_publish(TU *tu) {
+    TU *peer;
+    if(shmstat == NULL || tu->unplugged)
+        return;
+    peer = tu_peer(tu);
+    shmstat_set_ext(tu->extno, tu->state, peer != NULL ? peer->extno : -1);
+}
+
+/*
+ * Lock the state of a TU, which is guarded either by its own mutex or by
+ * the lock of the call it is in.  The call may change while we wait for its
+ * lock, so it is checked again once the lock is held and the locking is
+ * retried if it changed.  Without contention this is a single acquire.
+ *
+ * @return the lock that is held.
+ */
+static LOCK *tu_lock(TU *tu) {
+    TU_CALL *call;
+    LOCK *lock;
+    while(1){
+        call = atomic_load_explicit(&tu->call, memory_order_acquire);
+        lock = tu_lock_of(tu, call);
+        lock_acquire(lock);
+        if(atomic_load_explicit(&tu->call, memory_order_acquire) == call)
+            return lock;
+        lock_release(lock);
+    }
+}
+
 /*
  * Set the extension number for a TU.
  * A notification is set to the client of the TU.
@@ -160,14 +1047,195 @@ int tu_set_extension(TU *tu, int ext) {
     if(tu==NULL)
         return -1;
 
-    P(&(tu->mutex));
+    LOCK *lock = tu_lock(tu);
     tu->extno=ext;
+    tu_publish(tu);
     report_current_state(tu);
-    V(&(tu->mutex));
+    lock_release(lock);
+    tu_deliver(tu);
 
     return 0;
 }
 
+/*
+ * Mark a TU as unplugged from the PBX.
+ * The PBX calls this when the TU is unregistered, before hanging it up,
+ * because a concurrent pbx_dial() may already have looked the TU up.  If
+ * that dial locks the TU after this point, it sees the flag and treats the
+ * target as not found; if it got there first, the hangup that follows
+ * cancels the call it made.
+ *
+ * @param tu  The TU being unregistered.
+ */
+void tu_unplug(TU *tu) {
+    if(tu==NULL)
+        return;
+
+    LOCK *lock = tu_lock(tu);
+    if(shmstat != NULL)
+        shmstat_set_ext(tu->extno, -1, -1);
+    tu->unplugged=1;
+    lock_release(lock);
+}
+
+/*
+ * Lock the states of two different TUs.  If they are in the same call this
+ * is a single lock.  Otherwise only the lower of the two locks is waited for
+ * and the other is just tried, backing off if it is busy, so that no thread
+ * waits while holding a lock it may have found through a stale call.  This
+ * lets tu_apply() wait for the lock of a new call while holding the locks of
+ * the two TUs.
+ *
+ * @param lock  Set to the first lock held.
+ * @param olock  Set to the second lock held, or NULL if there is only one.
+ */
+static void tu_lock_two(TU *tu, TU *other, LOCK **lock, LOCK **olock) {
+    TU_CALL *call, *ocall;
+    LOCK *a, *b;
+    while(1){
+        call = atomic_load_explicit(&tu->call, memory_order_acquire);
+        ocall = atomic_load_explicit(&other->call, memory_order_acquire);
+        a = tu_lock_of(tu, call);
+        b = tu_lock_of(other, ocall);
+        if(a == b)
+            b = NULL;
+        else if(b < a){
+            *lock = b;
+            b = a;
+            a = *lock;
+        }
+        lock_acquire(a);
+        if(b != NULL && !lock_try(b)){
+            lock_release(a);
+            sched_yield();
+            continue;
+        }
+        if(atomic_load_explicit(&tu->call, memory_order_acquire) == call
+           && atomic_load_explicit(&other->call, memory_order_acquire) == ocall){
+            *lock = a;
+            *olock = b;
+            return;
+        }
+        if(b != NULL)
+            lock_release(b);
+        lock_release(a);
+    }
+}
+
+/*
+ * Change the state of a TU, which must be locked, keeping count of the TUs
+ * in each state.
+ */
+static void tu_set_state(TU *tu, TU_STATE state) {
+    if(tu->state == state)
+        return;
+    stat_add(STAT_TU_STATE + tu->state, -1);
+    stat_add(STAT_TU_STATE + state, 1);
+    tu->state = state;
+}
+
+/*
+ * Apply the transition for an event to a TU and the other TU involved (the
+ * target of a dial, otherwise the peer), both of which must be locked, and
+ * queue the resulting notifications.
+ *
+ * A transition that starts a call takes the lock of the new call and leaves
+ * it held, in addition to the locks of the two TUs, so that neither TU can be
+ * operated on through the call before both have joined it.  A transition that
+ * ends a call leaves the call to be freed by the caller, once it has released
+ * the lock.  In both cases the TUs switch locks only after everything else.
+ *
+ * @param call  For TU_EV_DIAL_OK, the call to start.
+ * @param msg  The chat text, for TU_EV_CHAT.
+ * @param notify  If notifications were queued for the other TU, a reference
+ * to it is stored here, so that they can be delivered after unlocking.
+ * @return the transition that was applied.
+ */
+static const TU_TRANSITION *tu_apply(TU *tu, TU *other, TU_FSM_EVENT ev,
+                                     TU_CALL *call, char *msg, TU **notify) {
+    const TU_TRANSITION *t = &tu_fsm[tu->state][ev];
+
+    tu_set_state(tu, t->next);
+    if(t->other_next != TU_FSM_SAME)
+        tu_set_state(other, t->other_next);
+
+    if(t->notify & TU_NOTIFY_SELF)
+        report_current_state(tu);
+    if(t->notify & TU_NOTIFY_OTHER)
+        report_current_state(other);
+    if(t->notify & TU_NOTIFY_CHAT){
+        struct iovec iov[] = {
+            { "CHAT ", 5 },
+            { msg, strlen(msg) },
+            { EOL, sizeof(EOL) - 1 }
+        };
+        tu_queue(other, iov, 3, 1);
+    }
+    if(t->notify & (TU_NOTIFY_OTHER | TU_NOTIFY_CHAT)){
+        *notify = other;
+        tu_ref(other, "Deliver.\n");
+    }
+
+    if(t->link == TU_LINK_SET){
+        tu_ref(tu, "Dial.\n");
+        tu_ref(other, "Dial.\n");
+        call->ends[0] = tu;
+        call->ends[1] = other;
+        lock_acquire(&call->lock);
+        stat_add(STAT_CALLS, 1);
+        atomic_store_explicit(&tu->call, call, memory_order_release);
+        atomic_store_explicit(&other->call, call, memory_order_release);
+    }
+    else if(t->link == TU_LINK_CLEAR){
+        stat_add(STAT_CALLS, -1);
+        atomic_store_explicit(&tu->call, NULL, memory_order_release);
+        atomic_store_explicit(&other->call, NULL, memory_order_release);
+    }
+
+    tu_publish(tu);
+    if(other != NULL)
+        tu_publish(other);
+
+    if(t->link == TU_LINK_CLEAR){
+        tu_unref(tu, "Hang Up.\n");
+        tu_unref(other, "Hang Up.\n");
+    }
+    return t;
+}
+
+/*
+ * Deliver the notifications queued by a transition, once the TUs have been
+ * unlocked, and drop the reference taken on the other TU for that purpose.
+ */
+static void tu_deliver_pair(TU *tu, TU *other) {
+    tu_deliver(tu);
+    if(other != NULL){
+        tu_deliver(other);
+        tu_unref(other, "Delivered.\n");
+    }
+}
+
+/*
+ * Carry out a command other than dial, which involves the TU and its peer.
+ */
+static int tu_command(TU *tu, TU_FSM_EVENT ev, char *msg) {
+    const TU_TRANSITION *t;
+    TU *notify = NULL;
+    TU_CALL *call;
+    LOCK *lock;
+
+    if(tu == NULL)
+        return -1;
+    lock = tu_lock(tu);
+    call = atomic_load_explicit(&tu->call, memory_order_relaxed);
+    t = tu_apply(tu, tu_peer(tu), ev, NULL, msg, &notify);
+    lock_release(lock);
+    if(t->link == TU_LINK_CLEAR)
+        slab_free(tu_call_pool, call);
+    tu_deliver_pair(tu, notify);
+    return t->ret;
+}
+
 /*
  * Initiate a call from a specified originating TU to a specified target TU.
  *   If the originating TU is not in the TU_DIAL_TONE state, then there is no effect.
@@ -199,93 +1267,40 @@ int tu_set_extension(TU *tu, int ext) {
  * TU transitioning to the TU_ERROR state. 
  */
 int tu_dial(TU *tu, TU *target) {
+    const TU_TRANSITION *t;
+    TU *notify = NULL;
+    TU_CALL *call = NULL;
+    TU_FSM_EVENT ev;
+    LOCK *lock, *olock = NULL;
+
     if(tu == NULL)
         return -1;
-
-    /* P(mutex) */
-    if( (target == NULL) || (tu == target) ){
-        P(&(tu->mutex));
-    }
-    else if(tu < target){
-        P(&(tu->mutex));
-        P(&(target->mutex));
-    }
-    else{
-        P(&(target->mutex));
-        P(&(tu->mutex));
-    }
-    /* P(mutex) */
-
-    if(tu->state == TU_DIAL_TONE){
-
-        if(target == NULL){
-            tu->state = TU_ERROR;
-            report_current_state(tu);
-            V(&(tu->mutex));
-            return -1;
-        }
-        else if(tu == target){
-            tu->state = TU_BUSY_SIGNAL;
-            report_current_state(tu);
-            V(&(tu->mutex));
-            return 0;
-        }
-        else if((target->peer != NULL) || (target->state != TU_ON_HOOK) ){
-            tu->state = TU_BUSY_SIGNAL;
-            report_current_state(tu);
-            /* V(mutex) */
-            if(tu < target){
-                V(&(tu->mutex));
-                V(&(target->mutex));
-            }
-            else{
-                V(&(target->mutex));
-                V(&(tu->mutex));
-            }
-            /* V(mutex) */
-            return 0;
-        }
-        else{
-            tu->peer = target;
-            target->peer = tu;
-            tu_ref(tu, "Dial.\n");
-            tu_ref(target, "Dial.\n");
-            tu->state = TU_RING_BACK;
-            report_current_state(tu);
-            target->state = TU_RINGING;
-            report_current_state(target);
-            /* V(mutex) */
-            if(tu < target){
-                V(&(tu->mutex));
-                V(&(target->mutex));
-            }
-            else{
-                V(&(target->mutex));
-                V(&(tu->mutex));
-            }
-            /* V(mutex) */
-            return 0;
-        }
-    }
-    else{
-        report_current_state(tu);
-
-        /* V(mutex) */
-        if( (target == NULL) || (tu == target) ){
-            V(&(tu->mutex));
-        }
-        else if(tu < target){
-            V(&(tu->mutex));
-            V(&(target->mutex));
-        }
-        else{
-            V(&(target->mutex));
-            V(&(tu->mutex));
-        }
-        /* V(mutex) */
-
-        return 0;
+    if(target == NULL || target == tu)
+        lock = tu_lock(tu);
+    else
+        tu_lock_two(tu, target, &lock, &olock);
+    if(target == NULL || (target != tu && target->unplugged))
+        ev = TU_EV_DIAL_NONE;
+    else if(target == tu)
+        ev = TU_EV_DIAL_SELF;
+    else if(atomic_load_explicit(&target->call, memory_order_relaxed) != NULL
+            || target->state != TU_ON_HOOK)
+        ev = TU_EV_DIAL_BUSY;
+    else
+        ev = TU_EV_DIAL_OK;
+    if(ev == TU_EV_DIAL_OK && tu_fsm[tu->state][ev].link == TU_LINK_SET
+       && (call = slab_alloc(tu_call_pool)) == NULL){
+        debug("Out of memory for call from %d to %d", tu->extno, target->extno);
+        ev = TU_EV_DIAL_NONE;
     }
+    t = tu_apply(tu, target, ev, call, NULL, &notify);
+    if(olock != NULL)
+        lock_release(olock);
+    lock_release(lock);
+    if(call != NULL)
+        lock_release(&call->lock);
+    tu_deliver_pair(tu, notify);
+    return t->ret;
 }
 
 /*
@@ -306,67 +1321,7 @@ int tu_dial(TU *tu, TU *target) {
  * TU transitioning to the TU_ERROR state. 
  */
 int tu_pickup(TU *tu) {
-    if(tu == NULL)
-        return -1;
-
-    /* P(mutex) */
-    if( (tu->peer == NULL) || (tu == tu->peer) ){
-        P(&(tu->mutex));
-    }
-    else if(tu < tu->peer){
-        P(&(tu->mutex));
-        P(&(tu->peer->mutex));
-    }
-    else{
-        P(&(tu->peer->mutex));
-        P(&(tu->mutex));
-    }
-    /* P(mutex) */
-
-    TU* target = NULL;
-    if(tu->state == TU_ON_HOOK){
-        tu->state = TU_DIAL_TONE;
-        report_current_state(tu);
-        V(&(tu->mutex));
-        return 0;
-    }
-    else if(tu->state == TU_RINGING){
-        target = tu->peer;
-
-        tu->state = TU_CONNECTED;
-        report_current_state(tu);
-        target->state = TU_CONNECTED;
-        report_current_state(target);
-
-        /* V(mutex) */
-        if(tu < target){
-            V(&(tu->mutex));
-            V(&(target->mutex));
-        }
-        else{
-            V(&(target->mutex));
-            V(&(tu->mutex));
-        }
-        /* V(mutex) */
-        return 0;
-    }
-    else{
-        report_current_state(tu);
-        /* V(mutex) */
-        if( (tu->peer == NULL) || (tu == tu->peer) ){
-            V(&(tu->mutex));
-        }
-        else if(tu < tu->peer){
-            V(&(tu->mutex));
-            V(&(tu->peer->mutex));
-        }
-        else{
-            V(&(tu->peer->mutex));
-            V(&(tu->mutex));
-        }
-        /* V(mutex) */
-        return 0;
-    }
+    return tu_command(tu, TU_EV_PICKUP, NULL);
 }
 
 /*
@@ -391,103 +1346,7 @@ int tu_pickup(TU *tu) {
  * TU transitioning to the TU_ERROR state. 
  */
 int tu_hangup(TU *tu) {
-    if(tu == NULL)
-        return -1;
-
-    /* P(mutex) */
-    if( (tu->peer == NULL) || (tu == tu->peer) ){
-        P(&(tu->mutex));
-    }
-    else if(tu < tu->peer){
-        P(&(tu->mutex));
-        P(&(tu->peer->mutex));
-    }
-    else{
-        P(&(tu->peer->mutex));
-        P(&(tu->mutex));
-    }
-    /* P(mutex) */
-
-    TU *target = NULL;
-    if( (tu->state == TU_CONNECTED) || (tu->state == TU_RINGING) ){
-
-        target = tu->peer;
-
-        tu->state = TU_ON_HOOK;
-        report_current_state(tu);
-        target->state = TU_DIAL_TONE;
-        report_current_state(target);
-
-        tu->peer = NULL;
-        target->peer = NULL;
-
-        tu_unref(tu, "Hang Up.\n");
-        tu_unref(target, "Hang Up.\n");
-
-        /* V(mutex) */
-        if(tu < target){
-            V(&(tu->mutex));
-            V(&(target->mutex));
-        }
-        else{
-            V(&(target->mutex));
-            V(&(tu->mutex));
-        }
-        /* V(mutex) */
-
-        return 0;
-
-    }
-    else if( tu->state == TU_RING_BACK ){
-        target = tu->peer;
-
-        tu->state = TU_ON_HOOK;
-        report_current_state(tu);
-        target->state = TU_ON_HOOK;
-        report_current_state(target);
-
-        tu->peer = NULL;
-        target->peer = NULL;
-
-        tu_unref(tu, "Hang Up.\n");
-        tu_unref(target, "Hang Up.\n");
-
-        /* V(mutex) */
-        if(tu < target){
-            V(&(tu->mutex));
-            V(&(target->mutex));
-        }
-        else{
-            V(&(target->mutex));
-            V(&(tu->mutex));
-        }
-        /* V(mutex) */
-
-        return 0;
-    }
-    else if( (tu->state == TU_DIAL_TONE) || (tu->state == TU_BUSY_SIGNAL) || (tu->state == TU_ERROR) ){
-        tu->state = TU_ON_HOOK;
-        report_current_state(tu);
-        V(&(tu->mutex));
-        return 0;
-    }
-    else{
-        report_current_state(tu);
-        /* V(mutex) */
-        if( (tu->peer == NULL) || (tu == tu->peer) ){
-            V(&(tu->mutex));
-        }
-        else if(tu < tu->peer){
-            V(&(tu->mutex));
-            V(&(tu->peer->mutex));
-        }
-        else{
-            V(&(tu->peer->mutex));
-            V(&(tu->mutex));
-        }
-        /* V(mutex) */
-        return 0;
-    }
+    return tu_command(tu, TU_EV_HANGUP, NULL);
 }
 
 /*
@@ -504,51 +1363,61 @@ int tu_hangup(TU *tu) {
  * or some other error occurs.
  */
 int tu_chat(TU *tu, char *msg) {
-    if(tu == NULL)
-        return -1;
+    return tu_chat_nowait(tu, msg, NULL);
+}
 
-    /* P(mutex) */
-    if( (tu->peer == NULL) || (tu == tu->peer) ){
-        P(&(tu->mutex));
-    }
-    else if(tu < tu->peer){
-        P(&(tu->mutex));
-        P(&(tu->peer->mutex));
-    }
-    else{
-        P(&(tu->peer->mutex));
-        P(&(tu->mutex));
-    }
-    /* P(mutex) */
+/*
+ * Send a chat as tu_chat() does, but if the recipient's output queue is
+ * over its high-water mark under TU_OUTPUT_PAUSE, register w to be resumed
+ * once it has drained, rather than waiting here.
+ *
+ * @param tu  The tu sending the chat.
+ * @param msg  The message to be sent.
+ * @param w  The waiter to register, or NULL to wait as tu_chat() does.
+ * @return as tu_chat(), or 1 if the chat was sent and w was registered.
+ */
+int tu_chat_nowait(TU *tu, char *msg, TU_WAITER *w) {
+    const TU_TRANSITION *t;
+    TU *notify = NULL;
+    LOCK *lock;
+    int ret;
 
-    if(tu->state != TU_CONNECTED){
-        report_current_state(tu);
-        /* V(mutex) */
-        if( (tu->peer == NULL) || (tu == tu->peer) ){
-            V(&(tu->mutex));
-        }
-        else if(tu < tu->peer){
-            V(&(tu->mutex));
-            V(&(tu->peer->mutex));
-        }
-        else{
-            V(&(tu->peer->mutex));
-            V(&(tu->mutex));
-        }
-        /* V(mutex) */
+    if(tu == NULL)
         return -1;
+    lock = tu_lock(tu);
+    t = tu_apply(tu, tu_peer(tu), TU_EV_CHAT, NULL, msg, &notify);
+    lock_release(lock);
+    ret = t->ret;
+    tu_deliver(tu);
+    if(notify != NULL){
+        tu_deliver(notify);
+        if(tu_out_policy == TU_OUTPUT_PAUSE){
+            if(w == NULL)
+                tu_wait_drained(notify);
+            else if(tu_add_waiter(notify, w))
+                ret = 1;
+        }
+        tu_unref(notify, "Delivered chat.\n");
     }
+    return ret;
+}
 
-    // CONNECTED STATE.
-    report_current_state(tu);
-    dprintf(tu->peer->tufd, "%s %s%s", "CHAT", msg, EOL);
-    if(tu < tu->peer){
-        V(&(tu->mutex));
-        V(&(tu->peer->mutex));
-    }
-    else{
-        V(&(tu->peer->mutex));
-        V(&(tu->mutex));
-    }
-    return 0;
+/*
+ * Send the client of a TU a notification of its current state, without
+ * changing it.  Used to answer input that is not a command.
+ *
+ * @param tu  The TU.
+ * @return 0 if successful, -1 otherwise.
+ */
+int tu_report(TU *tu) {
+    LOCK *lock;
+    int ret;
+
+    if(tu == NULL)
+        return -1;
+    lock = tu_lock(tu);
+    ret = report_current_state(tu);
+    lock_release(lock);
+    tu_deliver(tu);
+    return ret;
 }
@@ -0,0 +1,100 @@
+/*
+ * Transition table for the TU state machine, shared by the TU module and
+ * the tester.
+ */
+#include "tu_fsm.h"
+
+/*
+ * Transitions that involve only the TU itself: go to state s, or stay in
+ * it, and report it to the client.
+ */
+#define GO(s)           { s, TU_FSM_SAME, TU_LINK_KEEP, TU_NOTIFY_SELF, 0 }
+#define STAY(s)         GO(s)
+#define STAY_FAIL(s)    { s, TU_FSM_SAME, TU_LINK_KEEP, TU_NOTIFY_SELF, -1 }
+
+/* Every dial event from a state in which dialing has no effect. */
+#define NO_DIAL(s) \
+    [TU_EV_DIAL_NONE] STAY(s), [TU_EV_DIAL_SELF] STAY(s), \
+    [TU_EV_DIAL_BUSY] STAY(s), [TU_EV_DIAL_OK] STAY(s)
+
+const TU_TRANSITION tu_fsm[TU_NUM_STATES][TU_EV_COUNT] = {
+    [TU_ON_HOOK] = {
+        [TU_EV_PICKUP]      GO(TU_DIAL_TONE),
+        [TU_EV_HANGUP]      STAY(TU_ON_HOOK),
+        NO_DIAL(TU_ON_HOOK),
+        [TU_EV_CHAT]        STAY_FAIL(TU_ON_HOOK)
+    },
+    [TU_RINGING] = {
+        [TU_EV_PICKUP]      { TU_CONNECTED, TU_CONNECTED, TU_LINK_KEEP,
+                              TU_NOTIFY_SELF | TU_NOTIFY_OTHER, 0 },
+        [TU_EV_HANGUP]      { TU_ON_HOOK, TU_DIAL_TONE, TU_LINK_CLEAR,
+                              TU_NOTIFY_SELF | TU_NOTIFY_OTHER, 0 },
+        NO_DIAL(TU_RINGING),
+        [TU_EV_CHAT]        STAY_FAIL(TU_RINGING)
+    },
+    [TU_DIAL_TONE] = {
+        [TU_EV_PICKUP]      STAY(TU_DIAL_TONE),
+        [TU_EV_HANGUP]      GO(TU_ON_HOOK),
+        [TU_EV_DIAL_NONE]   { TU_ERROR, TU_FSM_SAME, TU_LINK_KEEP, TU_NOTIFY_SELF, -1 },
+        [TU_EV_DIAL_SELF]   GO(TU_BUSY_SIGNAL),
+        [TU_EV_DIAL_BUSY]   GO(TU_BUSY_SIGNAL),
+        [TU_EV_DIAL_OK]     { TU_RING_BACK, TU_RINGING, TU_LINK_SET,
+                              TU_NOTIFY_SELF | TU_NOTIFY_OTHER, 0 },
+        [TU_EV_CHAT]        STAY_FAIL(TU_DIAL_TONE)
+    },
+    [TU_RING_BACK] = {
+        [TU_EV_PICKUP]      STAY(TU_RING_BACK),
+        [TU_EV_HANGUP]      { TU_ON_HOOK, TU_ON_HOOK, TU_LINK_CLEAR,
+                              TU_NOTIFY_SELF | TU_NOTIFY_OTHER, 0 },
+        NO_DIAL(TU_RING_BACK),
+        [TU_EV_CHAT]        STAY_FAIL(TU_RING_BACK)
+    },
+    [TU_BUSY_SIGNAL] = {
+        [TU_EV_PICKUP]      STAY(TU_BUSY_SIGNAL),
+        [TU_EV_HANGUP]      GO(TU_ON_HOOK),
+        NO_DIAL(TU_BUSY_SIGNAL),
+        [TU_EV_CHAT]        STAY_FAIL(TU_BUSY_SIGNAL)
+    },
+    [TU_CONNECTED] = {
+        [TU_EV_PICKUP]      STAY(TU_CONNECTED),
+        [TU_EV_HANGUP]      { TU_ON_HOOK, TU_DIAL_TONE, TU_LINK_CLEAR,
+                              TU_NOTIFY_SELF | TU_NOTIFY_OTHER, 0 },
+        NO_DIAL(TU_CONNECTED),
+        [TU_EV_CHAT]        { TU_CONNECTED, TU_FSM_SAME, TU_LINK_KEEP,
+                              TU_NOTIFY_SELF | TU_NOTIFY_CHAT, 0 }
+    },
+    [TU_ERROR] = {
+        [TU_EV_PICKUP]      STAY(TU_ERROR),
+        [TU_EV_HANGUP]      GO(TU_ON_HOOK),
+        NO_DIAL(TU_ERROR),
+        [TU_EV_CHAT]        STAY_FAIL(TU_ERROR)
+    }
+};
+
+/* The command that gives rise to each event. */
+const TU_COMMAND tu_fsm_event_command[TU_EV_COUNT] = {
+    [TU_EV_PICKUP]      TU_PICKUP_CMD,
+    [TU_EV_HANGUP]      TU_HANGUP_CMD,
+    [TU_EV_DIAL_NONE]   TU_DIAL_CMD,
+    [TU_EV_DIAL_SELF]   TU_DIAL_CMD,
+    [TU_EV_DIAL_BUSY]   TU_DIAL_CMD,
+    [TU_EV_DIAL_OK]     TU_DIAL_CMD,
+    [TU_EV_CHAT]        TU_CHAT_CMD
+};
+
+/*
+ * Get the set of states that a TU can be in after it is sent a command,
+ * as a bitmap with bit s set for each possible state s.
+ *
+ * @param state  The state of the TU when the command is sent.
+ * @param cmd  The command.
+ * @return the bitmap of possible next states.
+ */
+int tu_fsm_next_states(TU_STATE state, TU_COMMAND cmd) {
+    int ev, set = 0;
+    for(ev=0; ev<TU_EV_COUNT; ev++){
+        if(tu_fsm_event_command[ev] == cmd)
+            set |= 1 << tu_fsm[state][ev].next;
+    }
+    return set;
+}
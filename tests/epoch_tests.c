@@ -0,0 +1,102 @@
+/*
+ * Unit tests for epoch-based reclamation (epoch.c).
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "epoch.h"
+
+#define SUITE epoch_suite
+
+static atomic_int released;
+
+static void count_release(void *obj) {
+    atomic_fetch_add(&released, 1);
+}
+
+Test(SUITE, barrier_releases_all_test, .timeout = 5) {
+    static int objs[100];
+    int i;
+
+    for(i=0; i<100; i++)
+        epoch_retire(count_release, &objs[i]);
+    epoch_barrier();
+    cr_assert_eq(atomic_load(&released), 100, "released %d of 100", atomic_load(&released));
+}
+
+Test(SUITE, exited_reader_test, .timeout = 5) {
+    int obj;
+
+    epoch_enter();
+    epoch_exit();
+    epoch_retire(count_release, &obj);
+    epoch_barrier();
+    cr_assert_eq(atomic_load(&released), 1);
+}
+
+static sem_t reader_in, reader_out;
+static int guarded, other;
+
+static void release_guarded(void *obj) {
+    atomic_fetch_add(&released, obj == &guarded ? 1000 : 1);
+}
+
+static void *reader(void *arg) {
+    epoch_enter();
+    sem_post(&reader_in);
+    sem_wait(&reader_out);
+    epoch_exit();
+    return NULL;
+}
+
+Test(SUITE, release_waits_for_reader_test, .timeout = 5) {
+    pthread_t tid;
+    int i;
+
+    sem_init(&reader_in, 0, 0);
+    sem_init(&reader_out, 0, 0);
+    pthread_create(&tid, NULL, reader, NULL);
+    sem_wait(&reader_in);
+
+    // The reader could still hold a pointer to guarded, however many
+    // further retirements try to advance the epoch.
+    epoch_retire(release_guarded, &guarded);
+    for(i=0; i<10; i++)
+        epoch_retire(release_guarded, &other);
+    cr_assert_lt(atomic_load(&released), 1000, "released while a reader was inside");
+
+    sem_post(&reader_out);
+    pthread_join(tid, NULL);
+    epoch_barrier();
+    cr_assert_eq(atomic_load(&released), 1010, "released %d", atomic_load(&released));
+}
+
+#define NTHREADS 4
+#define NRETIRE 10000
+
+static void *retirer(void *arg) {
+    static int obj;
+    int i;
+    for(i=0; i<NRETIRE; i++){
+        epoch_enter();
+        epoch_exit();
+        epoch_retire(count_release, &obj);
+    }
+    return NULL;
+}
+
+Test(SUITE, concurrent_retire_test, .timeout = 30) {
+    pthread_t tids[NTHREADS];
+    int i;
+
+    for(i=0; i<NTHREADS; i++)
+        pthread_create(&tids[i], NULL, retirer, NULL);
+    for(i=0; i<NTHREADS; i++)
+        pthread_join(tids[i], NULL);
+    epoch_barrier();
+    cr_assert_eq(atomic_load(&released), NTHREADS * NRETIRE);
+}
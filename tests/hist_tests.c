@@ -0,0 +1,116 @@
+/*
+ * Unit tests for the log-bucketed histograms (hist.c).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <criterion/criterion.h>
+
+#include "hist.h"
+
+#define SUITE hist_suite
+
+Test(SUITE, small_values_exact_test, .timeout = 5) {
+    uint64_t v;
+    for(v=0; v<HIST_SUB; v++){
+        cr_assert_eq(hist_bucket(v), (int)v);
+        cr_assert_eq(hist_bucket_limit(v), v);
+    }
+}
+
+Test(SUITE, bucket_limits_test, .timeout = 5) {
+    uint64_t lim;
+    int b;
+
+    for(b=0; b<HIST_BUCKETS - 1; b++){
+        lim = hist_bucket_limit(b);
+        cr_assert_eq(hist_bucket(lim), b, "limit of bucket %d falls in %d", b, hist_bucket(lim));
+        cr_assert_eq(hist_bucket(lim + 1), b + 1, "buckets %d and %d not contiguous", b, b + 1);
+    }
+    cr_assert_eq(hist_bucket(UINT64_MAX), HIST_BUCKETS - 1);
+    cr_assert_eq(hist_bucket_limit(HIST_BUCKETS - 1), UINT64_MAX);
+}
+
+Test(SUITE, relative_error_test, .timeout = 5) {
+    uint64_t v, lim;
+    int i;
+
+    srand(1);
+    for(i=0; i<100000; i++){
+        v = ((uint64_t)rand() << 31 | rand()) >> (rand() % 62);
+        lim = hist_bucket_limit(hist_bucket(v));
+        cr_assert_geq(lim, v);
+        cr_assert_leq(lim - v, v / HIST_SUB, "%lu counted up to %lu", v, lim);
+    }
+}
+
+Test(SUITE, quantile_test, .timeout = 5) {
+    static HIST h;
+    uint64_t v, q;
+
+    cr_assert_eq(hist_quantile(&h, 0.5), 0, "quantile of an empty histogram");
+    for(v=1; v<=1000; v++)
+        hist_record(&h, v);
+    cr_assert_eq(atomic_load(&h.count), 1000);
+    cr_assert_eq(atomic_load(&h.sum), 500500);
+    cr_assert_eq(atomic_load(&h.max), 1000);
+    q = hist_quantile(&h, 0.5);
+    cr_assert(q >= 500 && q <= 500 + 500 / HIST_SUB, "p50 %lu", q);
+    q = hist_quantile(&h, 0.99);
+    cr_assert(q >= 990 && q <= 1000, "p99 %lu", q);
+    cr_assert_eq(hist_quantile(&h, 1.0), 1000, "p100 above the maximum");
+    cr_assert_leq(hist_quantile(&h, 0.0), 1);
+}
+
+Test(SUITE, merge_reset_test, .timeout = 5) {
+    static HIST a, b;
+    int i;
+
+    for(i=0; i<10; i++)
+        hist_record(&a, 5);
+    hist_record(&b, 7);
+    hist_record(&b, 1 << 20);
+    hist_merge(&a, &b);
+    cr_assert_eq(atomic_load(&a.count), 12);
+    cr_assert_eq(atomic_load(&a.sum), 50 + 7 + (1 << 20));
+    cr_assert_eq(atomic_load(&a.max), 1 << 20);
+    cr_assert_eq(atomic_load(&a.buckets[hist_bucket(5)]), 10);
+    cr_assert_eq(atomic_load(&b.count), 2, "source of merge changed");
+    hist_reset(&a);
+    cr_assert_eq(atomic_load(&a.count), 0);
+    cr_assert_eq(atomic_load(&a.max), 0);
+    cr_assert_eq(hist_quantile(&a, 0.5), 0);
+}
+
+#define SHARED_THREADS 4
+#define SHARED_VALUES 100000
+
+static HIST shared;
+
+static void *shared_thread(void *arg) {
+    uint64_t base = (uintptr_t)arg;
+    int i;
+    for(i=0; i<SHARED_VALUES; i++)
+        hist_record_shared(&shared, base + i % 100);
+    return NULL;
+}
+
+Test(SUITE, record_shared_test, .timeout = 10) {
+    pthread_t tids[SHARED_THREADS];
+    uint64_t n = 0;
+    int i;
+
+    for(i=0; i<SHARED_THREADS; i++)
+        pthread_create(&tids[i], NULL, shared_thread, (void *)(uintptr_t)(i * 1000));
+    for(i=0; i<SHARED_THREADS; i++)
+        pthread_join(tids[i], NULL);
+    for(i=0; i<HIST_BUCKETS; i++)
+        n += atomic_load(&shared.buckets[i]);
+    cr_assert_eq(atomic_load(&shared.count), SHARED_THREADS * SHARED_VALUES, "counts lost");
+    cr_assert_eq(n, SHARED_THREADS * SHARED_VALUES, "bucket counts lost");
+    cr_assert_eq(atomic_load(&shared.sum),
+                 (uint64_t)SHARED_VALUES * (0 + 1000 + 2000 + 3000) + SHARED_THREADS * 1000 * 4950);
+    cr_assert_eq(atomic_load(&shared.max), 3099);
+}
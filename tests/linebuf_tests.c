@@ -0,0 +1,120 @@
+/*
+ * Unit tests for the line framing of client input (linebuf.c).
+ * Input is written to one end of a socket pair and framed from the other.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <criterion/criterion.h>
+
+#include "linebuf.h"
+
+static int sv[2];
+static LINEBUF lb;
+
+static void lb_setup(void) {
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+    linebuf_init(&lb, sv[0]);
+}
+
+static void lb_teardown(void) {
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void send_str(const char *s) {
+    cr_assert_eq(write(sv[1], s, strlen(s)), (ssize_t)strlen(s), "short write");
+}
+
+/* Send n copies of c, without an EOL. */
+static void send_fill(char c, size_t n) {
+    char *buf = malloc(n);
+    cr_assert_not_null(buf);
+    memset(buf, c, n);
+    cr_assert_eq(write(sv[1], buf, n), (ssize_t)n, "short write");
+    free(buf);
+}
+
+static void expect_line(const char *exp) {
+    char *line;
+    ssize_t len = linebuf_readline(&lb, &line);
+    cr_assert_eq(len, (ssize_t)strlen(exp), "expected length %zu, was %zd", strlen(exp), len);
+    cr_assert_str_eq(line, exp, "expected \"%s\", was \"%s\"", exp, line);
+}
+
+#define SUITE linebuf_suite
+
+Test(SUITE, lines_in_one_read_test, .init = lb_setup, .fini = lb_teardown, .timeout = 5) {
+    send_str("pickup\r\ndial 5\nchat hi there\r\n\r\nhangup\r\n");
+    expect_line("pickup");
+    expect_line("dial 5");
+    expect_line("chat hi there");
+    expect_line("");
+    expect_line("hangup");
+}
+
+Test(SUITE, crlf_split_across_reads_test, .init = lb_setup, .fini = lb_teardown, .timeout = 5) {
+    char *line;
+    size_t len;
+
+    send_str("pickup\r");
+    cr_assert_eq(linebuf_fill(&lb), 7, "first read");
+    cr_assert_eq(linebuf_next(&lb, &line, &len), 0, "line returned before its newline");
+    send_str("\ndial 12");
+    cr_assert_gt(linebuf_fill(&lb), 0, "second read");
+    cr_assert_eq(linebuf_next(&lb, &line, &len), 1, "line not returned");
+    cr_assert_eq(len, 6, "CR not stripped: length %zu", len);
+    cr_assert_str_eq(line, "pickup");
+    cr_assert_eq(linebuf_next(&lb, &line, &len), 0, "partial line returned");
+    send_str("\r\n");
+    expect_line("dial 12");
+}
+
+Test(SUITE, longest_line_test, .init = lb_setup, .fini = lb_teardown, .timeout = 5) {
+    char *line;
+    ssize_t len;
+
+    // A line that, with its CRLF, exactly fills the buffer is kept.
+    send_fill('x', LINEBUF_SIZE - 2);
+    send_str("\r\nhangup\r\n");
+    len = linebuf_readline(&lb, &line);
+    cr_assert_eq(len, LINEBUF_SIZE - 2, "length %zd", len);
+    cr_assert_eq(line[0], 'x');
+    cr_assert_eq(line[len - 1], 'x');
+    cr_assert_eq(line[len], '\0');
+    expect_line("hangup");
+}
+
+Test(SUITE, line_of_buffer_size_test, .init = lb_setup, .fini = lb_teardown, .timeout = 5) {
+    // One byte too many for the buffer: the line is dropped, the next kept.
+    send_fill('x', LINEBUF_SIZE);
+    send_str("\r\npickup\r\n");
+    expect_line("pickup");
+}
+
+Test(SUITE, discard_overlong_line_test, .init = lb_setup, .fini = lb_teardown, .timeout = 5) {
+    send_str("pickup\r\n");
+    send_fill('y', 3 * LINEBUF_SIZE + 100);
+    send_str("\r\ndial 7\r\n");
+    expect_line("pickup");
+    expect_line("dial 7");
+}
+
+Test(SUITE, eof_partial_line_test, .init = lb_setup, .fini = lb_teardown, .timeout = 5) {
+    char *line;
+
+    send_str("pickup\r\nhang");
+    shutdown(sv[1], SHUT_WR);
+    expect_line("pickup");
+    cr_assert_eq(linebuf_readline(&lb, &line), -1, "partial line returned at EOF");
+    cr_assert_eq(linebuf_readline(&lb, &line), -1, "read past EOF");
+}
+
+Test(SUITE, eof_empty_test, .init = lb_setup, .fini = lb_teardown, .timeout = 5) {
+    char *line;
+
+    shutdown(sv[1], SHUT_WR);
+    cr_assert_eq(linebuf_readline(&lb, &line), -1, "line returned at EOF");
+}
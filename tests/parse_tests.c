@@ -0,0 +1,76 @@
+/*
+ * Unit tests for the parsing of client command lines (pbx_client_parse()
+ * in server.c).
+ */
+#include <string.h>
+#include <limits.h>
+
+#include <criterion/criterion.h>
+
+#include "server_extra.h"
+
+#define SUITE parse_suite
+
+static char *msg;
+static int ext;
+
+/* Parse a copy of s, as the line framing would hand it over. */
+static TU_COMMAND parse(const char *s) {
+    static char line[256];
+    strcpy(line, s);
+    msg = NULL;
+    ext = 0;
+    return pbx_client_parse(line, strlen(line), &msg, &ext);
+}
+
+Test(SUITE, pickup_hangup_test, .timeout = 5) {
+    cr_assert_eq(parse("pickup"), TU_PICKUP_CMD);
+    cr_assert_eq(parse("hangup"), TU_HANGUP_CMD);
+    cr_assert_eq(parse("pickup "), TU_NO_CMD, "trailing space accepted");
+    cr_assert_eq(parse("pick"), TU_NO_CMD);
+    cr_assert_eq(parse("hangupx"), TU_NO_CMD);
+    cr_assert_eq(parse("Pickup"), TU_NO_CMD, "wrong case accepted");
+}
+
+Test(SUITE, dial_accepted_test, .timeout = 5) {
+    cr_assert_eq(parse("dial 5"), TU_DIAL_CMD);
+    cr_assert_eq(ext, 5);
+    cr_assert_eq(parse("dial   123  "), TU_DIAL_CMD, "spaces around extension rejected");
+    cr_assert_eq(ext, 123);
+    cr_assert_eq(parse("dial 0"), TU_DIAL_CMD);
+    cr_assert_eq(ext, 0);
+    cr_assert_eq(parse("dial 99999999999999999999"), TU_DIAL_CMD);
+    cr_assert_eq(ext, INT_MAX, "oversized extension not clamped");
+}
+
+Test(SUITE, dial_rejected_test, .timeout = 5) {
+    static const char *bad[] = { "dial", "dial ", "dial abc", "dial 5x", "dial -3", "dial 5 6", "dial +5" };
+    unsigned int i;
+
+    for(i=0; i<sizeof(bad)/sizeof(bad[0]); i++){
+        cr_assert_eq(parse(bad[i]), TU_NO_CMD, "\"%s\" accepted", bad[i]);
+        cr_assert_eq(ext, -1, "\"%s\" not marked as a malformed dial", bad[i]);
+    }
+    cr_assert_eq(parse("dialx 5"), TU_NO_CMD);
+    cr_assert_eq(ext, 0, "\"dialx 5\" marked as a dial");
+    cr_assert_eq(parse("dia"), TU_NO_CMD);
+    cr_assert_eq(ext, 0);
+}
+
+Test(SUITE, chat_test, .timeout = 5) {
+    cr_assert_eq(parse("chat hello there"), TU_CHAT_CMD);
+    cr_assert_str_eq(msg, "hello there");
+    cr_assert_eq(parse("chat    spaced "), TU_CHAT_CMD);
+    cr_assert_str_eq(msg, "spaced ", "leading spaces kept or trailing ones lost");
+    cr_assert_eq(parse("chat"), TU_CHAT_CMD);
+    cr_assert_str_eq(msg, "");
+    cr_assert_eq(parse("chatter"), TU_NO_CMD);
+    cr_assert_eq(parse("cha"), TU_NO_CMD);
+}
+
+Test(SUITE, unknown_test, .timeout = 5) {
+    cr_assert_eq(parse(""), TU_NO_CMD);
+    cr_assert_eq(parse("foo"), TU_NO_CMD);
+    cr_assert_eq(parse(" pickup"), TU_NO_CMD, "leading space accepted");
+    cr_assert_eq(ext, 0, "unknown verb marked as a dial");
+}
@@ -0,0 +1,145 @@
+/*
+ * Unit tests for the bounded connection queue (sbuf.c).
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "sbuf.h"
+
+#define SUITE sbuf_suite
+
+Test(SUITE, fifo_order_test, .timeout = 5) {
+    sbuf_t sb;
+    SBUF_STATS st;
+    int i;
+
+    sbuf_init(&sb, 4);
+    for(i=0; i<4; i++)
+        sbuf_insert(&sb, i);
+    for(i=0; i<4; i++)
+        cr_assert_eq(sbuf_remove(&sb), i, "items out of order");
+    sbuf_stats(&sb, &st);
+    cr_assert_eq(st.capacity, 4);
+    cr_assert_eq(st.depth, 0);
+    cr_assert_eq(st.max_depth, 4);
+    cr_assert_eq(st.removed, 4);
+    sbuf_deinit(&sb);
+}
+
+Test(SUITE, wraparound_test, .timeout = 5) {
+    sbuf_t sb;
+    int i;
+
+    sbuf_init(&sb, 3);
+    for(i=0; i<10; i++){
+        sbuf_insert(&sb, 2 * i);
+        sbuf_insert(&sb, 2 * i + 1);
+        cr_assert_eq(sbuf_remove(&sb), 2 * i);
+        cr_assert_eq(sbuf_remove(&sb), 2 * i + 1);
+    }
+    sbuf_deinit(&sb);
+}
+
+Test(SUITE, tryremove_test, .timeout = 5) {
+    sbuf_t sb;
+    int item = -1;
+
+    sbuf_init(&sb, 2);
+    cr_assert_eq(sbuf_tryremove(&sb, &item), -1, "removed from an empty buffer");
+    sbuf_insert(&sb, 7);
+    cr_assert_eq(sbuf_tryremove(&sb, &item), 0, "nothing removed");
+    cr_assert_eq(item, 7);
+    cr_assert_eq(sbuf_tryremove(&sb, &item), -1, "removed from an empty buffer");
+    sbuf_deinit(&sb);
+}
+
+Test(SUITE, tryinsert_test, .timeout = 5) {
+    sbuf_t sb;
+
+    sbuf_init(&sb, 2);
+    cr_assert_eq(sbuf_tryinsert(&sb, 1), 0, "insert into an empty buffer failed");
+    cr_assert_eq(sbuf_tryinsert(&sb, 2), 0, "insert into a non-full buffer failed");
+    cr_assert_eq(sbuf_tryinsert(&sb, 3), -1, "inserted into a full buffer");
+    cr_assert_eq(sbuf_remove(&sb), 1);
+    cr_assert_eq(sbuf_tryinsert(&sb, 3), 0, "insert after a remove failed");
+    cr_assert_eq(sbuf_remove(&sb), 2);
+    cr_assert_eq(sbuf_remove(&sb), 3);
+    sbuf_deinit(&sb);
+}
+
+static sbuf_t full_sb;
+static atomic_int inserted;
+
+static void *fill_thread(void *arg) {
+    int i;
+    for(i=0; i<3; i++){
+        sbuf_insert(&full_sb, i);
+        atomic_fetch_add(&inserted, 1);
+    }
+    return NULL;
+}
+
+Test(SUITE, insert_blocks_when_full_test, .timeout = 5) {
+    pthread_t tid;
+
+    sbuf_init(&full_sb, 2);
+    pthread_create(&tid, NULL, fill_thread, NULL);
+    usleep(100000);
+    cr_assert_eq(atomic_load(&inserted), 2, "insert did not block on a full buffer");
+    cr_assert_eq(sbuf_remove(&full_sb), 0);
+    pthread_join(tid, NULL);
+    cr_assert_eq(atomic_load(&inserted), 3);
+    cr_assert_eq(sbuf_remove(&full_sb), 1);
+    cr_assert_eq(sbuf_remove(&full_sb), 2);
+    sbuf_deinit(&full_sb);
+}
+
+#define NPRODUCERS 4
+#define NCONSUMERS 3
+#define NITEMS 20000
+
+static sbuf_t mpmc_sb;
+static atomic_long consumed_sum;
+
+static void *producer(void *arg) {
+    long base = (long)arg * NITEMS;
+    int i;
+    for(i=0; i<NITEMS; i++)
+        sbuf_insert(&mpmc_sb, base + i);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    int item;
+    while((item = sbuf_remove(&mpmc_sb)) >= 0)
+        atomic_fetch_add(&consumed_sum, item);
+    return NULL;
+}
+
+Test(SUITE, many_producers_consumers_test, .timeout = 30) {
+    pthread_t prod[NPRODUCERS], cons[NCONSUMERS];
+    long n = (long)NPRODUCERS * NITEMS;
+    SBUF_STATS st;
+    long i;
+
+    sbuf_init(&mpmc_sb, 8);
+    for(i=0; i<NCONSUMERS; i++)
+        pthread_create(&cons[i], NULL, consumer, NULL);
+    for(i=0; i<NPRODUCERS; i++)
+        pthread_create(&prod[i], NULL, producer, (void *)i);
+    for(i=0; i<NPRODUCERS; i++)
+        pthread_join(prod[i], NULL);
+    for(i=0; i<NCONSUMERS; i++)
+        sbuf_insert(&mpmc_sb, -1);
+    for(i=0; i<NCONSUMERS; i++)
+        pthread_join(cons[i], NULL);
+    cr_assert_eq(atomic_load(&consumed_sum), n * (n - 1) / 2, "items lost or duplicated");
+    sbuf_stats(&mpmc_sb, &st);
+    cr_assert_eq(st.removed, n + NCONSUMERS);
+    cr_assert_leq(st.max_depth, 8);
+    sbuf_deinit(&mpmc_sb);
+}
@@ -0,0 +1,133 @@
+/*
+ * Unit tests for the object pool (slab.c).
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "slab.h"
+
+#define SUITE slab_suite
+
+typedef struct {
+    int constructed;
+    int value;
+} OBJ;
+
+static atomic_int nctors;
+
+static void obj_ctor(void *p) {
+    OBJ *o = p;
+    o->constructed++;
+    o->value = -1;
+    atomic_fetch_add(&nctors, 1);
+}
+
+Test(SUITE, alignment_test, .timeout = 5) {
+    SLAB *sp = slab_create(10, NULL);
+    SLAB_STATS st;
+    void *a, *b;
+
+    cr_assert_not_null(sp);
+    a = slab_alloc(sp);
+    b = slab_alloc(sp);
+    cr_assert_not_null(a);
+    cr_assert_not_null(b);
+    cr_assert_eq((uintptr_t)a % SLAB_ALIGN, 0, "object not aligned");
+    cr_assert_eq((uintptr_t)b % SLAB_ALIGN, 0, "object not aligned");
+    slab_stats(sp, &st);
+    cr_assert_eq(st.obj_size, SLAB_ALIGN, "size %zu not rounded to a cache line", st.obj_size);
+}
+
+Test(SUITE, constructor_once_test, .timeout = 5) {
+    SLAB *sp = slab_create(sizeof(OBJ), obj_ctor);
+    OBJ *o, *p;
+
+    o = slab_alloc(sp);
+    cr_assert_eq(o->constructed, 1);
+    cr_assert_eq(o->value, -1);
+    o->value = 42;
+    slab_free(sp, o);
+    p = slab_alloc(sp);
+    cr_assert_eq(p, o, "freed object not reused from the cache");
+    cr_assert_eq(p->constructed, 1, "constructor ran again");
+    cr_assert_eq(p->value, 42, "state not kept across free");
+}
+
+#define NOBJS 1000
+
+Test(SUITE, distinct_objects_test, .timeout = 5) {
+    SLAB *sp = slab_create(sizeof(OBJ), obj_ctor);
+    static OBJ *objs[NOBJS];
+    SLAB_STATS st;
+    int i;
+
+    for(i=0; i<NOBJS; i++){
+        objs[i] = slab_alloc(sp);
+        cr_assert_not_null(objs[i]);
+        objs[i]->value = i;
+    }
+    for(i=0; i<NOBJS; i++)
+        cr_assert_eq(objs[i]->value, i, "objects overlap");
+    slab_stats(sp, &st);
+    cr_assert_eq(st.in_use, NOBJS);
+    cr_assert_eq(st.high_water, NOBJS);
+    cr_assert_eq(st.allocs, NOBJS);
+    cr_assert_geq(st.objects, NOBJS);
+    cr_assert_eq(atomic_load(&nctors), st.objects, "constructor count differs from objects");
+
+    for(i=0; i<NOBJS; i++)
+        slab_free(sp, objs[i]);
+    slab_stats(sp, &st);
+    cr_assert_eq(st.in_use, 0);
+    cr_assert_eq(st.high_water, NOBJS);
+
+    // Everything freed is reused before a new slab is carved.
+    for(i=0; i<NOBJS; i++)
+        objs[i] = slab_alloc(sp);
+    slab_stats(sp, &st);
+    cr_assert_eq(atomic_load(&nctors), st.objects, "new objects carved");
+    cr_assert_lt(st.objects, 2 * NOBJS, "freed objects not reused");
+}
+
+#define NTHREADS 4
+#define NROUNDS 2000
+#define NHELD 50
+
+static SLAB *shared_sp;
+
+static void *churn(void *arg) {
+    OBJ *held[NHELD];
+    int r, i;
+    for(r=0; r<NROUNDS; r++){
+        for(i=0; i<NHELD; i++){
+            held[i] = slab_alloc(shared_sp);
+            held[i]->value = (long)arg;
+        }
+        for(i=0; i<NHELD; i++){
+            cr_assert_eq(held[i]->value, (long)arg, "object shared between threads");
+            slab_free(shared_sp, held[i]);
+        }
+    }
+    return NULL;
+}
+
+Test(SUITE, threads_test, .timeout = 30) {
+    pthread_t tids[NTHREADS];
+    SLAB_STATS st;
+    long i;
+
+    shared_sp = slab_create(sizeof(OBJ), obj_ctor);
+    for(i=0; i<NTHREADS; i++)
+        pthread_create(&tids[i], NULL, churn, (void *)i);
+    for(i=0; i<NTHREADS; i++)
+        pthread_join(tids[i], NULL);
+    slab_stats(shared_sp, &st);
+    cr_assert_eq(st.in_use, 0);
+    cr_assert_eq(st.allocs, (uint64_t)NTHREADS * NROUNDS * NHELD);
+    cr_assert_leq(st.high_water, NTHREADS * NHELD);
+    cr_assert_gt(st.cache_hits, st.allocs / 2, "per-thread caches not used");
+}
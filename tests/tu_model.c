@@ -0,0 +1,78 @@
+/*
+ * Client-side model of the TU state machine (see tu_model.h).
+ */
+#include "tu_model.h"
+
+/*
+ * The "normal case" states are those the server's own transition table
+ * (see tu_fsm.h) can produce, and are filled in from it by init_next_states().
+ * Only the "abnormal case" states are listed here.
+ */
+static const int resync_states[NUM_STATES][NUM_COMMANDS] = {
+  [TU_ON_HOOK] {
+      R(TU_RINGING) | R(TU_ON_HOOK),                    // TU_PICKUP_CMD
+      R(TU_RINGING),                                    // TU_HANGUP_CMD
+      R(TU_RINGING),                                    // TU_DIAL_CMD
+      R(TU_RINGING),                                    // TU_CHAT_CMD
+      R(TU_ON_HOOK) | R(TU_RINGING)                     // DELAY
+  },
+  [TU_RINGING] {
+      R(TU_ON_HOOK) | R(TU_RINGING),                    // TU_PICKUP_CMD
+      R(TU_RINGING),                                    // TU_HANGUP_CMD
+      R(TU_ON_HOOK),                                    // TU_DIAL_CMD
+      R(TU_ON_HOOK),                                    // TU_CHAT_CMD
+      R(TU_RINGING) | R(TU_ON_HOOK)                     // DELAY
+  },
+  [TU_DIAL_TONE] {
+      0,                                                // TU_PICKUP_CMD
+      R(TU_DIAL_TONE),                                  // TU_HANGUP_CMD
+      R(TU_DIAL_TONE),                                  // TU_DIAL_CMD
+      0,                                                // TU_CHAT_CMD
+      R(TU_DIAL_TONE)                                   // DELAY
+  },
+  [TU_RING_BACK] {
+      R(TU_CONNECTED) | R(TU_DIAL_TONE),                // TU_PICKUP_CMD
+      R(TU_CONNECTED) | R(TU_DIAL_TONE) | R(TU_RING_BACK), // TU_HANGUP_CMD
+      R(TU_CONNECTED) | R(TU_DIAL_TONE),                // TU_DIAL_CMD
+      R(TU_CONNECTED) | R(TU_DIAL_TONE),                // TU_CHAT_CMD
+      R(TU_RING_BACK) | R(TU_CONNECTED) | R(TU_DIAL_TONE) // DELAY
+  },
+  [TU_BUSY_SIGNAL] {
+      0,                                                // TU_PICKUP_CMD
+      R(TU_BUSY_SIGNAL),                                // TU_HANGUP_CMD
+      0,                                                // TU_DIAL_CMD
+      0,                                                // TU_CHAT_CMD
+      R(TU_BUSY_SIGNAL)                                 // DELAY
+  },
+  [TU_CONNECTED] {
+      R(TU_DIAL_TONE) | R(TU_CONNECTED),                // TU_PICKUP_CMD
+      R(TU_DIAL_TONE) | R(TU_CONNECTED),                // TU_HANGUP_CMD
+      R(TU_DIAL_TONE),                                  // TU_DIAL_CMD
+      R(TU_DIAL_TONE),                                  // TU_CHAT_CMD
+      R(TU_CONNECTED) | R(TU_DIAL_TONE)                 // DELAY
+  },
+  [TU_ERROR] {
+      0,                                                // TU_PICKUP_CMD
+      R(TU_ERROR),                                      // TU_HANGUP_CMD
+      0,                                                // TU_DIAL_CMD
+      0,                                                // TU_CHAT_CMD
+      R(TU_ERROR)                                       // DELAY
+  }
+};
+
+int next_states[NUM_STATES][NUM_COMMANDS];
+
+/*
+ * Fill in next_states[] from the server's transition table and the
+ * resynchronization states above.
+ */
+void init_next_states(void) {
+    int s, c;
+    for(s=0; s<NUM_STATES; s++){
+        for(c=0; c<NUM_COMMANDS; c++){
+            next_states[s][c] = resync_states[s][c];
+            if(c != DELAY_COMMAND)
+                next_states[s][c] |= tu_fsm_next_states(s, c);
+        }
+    }
+}
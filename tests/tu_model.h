@@ -0,0 +1,53 @@
+#ifndef TU_MODEL_H
+#define TU_MODEL_H
+
+#include "tu_fsm.h"
+
+/*
+ * Client-side model of the TU state machine, shared by the script tester
+ * and the load generator (util/pbx_loadgen.c).
+ *
+ * States and commands are numbered as in tu.h and server.h, with one more
+ * pseudo-command, a delay, after the real ones.
+ */
+#define NUM_STATES 7
+#define NUM_COMMANDS 5
+#define DELAY_COMMAND (NUM_COMMANDS-1)
+
+/*
+ * Table of expected next states.
+ * Each entry is a bitmap that specifies a set of possible next states, given
+ * the current state and the last command that was issued.
+ *
+ * An issue that a client has to handle is that commands to the server can
+ * "cross in transit" asynchronous state-change notifications coming back from the server.
+ * If we are currently in the TU_ON_HOOK state and we send a TU_PICKUP_CMD, it might
+ * be that the TU_PICKUP_CMD crosses in transit a TU_RINGING notification being sent
+ * back to us.  What we will see is a next-state notification of TU_RINGING, rather
+ * than the TU_DIAL_TONE notification that we would otherwise expect.
+ *
+ * To handle this, there are two classes of expected states encoded in each entry of
+ * the table.  The "normal case" encodes a TU_STATE s as the bit value 1<<s, and it
+ * indicates a state that we would expect to see if there were no "crossing in transit".
+ * The "abnormal case" encodes additional states that we might see when messages
+ * cross in transit.  These are encoded as 1<<(s+RESYNC), where RESYNC is larger than
+ * any TU_STATE value.  When we receive a state notification, it is checked against
+ * the expected state bitmap.  If we find that state among the "normal case" states,
+ * then nothing special happens and we proceed on to selecting the next command to send.
+ * On the other hand, if we find that state among the "abnormal case" states, then
+ * a "resync" flag is set and we do not immediately select a new command to send.
+ * Instead, we assume that what we have just received is an asynchronous state-change
+ * notification that crossed in transit our last command, and that the response to
+ * our last command is still forthcoming.  In this situation, we redetermine the set
+ * of expected events based on the new state, but the last command that we sent.
+ * When we finally do receive a "normal case" response, then the resynchronization is
+ * over and we proceed to send another command.
+ */
+#define RESYNC NUM_STATES
+#define R(s) (1<<((s)+RESYNC))
+
+extern int next_states[NUM_STATES][NUM_COMMANDS];
+
+void init_next_states(void);
+
+#endif
@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# A/B comparison of our server against the reference modules (make abbench).
+#
+# The same load, from bin/pbx_loadgen, is run against each variant in turn:
+# our server, our server with one module (server, pbx or tu) taken from
+# lib/pbx.a, and the whole reference server (demo/pbx, standing in for main,
+# which the archive does not have).  Every variant runs thread-per-client,
+# the only mode the reference has.  For each, a row of the table gives the
+# throughput and response latency seen by the load generator, the CPU time
+# the server used, and its peak RSS.  A variant that is slower than ours
+# points at the module that it swaps.
+#
+# Usage: ab_bench.sh [-p <first port>] [-n <TUs>] [-d <seconds>] [-k <think ms>] [-t <threads>]
+#   The reference registry holds at most FD_SETSIZE TUs, so keep -n below that.
+
+BIN=bin
+port=9700
+ntus=200
+secs=5
+think=10
+threads=1
+
+usage() {
+    echo "usage: $0 [-p <first port>] [-n <TUs>] [-d <seconds>] [-k <think ms>] [-t <threads>]" >&2
+    exit 1
+}
+
+while getopts p:n:d:k:t: opt; do
+    case $opt in
+        p) port=$OPTARG ;;
+        n) ntus=$OPTARG ;;
+        d) secs=$OPTARG ;;
+        k) think=$OPTARG ;;
+        t) threads=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+ticks=$(getconf CLK_TCK)
+
+# Wait for a server to accept connections on a port.
+wait_listening() {
+    i=0
+    while [ $i -lt 50 ]; do
+        if awk -v p=":$(printf '%04X' $1)" '$4 == "0A" && substr($2, length($2) - 4) == p { found = 1 }
+                END { exit !found }' /proc/net/tcp /proc/net/tcp6 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+        i=$((i + 1))
+    done
+    return 1
+}
+
+# Print one row of the table for a variant.
+run() {
+    name=$1
+    exe=$2
+    port=$((port + 1))
+    "$exe" -p $port 2>/dev/null &
+    pid=$!
+    if ! wait_listening $port; then
+        printf "%-14s %s\n" "$name" "(did not start)"
+        kill $pid 2>/dev/null
+        wait $pid 2>/dev/null
+        return
+    fi
+    $BIN/pbx_loadgen -p $port -n $ntus -d $secs -k $think -t $threads > "$out" 2>/dev/null
+    rss=$(awk '/^VmHWM/ { print $2 }' /proc/$pid/status)
+    cpu=$(awk -v t=$ticks '{ printf "%.2f", ($14 + $15) / t }' /proc/$pid/stat)
+    kill -HUP $pid
+    wait $pid 2>/dev/null
+    awk -v name="$name" -v rss="$rss" -v cpu="$cpu" '
+        $1 == "commands/s" { cmds = $2 }
+        $1 == "calls/s" { calls = $2 }
+        $1 == "unexpected" { unexpected = $2 }
+        $1 == "latency" { p50 = $4; p99 = $8 }
+        END {
+            printf "%-14s %12s %10s %10s %10s %12s %12s %12s\n",
+                   name, cmds, calls, p50, p99, cpu, rss, unexpected
+        }' "$out"
+}
+
+echo "$ntus TUs for $secs s, think $think ms, $threads load threads"
+printf "%-14s %12s %10s %10s %10s %12s %12s %12s\n" \
+       "variant" "commands/s" "calls/s" "p50 us" "p99 us" "server cpu s" "max RSS kB" "unexpected"
+run "ours" $BIN/pbx
+run "ref server" $BIN/pbx_ref_server
+run "ref pbx" $BIN/pbx_ref_pbx
+run "ref tu" $BIN/pbx_ref_tu
+run "reference" $BIN/pbx_demo
@@ -0,0 +1,538 @@
+/*
+ * Load generator for the PBX server.
+ *
+ * Simulates many concurrent TUs, each with its own connection to the
+ * server, spread over a few threads that each multiplex their TUs with
+ * epoll.  Every TU follows the client-side model of the script tester
+ * (tests/tu_model.h): after each command it expects one of the states in
+ * next_states[][] for its state and that command, resynchronizing when a
+ * notification crosses the command in transit, and between commands it
+ * expects only the asynchronous notifications of the DELAY column.  Any
+ * state the model does not allow is counted as unexpected.
+ *
+ * Once a TU has had the response to its command, it thinks for a random
+ * time (exponentially distributed about the given mean) and then issues
+ * another, drawn from the given mix of pickup, dial, chat and hangup.  By
+ * default only commands that can get somewhere from the TU's current state
+ * are drawn (e.g. only pickup when on hook, dial or hangup at dial tone,
+ * chat or hangup when connected), which keeps calls being set up and torn
+ * down; with -a any command may be drawn in any state.  Dials go to random
+ * extensions among the simulated TUs.
+ *
+ * Reported are the commands per second, the calls set up per second (an
+ * answer that connects), and the latency of responses: the time from
+ * sending a command to receiving the notification that completes it.
+ *
+ * Usage: pbx_loadgen [-h <host>] [-p <port>] [-n <TUs>] [-t <threads>]
+ *                    [-d <seconds>] [-m <pickup>:<dial>:<chat>:<hangup>]
+ *                    [-k <think ms>] [-a]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "hist.h"
+#include "tu_model.h"
+
+#define USAGE "usage: %s [-h <host>] [-p <port>] [-n <TUs>] [-t <threads>] [-d <seconds>]" \
+              " [-m <pickup>:<dial>:<chat>:<hangup>] [-k <think ms>] [-a]\n"
+
+/* How long to wait for the response to a command before giving up on it. */
+#define RESPONSE_TIMEOUT_NS 5000000000ULL
+
+/* How long to wait before retrying a command that the socket would not take. */
+#define RETRY_NS 1000000ULL
+
+#define MAX_LINE 512
+#define MAX_EVENTS 64
+
+/* One simulated TU. */
+typedef struct lg_tu {
+    int fd;
+    int extension;
+    TU_STATE state;
+    int expected;               /* Expected next states, as in tu_model.h */
+    TU_COMMAND last_command;
+    int awaiting;               /* Set while the last command has had no response */
+    uint64_t sent_ns;           /* When the last command was sent */
+    uint64_t due_ns;            /* When to act next, or to give up waiting */
+    int heap_index;
+    unsigned int seed;
+    size_t inlen;
+    char in[MAX_LINE];
+}LG_TU;
+
+/* Counters kept by each loop, read by the main thread while it runs. */
+typedef enum {
+    LG_COMMANDS, LG_CALLS, LG_NOTIFICATIONS, LG_CHATS, LG_RESYNCS, LG_UNEXPECTED,
+    LG_TIMEOUTS, LG_DISCONNECTS, LG_NUM_COUNTERS
+} LG_COUNTER;
+
+static char *lg_counter_names[] = {
+    "commands", "calls", "notifications", "chats", "resyncs", "unexpected",
+    "timeouts", "disconnects"
+};
+
+/* One event loop, with the TUs it drives. */
+typedef struct lg_loop {
+    pthread_t tid;
+    int epfd;
+    LG_TU **heap;               /* The TUs, ordered by due_ns */
+    int ntus;
+    HIST latency;               /* Response latencies, in nanoseconds */
+    atomic_ulong counters[LG_NUM_COUNTERS];
+}LG_LOOP;
+
+static int *extensions, nextensions;
+static int weights[TU_NUM_COMMANDS] = {
+    [TU_PICKUP_CMD] 30, [TU_DIAL_CMD] 30, [TU_CHAT_CMD] 20, [TU_HANGUP_CMD] 20
+};
+static int any_command;
+static double think_ms = 100;
+static uint64_t end_ns;
+static size_t state_name_len[TU_NUM_STATES];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lg_count(LG_LOOP *lp, LG_COUNTER c) {
+    hist_inc(&lp->counters[c], 1);
+}
+
+/*
+ * Binary heap of a loop's TUs, by due time.
+ */
+static void heap_swap(LG_LOOP *lp, int i, int j) {
+    LG_TU *t = lp->heap[i];
+    lp->heap[i] = lp->heap[j];
+    lp->heap[j] = t;
+    lp->heap[i]->heap_index = i;
+    lp->heap[j]->heap_index = j;
+}
+
+/*
+ * Restore the heap order after the due time of a TU has changed.
+ */
+static void heap_fix(LG_LOOP *lp, LG_TU *tu) {
+    int i = tu->heap_index, c;
+    while(i > 0 && lp->heap[(i - 1) / 2]->due_ns > lp->heap[i]->due_ns){
+        heap_swap(lp, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while((c = 2 * i + 1) < lp->ntus){
+        if(c + 1 < lp->ntus && lp->heap[c + 1]->due_ns < lp->heap[c]->due_ns)
+            c++;
+        if(lp->heap[i]->due_ns <= lp->heap[c]->due_ns)
+            break;
+        heap_swap(lp, i, c);
+        i = c;
+    }
+}
+
+static void lg_schedule(LG_LOOP *lp, LG_TU *tu, uint64_t due) {
+    tu->due_ns = due;
+    heap_fix(lp, tu);
+}
+
+/*
+ * Draw a think time, exponentially distributed about the mean.
+ */
+static uint64_t lg_think(LG_TU *tu) {
+    double u = (rand_r(&tu->seed) + 1.0) / (RAND_MAX + 2.0);
+    return -log(u) * think_ms * 1e6;
+}
+
+/*
+ * Choose the next command of a TU from the mix.
+ */
+static TU_COMMAND lg_choose(LG_TU *tu) {
+    int w[TU_NUM_COMMANDS], c, total = 0, r;
+
+    for(c=0; c<TU_NUM_COMMANDS; c++){
+        w[c] = weights[c];
+        // Without -a, only commands that may leave the state, or chat in a call.
+        if(!any_command && (next_states[tu->state][c] & ((1 << NUM_STATES) - 1)) == 1 << tu->state
+           && !(c == TU_CHAT_CMD && tu->state == TU_CONNECTED))
+            w[c] = 0;
+        total += w[c];
+    }
+    if(total == 0)
+        return TU_HANGUP_CMD;
+    r = rand_r(&tu->seed) % total;
+    for(c=0; r >= w[c]; c++)
+        r -= w[c];
+    return c;
+}
+
+/*
+ * Give up on a TU whose connection has failed.
+ */
+static void lg_disconnect(LG_LOOP *lp, LG_TU *tu) {
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, tu->fd, NULL);
+    close(tu->fd);
+    tu->fd = -1;
+    tu->awaiting = 0;
+    lg_count(lp, LG_DISCONNECTS);
+    lg_schedule(lp, tu, UINT64_MAX);
+}
+
+/*
+ * Issue the next command of a TU, or give up on the response to its last
+ * one if that is what is due.
+ */
+static void lg_act(LG_LOOP *lp, LG_TU *tu, uint64_t now) {
+    char line[64];
+    TU_COMMAND cmd;
+    int len, ext;
+    ssize_t n;
+
+    if(tu->awaiting){
+        lg_count(lp, LG_TIMEOUTS);
+        tu->awaiting = 0;
+        tu->expected = next_states[tu->state][DELAY_COMMAND];
+    }
+    switch(cmd = lg_choose(tu)){
+        case TU_DIAL_CMD:
+            ext = extensions[rand_r(&tu->seed) % nextensions];
+            len = snprintf(line, sizeof(line), "%s %d%s", tu_command_names[cmd], ext, EOL);
+            break;
+        case TU_CHAT_CMD:
+            len = snprintf(line, sizeof(line), "%s load from %d%s", tu_command_names[cmd],
+                           tu->extension, EOL);
+            break;
+        default:
+            len = snprintf(line, sizeof(line), "%s%s", tu_command_names[cmd], EOL);
+            break;
+    }
+    if((n = send(tu->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0
+       && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        lg_schedule(lp, tu, now + RETRY_NS);
+        return;
+    }
+    if(n != len){
+        lg_disconnect(lp, tu);
+        return;
+    }
+    tu->last_command = cmd;
+    tu->expected = next_states[tu->state][cmd];
+    tu->awaiting = 1;
+    tu->sent_ns = now;
+    lg_count(lp, LG_COMMANDS);
+    lg_schedule(lp, tu, now + RESPONSE_TIMEOUT_NS);
+}
+
+/*
+ * Handle one notification from the server, with its EOL stripped.
+ */
+static void lg_notification(LG_LOOP *lp, LG_TU *tu, char *msg, uint64_t now) {
+    TU_STATE new;
+
+    lg_count(lp, LG_NOTIFICATIONS);
+    if(strncmp(msg, "CHAT", 4) == 0){
+        lg_count(lp, LG_CHATS);
+        return;
+    }
+    for(new=0; new<TU_NUM_STATES; new++){
+        if(strncmp(msg, tu_state_names[new], state_name_len[new]) == 0
+           && (msg[state_name_len[new]] == ' ' || msg[state_name_len[new]] == '\0'))
+            break;
+    }
+    if(new == TU_NUM_STATES){
+        lg_count(lp, LG_UNEXPECTED);
+        return;
+    }
+
+    if(1 << new & tu->expected){
+        // The response to the last command, if one was awaited.
+        if(tu->awaiting){
+            hist_record(&lp->latency, now - tu->sent_ns);
+            if(tu->last_command == TU_PICKUP_CMD && new == TU_CONNECTED)
+                lg_count(lp, LG_CALLS);
+            tu->awaiting = 0;
+            tu->expected = next_states[new][DELAY_COMMAND];
+            lg_schedule(lp, tu, now + lg_think(tu));
+        }
+    }
+    else{
+        // Crossed in transit with the last command, or not allowed by the model.
+        lg_count(lp, (1 << (new + RESYNC) & tu->expected) ? LG_RESYNCS : LG_UNEXPECTED);
+        tu->expected = next_states[new][tu->awaiting ? tu->last_command : DELAY_COMMAND];
+    }
+    tu->state = new;
+}
+
+/*
+ * Read what the server has sent a TU and handle each complete line.
+ */
+static void lg_read(LG_LOOP *lp, LG_TU *tu, uint64_t now) {
+    char *start, *nl;
+    ssize_t n;
+
+    while(tu->fd >= 0){
+        if((n = read(tu->fd, tu->in + tu->inlen, sizeof(tu->in) - tu->inlen)) <= 0){
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if(n < 0 && errno == EINTR)
+                continue;
+            lg_disconnect(lp, tu);
+            return;
+        }
+        tu->inlen += n;
+        start = tu->in;
+        while((nl = memchr(start, '\n', tu->in + tu->inlen - start)) != NULL){
+            *nl = '\0';
+            if(nl > start && nl[-1] == '\r')
+                nl[-1] = '\0';
+            lg_notification(lp, tu, start, now);
+            start = nl + 1;
+        }
+        tu->inlen -= start - tu->in;
+        memmove(tu->in, start, tu->inlen);
+        if(tu->inlen == sizeof(tu->in))
+            tu->inlen = 0;      // An overlong chat; drop it.
+    }
+}
+
+/*
+ * Thread function for an event loop, which runs until the end of the test.
+ */
+static void *lg_loop_thread(void *arg) {
+    LG_LOOP *lp = arg;
+    struct epoll_event evs[MAX_EVENTS];
+    uint64_t now = now_ns(), due;
+    int i, n, timeout;
+
+    while(now < end_ns){
+        due = lp->ntus > 0 && lp->heap[0]->due_ns < end_ns ? lp->heap[0]->due_ns : end_ns;
+        timeout = due > now ? (due - now + 999999) / 1000000 : 0;
+        if((n = epoll_wait(lp->epfd, evs, MAX_EVENTS, timeout)) < 0 && errno != EINTR){
+            perror("epoll_wait");
+            break;
+        }
+        now = now_ns();
+        for(i=0; i<n; i++)
+            lg_read(lp, evs[i].data.ptr, now);
+        while(lp->ntus > 0 && lp->heap[0]->due_ns <= now)
+            lg_act(lp, lp->heap[0], now);
+    }
+    return NULL;
+}
+
+/*
+ * Connect a TU to the server and learn its extension from the first
+ * notification.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int lg_connect(LG_TU *tu, struct addrinfo *ai) {
+    char line[MAX_LINE];
+    size_t len = 0;
+    ssize_t n;
+    int one = 1;
+
+    if((tu->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+        return -1;
+    if(connect(tu->fd, ai->ai_addr, ai->ai_addrlen) < 0){
+        close(tu->fd);
+        return -1;
+    }
+    while(len < sizeof(line) - 1 && memchr(line, '\n', len) == NULL){
+        if((n = read(tu->fd, line + len, sizeof(line) - 1 - len)) <= 0){
+            close(tu->fd);
+            return -1;
+        }
+        len += n;
+    }
+    line[len] = '\0';
+    if(strncmp(line, tu_state_names[TU_ON_HOOK], state_name_len[TU_ON_HOOK]) != 0){
+        close(tu->fd);
+        return -1;
+    }
+    tu->extension = atoi(line + state_name_len[TU_ON_HOOK]);
+    tu->state = TU_ON_HOOK;
+    tu->last_command = TU_HANGUP_CMD;
+    tu->expected = next_states[TU_ON_HOOK][DELAY_COMMAND];
+    setsockopt(tu->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(tu->fd, F_SETFL, fcntl(tu->fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * Parse a command mix, e.g. "30:30:20:20" for pickup:dial:chat:hangup.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int lg_parse_mix(char *s) {
+    int w[TU_NUM_COMMANDS], order[] = { TU_PICKUP_CMD, TU_DIAL_CMD, TU_CHAT_CMD, TU_HANGUP_CMD };
+    int i, total = 0;
+    char *end;
+
+    for(i=0; i<TU_NUM_COMMANDS; i++){
+        w[order[i]] = strtol(s, &end, 10);
+        if(end == s || w[order[i]] < 0 || *end != (i < TU_NUM_COMMANDS - 1 ? ':' : '\0'))
+            return -1;
+        total += w[order[i]];
+        s = end + 1;
+    }
+    if(total == 0)
+        return -1;
+    memcpy(weights, w, sizeof(weights));
+    return 0;
+}
+
+/*
+ * Sum a counter over all loops.
+ */
+static unsigned long lg_total(LG_LOOP *loops, int nloops, LG_COUNTER c) {
+    unsigned long sum = 0;
+    int i;
+    for(i=0; i<nloops; i++)
+        sum += atomic_load_explicit(&loops[i].counters[c], memory_order_relaxed);
+    return sum;
+}
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost", *port = "9999";
+    int ntus = 100, nloops = 1, seconds = 10;
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai;
+    struct rlimit rl;
+    struct epoll_event ev;
+    LG_LOOP *loops;
+    LG_TU *tus;
+    HIST latency;
+    uint64_t start, now;
+    unsigned long last_commands = 0, last_calls = 0, commands, calls;
+    int opt, i, s, err;
+
+    while((opt = getopt(argc, argv, "h:p:n:t:d:m:k:a")) != -1){
+        switch(opt){
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'n': ntus = atoi(optarg); break;
+            case 't': nloops = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'k': think_ms = atof(optarg); break;
+            case 'a': any_command = 1; break;
+            case 'm':
+                if(lg_parse_mix(optarg) == 0)
+                    break;
+                // Fall through.
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(ntus <= 0 || nloops <= 0 || seconds <= 0 || think_ms < 0){
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(nloops > ntus)
+        nloops = ntus;
+    init_next_states();
+    for(s=0; s<TU_NUM_STATES; s++)
+        state_name_len[s] = strlen(tu_state_names[s]);
+
+    // Each TU needs a descriptor.
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < ntus + 64){
+        rl.rlim_cur = rl.rlim_max < ntus + 64 ? rl.rlim_max : ntus + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if((err = getaddrinfo(host, port, &hints, &ai)) != 0){
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+    if((tus = calloc(ntus, sizeof(LG_TU))) == NULL || (extensions = calloc(ntus, sizeof(int))) == NULL
+       || (loops = calloc(nloops, sizeof(LG_LOOP))) == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Connecting %d TUs to %s:%s...\n", ntus, host, port);
+    for(i=0; i<ntus; i++){
+        if(lg_connect(&tus[i], ai) < 0){
+            fprintf(stderr, "Failed to connect TU %d: %s\n", i, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        tus[i].seed = i + 1;
+        extensions[nextensions++] = tus[i].extension;
+    }
+    freeaddrinfo(ai);
+
+    // Deal the TUs out to the loops, each to act after a first think.
+    start = now_ns();
+    end_ns = start + seconds * 1000000000ULL;
+    for(i=0; i<nloops; i++){
+        if((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+           || (loops[i].heap = calloc(ntus / nloops + 1, sizeof(LG_TU *))) == NULL){
+            perror("epoll_create1");
+            return EXIT_FAILURE;
+        }
+    }
+    for(i=0; i<ntus; i++){
+        LG_LOOP *lp = &loops[i % nloops];
+        ev.events = EPOLLIN;
+        ev.data.ptr = &tus[i];
+        epoll_ctl(lp->epfd, EPOLL_CTL_ADD, tus[i].fd, &ev);
+        tus[i].heap_index = lp->ntus;
+        lp->heap[lp->ntus++] = &tus[i];
+        lg_schedule(lp, &tus[i], start + lg_think(&tus[i]));
+    }
+    for(i=0; i<nloops; i++)
+        pthread_create(&loops[i].tid, NULL, lg_loop_thread, &loops[i]);
+
+    // Report the rates over each second while the test runs.
+    fprintf(stderr, "%8s %12s %12s\n", "seconds", "commands/s", "calls/s");
+    for(s=1; s<=seconds; s++){
+        struct timespec ts = { .tv_sec = (start + s * 1000000000ULL) / 1000000000ULL,
+                               .tv_nsec = (start + s * 1000000000ULL) % 1000000000ULL };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        commands = lg_total(loops, nloops, LG_COMMANDS);
+        calls = lg_total(loops, nloops, LG_CALLS);
+        fprintf(stderr, "%8d %12lu %12lu\n", s, commands - last_commands, calls - last_calls);
+        last_commands = commands;
+        last_calls = calls;
+    }
+    for(i=0; i<nloops; i++)
+        pthread_join(loops[i].tid, NULL);
+    now = now_ns();
+
+    hist_reset(&latency);
+    for(i=0; i<nloops; i++)
+        hist_merge(&latency, &loops[i].latency);
+    printf("%d TUs, %d threads, %.1f s, think %.1f ms, mix pickup:dial:chat:hangup %d:%d:%d:%d%s\n",
+           ntus, nloops, (now - start) / 1e9, think_ms, weights[TU_PICKUP_CMD],
+           weights[TU_DIAL_CMD], weights[TU_CHAT_CMD], weights[TU_HANGUP_CMD],
+           any_command ? " (any state)" : "");
+    printf("%-16s %12.1f\n", "commands/s", lg_total(loops, nloops, LG_COMMANDS) / ((now - start) / 1e9));
+    printf("%-16s %12.1f\n", "calls/s", lg_total(loops, nloops, LG_CALLS) / ((now - start) / 1e9));
+    for(i=0; i<LG_NUM_COUNTERS; i++)
+        printf("%-16s %12lu\n", lg_counter_names[i], lg_total(loops, nloops, i));
+    printf("%-16s %12lu\n", "responses", atomic_load(&latency.count));
+    printf("latency (us)     p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           hist_quantile(&latency, 0.5) / 1e3, hist_quantile(&latency, 0.9) / 1e3,
+           hist_quantile(&latency, 0.99) / 1e3, hist_quantile(&latency, 0.999) / 1e3,
+           atomic_load(&latency.max) / 1e3);
+
+    for(i=0; i<ntus; i++)
+        if(tus[i].fd >= 0)
+            close(tus[i].fd);
+    return lg_total(loops, nloops, LG_UNEXPECTED) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,52 @@
+/*
+ * Stand-ins for the functions our modules have beyond the interfaces in
+ * pbx.h, tu.h and server.h, for servers in which one module is taken from
+ * the reference archive (lib/pbx.a) instead of src/.  The reference module
+ * has none of them, but the rest of our server calls them.
+ *
+ * Every definition here is weak, so that wherever our own module is linked
+ * its functions win.  None of them defines a function of the reference
+ * interfaces: those must stay undefined, so that the linker takes them
+ * from the archive.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "pbx_extra.h"
+#include "tu_extra.h"
+#include "server_extra.h"
+
+#define WEAK __attribute__((weak))
+
+/*
+ * With the reference pbx.o, the registry is the reference's fixed table of
+ * PBX_MAX_EXTENSIONS, indexed by file descriptor.
+ */
+WEAK int pbx_set_max_extensions(int max) { return 0; }
+WEAK int pbx_get_max_extensions(void) { return PBX_MAX_EXTENSIONS; }
+WEAK int pbx_dump_queues(PBX *pbx, FILE *out) { return 0; }
+
+/*
+ * With the reference tu.o, output is written directly and never queued, so
+ * there is nothing to bound, report or shut down.
+ */
+WEAK void tu_unplug(TU *tu) { }
+WEAK void tu_disconnect(TU *tu) { }
+WEAK int tu_report(TU *tu) { return 0; }
+WEAK int tu_report_leaks(FILE *out) { return 0; }
+WEAK int tu_pool_stats(SLAB_STATS *st) { return -1; }
+WEAK int tu_set_output_limit(size_t hiwat, TU_OUTPUT_POLICY policy) { return 0; }
+WEAK void tu_output_stats(TU *tu, TU_OUTPUT_STATS *st) { memset(st, 0, sizeof(*st)); }
+WEAK void tu_output_shutdown(void) { }
+
+/*
+ * The reference server.o has only the thread-per-client service function;
+ * the epoll and pool servers need ours.
+ */
+static void no_server(void) {
+    fprintf(stderr, "Only the thread-per-client server (-m thread) is available with the reference server\n");
+    exit(EXIT_FAILURE);
+}
+
+WEAK void pbx_client_dispatch(TU *tu, char *line, size_t len) { no_server(); }
+WEAK void pbx_client_serve(int client_fd) { no_server(); }
@@ -0,0 +1,553 @@
+/*
+ * Replay of traffic captured by the PBX server (pbx -c, see capture.h).
+ *
+ * Each connection in the capture is re-created against a server, and the
+ * lines its client sent are sent again: at the times they were captured
+ * (scaled by a speed factor), or with -f as fast as possible.  Either way,
+ * before a line is sent the replay waits until every connection has
+ * received as many notifications as it had at that point in the capture,
+ * so that the server gets each command in the same state as it did then;
+ * a wait that runs out is counted as a stall, and the replay goes on.  Extensions are
+ * assigned afresh by the server, so dialed extensions are translated from
+ * those of the capture to those of the replay.
+ *
+ * At the end, the notifications received by each connection are compared
+ * with those it received in the capture, with extensions in them replaced
+ * by connection ids, and the time from each command to the first
+ * notification that followed is compared as well.  The exit status is
+ * nonzero if any connection's notifications differed.
+ *
+ * With -l, the capture is listed as text instead.
+ *
+ * Usage: pbx_replay [-h <host>] [-p <port>] [-s <speed> | -f] [-w <wait ms>] <capture file>
+ *        pbx_replay -l <capture file>
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "server_extra.h"
+#include "hist.h"
+#include "capture.h"
+
+#define USAGE "usage: %s [-h <host>] [-p <port>] [-s <speed> | -f] [-w <wait ms>] <capture file>\n" \
+              "       %s -l <capture file>\n"
+
+#define MAX_LINE 1024
+#define MAX_EVENTS 64
+
+/* Mismatches to print. */
+#define MAX_SHOWN 10
+
+/* A list of notifications, with extensions replaced by connection ids. */
+typedef struct {
+    char **lines;
+    int n, cap;
+}RP_LIST;
+
+/* One connection of the capture, and its counterpart in the replay. */
+typedef struct {
+    int fd;                     /* In the replay, or -1 */
+    int open;                   /* Set while the capture has it open */
+    RP_LIST cap, rp;            /* Notifications in the capture and in the replay */
+    int cap_waiting;            /* Set while a command awaits a notification */
+    int rp_waiting;
+    uint64_t cap_sent_ns;       /* When that command was sent */
+    uint64_t rp_sent_ns;
+    size_t inlen;
+    char in[MAX_LINE];
+}RP_CONN;
+
+/* Table from extension to connection id, for the capture or the replay. */
+typedef struct {
+    uint32_t *conns;
+    int n;
+}RP_EXTMAP;
+
+static RP_CONN *conns;
+static uint32_t nconns;
+static RP_EXTMAP cap_exts, rp_exts;
+static int epfd;
+static HIST cap_latency, rp_latency;
+static unsigned long stalls, commands;
+static int behind;              /* Connections with fewer notifications than in the capture */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *xrealloc(void *p, size_t size) {
+    if((p = realloc(p, size)) == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void extmap_set(RP_EXTMAP *m, int ext, uint32_t conn) {
+    int n;
+    if(ext < 0)
+        return;
+    if(ext >= m->n){
+        for(n = m->n ? m->n : 64; n <= ext; n *= 2)
+            ;
+        m->conns = xrealloc(m->conns, n * sizeof(uint32_t));
+        memset(m->conns + m->n, 0, (n - m->n) * sizeof(uint32_t));
+        m->n = n;
+    }
+    m->conns[ext] = conn;
+}
+
+static uint32_t extmap_get(RP_EXTMAP *m, int ext) {
+    return ext >= 0 && ext < m->n ? m->conns[ext] : 0;
+}
+
+/*
+ * Find the extension of a connection.
+ *
+ * @return the extension, or -1 if it is not known.
+ */
+static int extmap_find(RP_EXTMAP *m, uint32_t conn) {
+    int ext;
+    for(ext=0; ext<m->n; ext++)
+        if(m->conns[ext] == conn)
+            return ext;
+    return -1;
+}
+
+/*
+ * Whether a connection open in the replay has yet to receive notifications
+ * that it had by now in the capture.
+ */
+static int lagging(RP_CONN *c) {
+    return c->fd >= 0 && c->rp.n < c->cap.n;
+}
+
+/*
+ * Account for a change to a connection that may have changed lagging().
+ *
+ * @param was  What lagging() was before the change.
+ */
+static void note_lag(RP_CONN *c, int was) {
+    behind += lagging(c) - was;
+}
+
+static RP_CONN *conn_get(uint32_t id) {
+    uint32_t n;
+    if(id >= nconns){
+        for(n = nconns ? nconns : 64; n <= id; n *= 2)
+            ;
+        conns = xrealloc(conns, n * sizeof(RP_CONN));
+        memset(conns + nconns, 0, (n - nconns) * sizeof(RP_CONN));
+        for(; nconns<n; nconns++)
+            conns[nconns].fd = -1;
+    }
+    return &conns[id];
+}
+
+/*
+ * Add a notification to a list, with the extension in it replaced by a
+ * connection id (e.g. "CONNECTED 7" becomes "CONNECTED #3"), and note the
+ * extension of the receiving connection if the notification gives it.
+ */
+static void list_add(RP_LIST *l, RP_EXTMAP *m, uint32_t conn, const char *text, size_t len) {
+    char line[MAX_LINE + 32];
+    size_t hook = strlen(tu_state_names[TU_ON_HOOK]), conn_len = strlen(tu_state_names[TU_CONNECTED]);
+
+    if(len > MAX_LINE)
+        len = MAX_LINE;
+    if(len > hook && strncmp(text, tu_state_names[TU_ON_HOOK], hook) == 0 && text[hook] == ' '){
+        extmap_set(m, atoi(text + hook + 1), conn);
+        snprintf(line, sizeof(line), "%s", tu_state_names[TU_ON_HOOK]);
+    }
+    else if(len > conn_len && strncmp(text, tu_state_names[TU_CONNECTED], conn_len) == 0
+            && text[conn_len] == ' ')
+        snprintf(line, sizeof(line), "%s #%u", tu_state_names[TU_CONNECTED],
+                 extmap_get(m, atoi(text + conn_len + 1)));
+    else
+        snprintf(line, sizeof(line), "%.*s", (int)len, text);
+    if(l->n == l->cap){
+        l->cap = l->cap ? 2 * l->cap : 16;
+        l->lines = xrealloc(l->lines, l->cap * sizeof(char *));
+    }
+    if((l->lines[l->n++] = strdup(line)) == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Stop replaying a connection.
+ */
+static void rp_close(uint32_t id) {
+    RP_CONN *c = &conns[id];
+    int ext = extmap_find(&rp_exts, id), was = lagging(c);
+
+    if(c->fd < 0)
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    note_lag(c, was);
+    if(ext >= 0)
+        extmap_set(&rp_exts, ext, 0);
+}
+
+/*
+ * Read what the server has sent a connection.
+ */
+static void rp_read(uint32_t id, uint64_t now) {
+    RP_CONN *c = &conns[id];
+    char *start, *nl;
+    ssize_t n;
+
+    while(c->fd >= 0){
+        if((n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen)) <= 0){
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if(n < 0 && errno == EINTR)
+                continue;
+            rp_close(id);
+            return;
+        }
+        c->inlen += n;
+        start = c->in;
+        while((nl = memchr(start, '\n', c->in + c->inlen - start)) != NULL){
+            int was = lagging(c);
+            list_add(&c->rp, &rp_exts, id, start, nl > start && nl[-1] == '\r' ? nl - 1 - start : nl - start);
+            note_lag(c, was);
+            if(c->rp_waiting){
+                hist_record(&rp_latency, now - c->rp_sent_ns);
+                c->rp_waiting = 0;
+            }
+            start = nl + 1;
+        }
+        c->inlen -= start - c->in;
+        memmove(c->in, start, c->inlen);
+        if(c->inlen == sizeof(c->in))
+            c->inlen = 0;
+    }
+}
+
+/*
+ * Read the notifications that arrive before a deadline, or if stop is set,
+ * only the first that do.
+ *
+ * @return the time at which it returned.
+ */
+static uint64_t pump_some(uint64_t until, int stop) {
+    struct epoll_event evs[MAX_EVENTS];
+    uint64_t now;
+    int i, n;
+
+    do{
+        now = now_ns();
+        n = epoll_wait(epfd, evs, MAX_EVENTS, until > now ? (until - now + 999999) / 1000000 : 0);
+        now = now_ns();
+        for(i=0; i<n; i++)
+            rp_read(evs[i].data.u32, now);
+    }while(now < until && !(stop && n > 0));
+    return now;
+}
+
+/*
+ * Read notifications until a deadline.
+ */
+static void pump(uint64_t until) {
+    pump_some(until, 0);
+}
+
+/*
+ * Read notifications until a connection has received a number of them, or
+ * a deadline passes.
+ *
+ * @return 0 if it did, -1 if the deadline passed.
+ */
+static int pump_until(RP_CONN *c, int count, uint64_t deadline) {
+    while(c->rp.n < count && c->fd >= 0){
+        if(pump_some(deadline, 1) >= deadline && c->rp.n < count && c->fd >= 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read notifications until no connection lags the capture, or a deadline
+ * passes.
+ *
+ * @param except  A connection to disregard, or NULL.
+ * @return 0 if none does, -1 if the deadline passed.
+ */
+static int pump_all(uint64_t deadline, RP_CONN *except) {
+    while(behind - (except != NULL && lagging(except)) > 0){
+        if(pump_some(deadline, 1) >= deadline && behind - (except != NULL && lagging(except)) > 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int rp_connect(uint32_t id, struct addrinfo *ai) {
+    RP_CONN *c = &conns[id];
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = id };
+    int one = 1;
+
+    if((c->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+        return -1;
+    if(connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0){
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+/*
+ * Send a captured line on a connection, translating the extension of a
+ * dial from the capture to the replay.  Only a line that the server parses
+ * as a dial is translated; any other line, malformed dials included, is
+ * sent as it was captured.
+ */
+static void rp_send(uint32_t id, char *text, size_t len, uint64_t wait_ns) {
+    RP_CONN *c = &conns[id];
+    char line[MAX_LINE + 32], *msg;
+    uint32_t target;
+    int n, ext, cap_ext;
+
+    if(len > MAX_LINE)
+        len = MAX_LINE;
+    memcpy(line, text, len);
+    line[len] = '\0';
+    if(pbx_client_parse(line, len, &msg, &cap_ext) == TU_DIAL_CMD){
+        // An extension that no connection had is sent as one that no TU can have.
+        ext = INT_MAX;
+        if((target = extmap_get(&cap_exts, cap_ext)) != 0){
+            pump_until(&conns[target], 1, now_ns() + wait_ns);
+            if((ext = extmap_find(&rp_exts, target)) < 0)
+                ext = INT_MAX;
+        }
+        n = snprintf(line, sizeof(line), "%s %d%s", tu_command_names[TU_DIAL_CMD], ext, EOL);
+    }
+    else
+        n = snprintf(line, sizeof(line), "%.*s%s", (int)len, text, EOL);
+    if(c->fd < 0 || send(c->fd, line, n, MSG_NOSIGNAL) != n)
+        return;
+    c->rp_waiting = 1;
+    c->rp_sent_ns = now_ns();
+}
+
+/*
+ * Read one record, and its text, from a capture.
+ *
+ * @return 1 if a record was read, 0 at the end of the capture.
+ */
+static int read_record(FILE *in, CAPTURE_RECORD *rec, char *text) {
+    if(fread(rec, sizeof(*rec), 1, in) != 1)
+        return 0;
+    if(fread(text, 1, rec->len, in) != rec->len)
+        return 0;
+    text[rec->len] = '\0';
+    return 1;
+}
+
+/*
+ * List a capture as text.
+ */
+static void list_capture(FILE *in) {
+    static char *types[] = { "?", "connect", "command", "notify", "disconnect" };
+    static char text[CAPTURE_MAX_TEXT + 1];
+    CAPTURE_RECORD rec;
+
+    while(read_record(in, &rec, text))
+        printf("%14.6f %8u %-10s %s\n", rec.ns / 1e9, rec.conn,
+               rec.type <= CAPTURE_DISCONNECT ? types[rec.type] : types[0], text);
+}
+
+/*
+ * Compare the notifications of each connection in the capture and in the
+ * replay, and print a summary.
+ *
+ * @return the number of connections whose notifications differed.
+ */
+static int compare(double cap_secs, double rp_secs) {
+    unsigned long ncap = 0, nrp = 0, differ = 0;
+    int same = 0, total = 0, shown = 0, i;
+    uint32_t id;
+
+    for(id=1; id<nconns; id++){
+        RP_CONN *c = &conns[id];
+        int n = c->cap.n < c->rp.n ? c->cap.n : c->rp.n, bad = 0;
+
+        if(c->cap.n == 0 && c->rp.n == 0)
+            continue;
+        total++;
+        ncap += c->cap.n;
+        nrp += c->rp.n;
+        for(i=0; i<n; i++){
+            if(strcmp(c->cap.lines[i], c->rp.lines[i]) == 0)
+                continue;
+            if(bad++ == 0 && shown++ < MAX_SHOWN)
+                printf("connection %u, notification %d: captured \"%s\", replayed \"%s\"\n",
+                       id, i + 1, c->cap.lines[i], c->rp.lines[i]);
+        }
+        if(c->cap.n != c->rp.n && bad == 0 && shown++ < MAX_SHOWN)
+            printf("connection %u: %d notifications captured, %d replayed\n", id, c->cap.n, c->rp.n);
+        bad += abs(c->cap.n - c->rp.n);
+        differ += bad;
+        if(bad == 0)
+            same++;
+    }
+    printf("%-28s %12s %12s\n", "", "capture", "replay");
+    printf("%-28s %12.3f %12.3f\n", "seconds", cap_secs, rp_secs);
+    printf("%-28s %12lu %12lu\n", "commands", commands, commands);
+    printf("%-28s %12lu %12lu\n", "notifications", ncap, nrp);
+    printf("%-28s %12.1f %12.1f\n", "response p50 (us)", hist_quantile(&cap_latency, 0.5) / 1e3,
+           hist_quantile(&rp_latency, 0.5) / 1e3);
+    printf("%-28s %12.1f %12.1f\n", "response p99 (us)", hist_quantile(&cap_latency, 0.99) / 1e3,
+           hist_quantile(&rp_latency, 0.99) / 1e3);
+    printf("%-28s %12.1f %12.1f\n", "response max (us)", atomic_load(&cap_latency.max) / 1e3,
+           atomic_load(&rp_latency.max) / 1e3);
+    printf("(in the capture, from a command to a notification inside the server;\n"
+           " in the replay, the round trip seen by the client)\n");
+    printf("connections matching: %d of %d; notifications differing: %lu; stalls: %lu\n",
+           same, total, differ, stalls);
+    return total - same;
+}
+
+int main(int argc, char *argv[]) {
+    static char text[CAPTURE_MAX_TEXT + 1];
+    char *host = "localhost", *port = "9999";
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai;
+    uint64_t wait_ns = 1000000000ULL, start, first_ns = 0, last_ns = 0, due;
+    double speed = 1;
+    int opt, fast = 0, list = 0, err, started = 0;
+    CAPTURE_HEADER hdr;
+    CAPTURE_RECORD rec;
+    RP_CONN *c;
+    FILE *in;
+
+    while((opt = getopt(argc, argv, "h:p:s:fw:l")) != -1){
+        switch(opt){
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 's': speed = atof(optarg); break;
+            case 'f': fast = 1; break;
+            case 'w': wait_ns = atol(optarg) * 1000000ULL; break;
+            case 'l': list = 1; break;
+            default:
+                fprintf(stderr, USAGE, argv[0], argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(optind != argc - 1 || speed <= 0){
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    if((in = fopen(argv[optind], "r")) == NULL){
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != CAPTURE_MAGIC
+       || hdr.version != CAPTURE_VERSION){
+        fprintf(stderr, "%s: not a PBX capture of this version\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if(list){
+        list_capture(in);
+        return EXIT_SUCCESS;
+    }
+
+    if((err = getaddrinfo(host, port, &hints, &ai)) != 0){
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+    if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        perror("epoll_create1");
+        return EXIT_FAILURE;
+    }
+    hist_reset(&cap_latency);
+    hist_reset(&rp_latency);
+
+    start = now_ns();
+    while(read_record(in, &rec, text)){
+        if(!started){
+            first_ns = rec.ns;
+            started = 1;
+        }
+        last_ns = rec.ns;
+        c = conn_get(rec.conn);
+
+        // Notifications are only noted: they are what the replay should produce.
+        if(rec.type == CAPTURE_NOTIFY){
+            int was = lagging(c);
+            list_add(&c->cap, &cap_exts, rec.conn, text, rec.len);
+            note_lag(c, was);
+            if(c->cap_waiting){
+                hist_record(&cap_latency, rec.ns - c->cap_sent_ns);
+                c->cap_waiting = 0;
+            }
+            continue;
+        }
+        if(!fast){
+            due = start + (rec.ns - first_ns) / speed;
+            if(due > now_ns())
+                pump(due);
+        }
+        pump(0);
+        switch(rec.type){
+            case CAPTURE_CONNECT:
+                c->open = 1;
+                if(rp_connect(rec.conn, ai) < 0){
+                    fprintf(stderr, "Failed to connect for connection %u: %s\n", rec.conn, strerror(errno));
+                    return EXIT_FAILURE;
+                }
+                break;
+            case CAPTURE_COMMAND:
+                if(pump_all(now_ns() + wait_ns, NULL) < 0)
+                    stalls++;
+                rp_send(rec.conn, text, rec.len, wait_ns);
+                c->cap_waiting = 1;
+                c->cap_sent_ns = rec.ns;
+                commands++;
+                break;
+            case CAPTURE_DISCONNECT:
+                // The client closed, and the server may notify it while it
+                // unregisters the TU; read until the server closes too.
+                if(pump_all(now_ns() + wait_ns, c) < 0)
+                    stalls++;
+                c->open = 0;
+                if(c->fd >= 0)
+                    shutdown(c->fd, SHUT_WR);
+                if(pump_until(c, INT_MAX, now_ns() + wait_ns) < 0){
+                    stalls++;
+                    rp_close(rec.conn);
+                }
+                extmap_set(&cap_exts, extmap_find(&cap_exts, rec.conn), 0);
+                break;
+        }
+    }
+    fclose(in);
+    freeaddrinfo(ai);
+
+    // Wait for the last notifications to connections that were never closed.
+    for(rec.conn=1; rec.conn<nconns; rec.conn++)
+        if(conns[rec.conn].open)
+            pump_until(&conns[rec.conn], conns[rec.conn].cap.n, now_ns() + wait_ns);
+    return compare((last_ns - first_ns) / 1e9, (now_ns() - start) / 1e9) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
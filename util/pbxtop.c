@@ -0,0 +1,170 @@
+/*
+ * Live view of a PBX server, read from the shared-memory statistics segment
+ * that the server publishes when started with -s <shm name> (see shmstat.h).
+ * The server is never contacted: everything shown comes from the segment.
+ *
+ * The top of the screen shows the server-wide counters, with rates over
+ * the last refresh; below it is a table of registered extensions, with the
+ * state of each TU and the extension of its peer.
+ *
+ * Usage: pbxtop [-i <interval ms>] [-r <rows>] [-1] <shm name>
+ *   -i  Time between refreshes (default 1000 ms).
+ *   -r  Number of extensions to list (default 20, 0 for all).
+ *   -1  Print one snapshot, without clearing the screen, and exit.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pbx.h"
+#include "shmstat.h"
+
+#define USAGE "usage: %s [-i <interval ms>] [-r <rows>] [-1] <shm name>\n"
+
+/* A segment not refreshed for this long belongs to a server that is gone. */
+#define STALE_NS (4ULL * SHMSTAT_INTERVAL * 1000000)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Map a segment and check that its layout is the one we were built with.
+ *
+ * @return the segment, or NULL with a message printed.
+ */
+static SHMSTAT *open_segment(char *name) {
+    struct stat sb;
+    SHMSTAT *shm;
+    int fd;
+
+    if((fd = shm_open(name, O_RDONLY, 0)) < 0){
+        perror(name);
+        return NULL;
+    }
+    if(fstat(fd, &sb) < 0 || sb.st_size < sizeof(SHMSTAT)
+       || (shm = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        fprintf(stderr, "%s: not a PBX statistics segment\n", name);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    if(shm->magic != SHMSTAT_MAGIC || shm->version != SHMSTAT_VERSION
+       || shm->nstats != STAT_COUNT || shm->ncommands != TU_NUM_COMMANDS
+       || sb.st_size < sizeof(SHMSTAT) + (size_t)shm->nexts * sizeof(SHMSTAT_EXT)){
+        fprintf(stderr, "%s: not a PBX statistics segment of this version\n", name);
+        munmap(shm, sb.st_size);
+        return NULL;
+    }
+    return shm;
+}
+
+/*
+ * Print a rate, or a dash if there is no previous sample.
+ */
+static void print_rate(double delta, double secs) {
+    if(secs > 0)
+        printf(" %12.1f", delta / secs);
+    else
+        printf(" %12s", "-");
+}
+
+/*
+ * Print one view of the segment.
+ *
+ * @param prev  The counters of the previous view, or NULL if there is none.
+ */
+static void show(SHMSTAT *shm, SHMSTAT_COUNTERS *cur, SHMSTAT_COUNTERS *prev, int rows) {
+    double secs = prev != NULL && cur->updated_ns > prev->updated_ns
+        ? (cur->updated_ns - prev->updated_ns) / 1e9 : 0;
+    int limit = atomic_load_explicit(&shm->ext_limit, memory_order_relaxed);
+    int i, ext, state, peer, shown = 0;
+
+    printf("pbx pid %d%s   registered %ld   calls %ld   connections %ld   malformed %ld   evicted %ld\n",
+           shm->pid, now_ns() - cur->updated_ns > STALE_NS ? " (not running)" : "",
+           cur->stats[STAT_REGISTERED], cur->stats[STAT_CALLS], cur->stats[STAT_CONNECTIONS],
+           cur->stats[STAT_MALFORMED], cur->stats[STAT_EVICTIONS]);
+    for(i=0; i<TU_NUM_STATES; i++)
+        printf("%s%s %ld", i ? "   " : "", tu_state_names[i], cur->stats[STAT_TU_STATE + i]);
+    printf("\n\n%-10s %12s %12s\n", "", "total", "per second");
+    for(i=0; i<TU_NUM_COMMANDS; i++){
+        printf("%-10s %12lu", tu_command_names[i], cur->commands[i]);
+        print_rate(prev ? (double)cur->commands[i] - prev->commands[i] : 0, secs);
+        printf("\n");
+    }
+    printf("%-10s %12ld", "bytes in", cur->stats[STAT_BYTES_IN]);
+    print_rate(prev ? (double)cur->stats[STAT_BYTES_IN] - prev->stats[STAT_BYTES_IN] : 0, secs);
+    printf("\n%-10s %12ld", "bytes out", cur->stats[STAT_BYTES_OUT]);
+    print_rate(prev ? (double)cur->stats[STAT_BYTES_OUT] - prev->stats[STAT_BYTES_OUT] : 0, secs);
+
+    printf("\n\n%10s  %-12s %10s\n", "EXTENSION", "STATE", "PEER");
+    for(ext=0; ext<limit && ext<shm->nexts && (rows == 0 || shown < rows); ext++){
+        shmstat_read_ext(shm, ext, &state, &peer);
+        if(state < 0 || state >= TU_NUM_STATES)
+            continue;
+        if(peer >= 0)
+            printf("%10d  %-12s %10d\n", ext, tu_state_names[state], peer);
+        else
+            printf("%10d  %-12s %10s\n", ext, tu_state_names[state], "-");
+        shown++;
+    }
+    if(shown < cur->stats[STAT_REGISTERED])
+        printf("%10s  (%ld more)\n", "...", cur->stats[STAT_REGISTERED] - shown);
+}
+
+int main(int argc, char *argv[]) {
+    SHMSTAT_COUNTERS counters[2];
+    struct timespec interval;
+    int opt, once = 0, rows = 20, ms = 1000, n;
+    SHMSTAT *shm;
+
+    while((opt = getopt(argc, argv, "i:r:1")) != -1){
+        switch(opt){
+            case 'i':
+                if((ms = atoi(optarg)) <= 0){
+                    fprintf(stderr, USAGE, argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                if((rows = atoi(optarg)) < 0){
+                    fprintf(stderr, USAGE, argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case '1':
+                once = 1;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(optind != argc - 1){
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    if((shm = open_segment(argv[optind])) == NULL)
+        return EXIT_FAILURE;
+
+    interval.tv_sec = ms / 1000;
+    interval.tv_nsec = ms % 1000 * 1000000L;
+    for(n=0; ; n++){
+        shmstat_read_counters(shm, &counters[n % 2]);
+        if(!once)
+            printf("\033[H\033[2J");
+        show(shm, &counters[n % 2], n ? &counters[(n + 1) % 2] : NULL, rows);
+        fflush(stdout);
+        if(once)
+            break;
+        nanosleep(&interval, NULL);
+    }
+    return EXIT_SUCCESS;
+}